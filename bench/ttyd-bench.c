@@ -0,0 +1,421 @@
+// ttyd-bench: load generator for a local ttyd, speaking the same protocol as the web client
+#include <getopt.h>
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// client message
+#define INPUT '0'
+#define RESIZE_TERMINAL '1'
+
+// server message
+#define OUTPUT '0'
+
+enum workload { WORKLOAD_BULK, WORKLOAD_ECHO, WORKLOAD_RESIZE, WORKLOAD_CHURN };
+static const char *workload_names[] = {"bulk", "echo", "resize", "churn"};
+
+struct session {
+  struct lws *wsi;
+  bool handshake_sent;
+  bool ready;        // first OUTPUT received
+  bool command_sent;
+  bool waiting;      // echo sent, waiting for it to come back
+  bool backspace;    // whether the next echo probe erases the previous one
+  bool closed;
+  int resizes;
+  double start;      // connect or probe time (s)
+};
+
+struct stats {
+  uint64_t bytes_in;  // OUTPUT payload received
+  uint64_t frames_in;
+  uint64_t bytes_out;  // messages sent
+  uint64_t messages_out;
+  uint64_t connects;
+  uint64_t errors;
+  double *samples;  // latencies (s)
+  size_t nsamples;
+  size_t cap;
+};
+
+static struct lws_context *context;
+static struct session *sessions;
+static struct stats stats;
+static volatile sig_atomic_t tick = 0;
+static bool running = true;
+
+static struct {
+  char url[256];
+  const char *address;
+  const char *path;
+  int port;
+  bool ssl;
+  int sessions;
+  enum workload workload;
+  int duration;
+  const char *command;
+  const char *token;
+  int pid;
+  bool deflate;
+} opts;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_sample(double value) {
+  if (stats.nsamples == stats.cap) {
+    stats.cap = stats.cap ? stats.cap * 2 : 1024;
+    stats.samples = realloc(stats.samples, stats.cap * sizeof(double));
+    if (stats.samples == NULL) abort();
+  }
+  stats.samples[stats.nsamples++] = value;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+  if (stats.nsamples == 0) return 0;
+  size_t i = (size_t)(p * (stats.nsamples - 1) + 0.5);
+  return stats.samples[i];
+}
+
+// server cpu time (s) and rss (kB) from procfs
+static bool proc_sample(int pid, double *cpu, long *rss) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return false;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+
+  // fields after the command name, which may contain spaces
+  char *p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  long pages;
+  const char *fmt = "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld";
+  if (p == NULL || sscanf(p + 2, fmt, &utime, &stime, &pages) != 3) return false;
+  *cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+  *rss = pages * (sysconf(_SC_PAGESIZE) / 1024);
+  return true;
+}
+
+static void connect_session(struct session *s) {
+  struct lws_client_connect_info info;
+  memset(&info, 0, sizeof(info));
+  memset(s, 0, sizeof(struct session));
+  info.context = context;
+  info.address = opts.address;
+  info.port = opts.port;
+  info.path = opts.path;
+  info.host = opts.address;
+  info.origin = opts.address;
+  info.protocol = "tty";
+  info.userdata = s;
+  info.pwsi = &s->wsi;
+  if (opts.ssl) info.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+
+  s->start = now();
+  stats.connects++;
+  if (lws_client_connect_via_info(&info) == NULL) {
+    stats.errors++;
+    s->closed = true;
+  }
+}
+
+static int send_message(struct lws *wsi, const char *data, size_t len) {
+  unsigned char buf[LWS_PRE + 512];
+  if (len > sizeof(buf) - LWS_PRE) len = sizeof(buf) - LWS_PRE;
+  memcpy(buf + LWS_PRE, data, len);
+  if (lws_write(wsi, buf + LWS_PRE, len, LWS_WRITE_BINARY) < (int)len) return -1;
+  stats.bytes_out += len;
+  stats.messages_out++;
+  return 0;
+}
+
+static int session_writable(struct lws *wsi, struct session *s) {
+  char msg[512];
+  int n;
+
+  if (!s->handshake_sent) {
+    n = snprintf(msg, sizeof(msg), "{\"AuthToken\": \"%s\", \"columns\": 80, \"rows\": 24}", opts.token);
+    s->handshake_sent = true;
+    return send_message(wsi, msg, (size_t)n);
+  }
+  if (!s->ready) return 0;
+
+  switch (opts.workload) {
+    case WORKLOAD_BULK:
+      if (s->command_sent) break;
+      n = snprintf(msg, sizeof(msg), "%c%s\r", INPUT, opts.command);
+      s->command_sent = true;
+      return send_message(wsi, msg, (size_t)n);
+    case WORKLOAD_ECHO:
+      if (s->waiting) break;
+      msg[0] = INPUT;
+      msg[1] = s->backspace ? '\x7f' : 'x';
+      s->backspace = !s->backspace;
+      s->waiting = true;
+      s->start = now();
+      return send_message(wsi, msg, 2);
+    case WORKLOAD_RESIZE: {
+      int cols = s->resizes % 2 ? 80 : 120, rows = s->resizes % 2 ? 24 : 40;
+      s->resizes++;
+      n = snprintf(msg, sizeof(msg), "%c{\"columns\": %d, \"rows\": %d}", RESIZE_TERMINAL, cols, rows);
+      if (send_message(wsi, msg, (size_t)n) < 0) return -1;
+      lws_callback_on_writable(wsi);
+    } break;
+    case WORKLOAD_CHURN:
+      break;
+  }
+  return 0;
+}
+
+static int session_receive(struct lws *wsi, struct session *s, const char *in, size_t len) {
+  if (len == 0 || in[0] != OUTPUT) return 0;
+  stats.bytes_in += len - 1;
+  stats.frames_in++;
+
+  if (!s->ready) {
+    s->ready = true;
+    if (opts.workload == WORKLOAD_CHURN) {
+      add_sample(now() - s->start);
+      return -1;
+    }
+    lws_callback_on_writable(wsi);
+    return 0;
+  }
+
+  // the echo of x, or the "\b \b" erasing it
+  if (opts.workload == WORKLOAD_ECHO && s->waiting && memchr(in + 1, s->backspace ? 'x' : '\b', len - 1) != NULL) {
+    add_sample(now() - s->start);
+    s->waiting = false;
+    lws_callback_on_writable(wsi);
+  }
+  return 0;
+}
+
+static int callback_bench(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  struct session *s = (struct session *)user;
+
+  switch (reason) {
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      lws_callback_on_writable(wsi);
+      break;
+    case LWS_CALLBACK_CLIENT_WRITEABLE:
+      if (session_writable(wsi, s) < 0) return -1;
+      break;
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+      return session_receive(wsi, s, (const char *)in, len);
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      lwsl_err("connection error: %s\n", in ? (char *)in : "(null)");
+      stats.errors++;
+      // fall through
+    case LWS_CALLBACK_CLIENT_CLOSED:
+      if (s == NULL || s->closed) break;
+      s->closed = true;
+      s->wsi = NULL;
+      if (opts.workload == WORKLOAD_CHURN && running) connect_session(s);
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+static const struct lws_protocols protocols[] = {{"tty", callback_bench, 0, 0}, {NULL, NULL, 0, 0}};
+
+#ifndef LWS_WITHOUT_EXTENSIONS
+static const struct lws_extension extensions[] = {
+    {"permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_max_window_bits"},
+    {NULL, NULL, NULL}};
+#endif
+
+static void alarm_handler(int sig) {
+  tick++;
+  lws_cancel_service(context);
+}
+
+static void print_help() {
+  // clang-format off
+  fprintf(stderr, "ttyd-bench is a load generator for ttyd\n\n"
+          "USAGE:\n"
+          "    ttyd-bench [options] [<url>] (default: ws://127.0.0.1:7681/ws)\n\n"
+          "OPTIONS:\n"
+          "    -n, --sessions          Concurrent sessions (default: 1)\n"
+          "    -w, --workload          bulk, echo, resize or churn (default: bulk)\n"
+          "    -t, --duration          Seconds to run (default: 10)\n"
+          "    -x, --command           Input sent by the bulk workload (default: head -c 64000000 /dev/urandom | base64; exit)\n"
+          "    -c, --token             Auth token, the base64 encoded credential of the server\n"
+          "    -p, --pid               Pid of the ttyd server, to report its cpu and memory\n"
+          "    -z, --no-deflate        Do not negotiate permessage-deflate\n"
+          "    -d, --debug             Set log level (default: 3)\n"
+          "    -h, --help              Print this text and exit\n\n"
+          "WORKLOADS:\n"
+          "    bulk      every session sends the command once and reads its output until the server closes it\n"
+          "    echo      every session types and erases a character, waiting for each echo (reports latency)\n"
+          "    resize    every session sends resizes as fast as the socket takes them\n"
+          "    churn     every session reconnects once the first output arrives (reports connect latency)\n"
+  );
+  // clang-format on
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {{"sessions", required_argument, NULL, 'n'},
+                                          {"workload", required_argument, NULL, 'w'},
+                                          {"duration", required_argument, NULL, 't'},
+                                          {"command", required_argument, NULL, 'x'},
+                                          {"token", required_argument, NULL, 'c'},
+                                          {"pid", required_argument, NULL, 'p'},
+                                          {"no-deflate", no_argument, NULL, 'z'},
+                                          {"debug", required_argument, NULL, 'd'},
+                                          {"help", no_argument, NULL, 'h'},
+                                          {NULL, 0, 0, 0}};
+  int debug_level = LLL_ERR | LLL_WARN;
+  int c;
+
+  opts.sessions = 1;
+  opts.duration = 10;
+  opts.command = "head -c 64000000 /dev/urandom | base64; exit";
+  opts.token = "";
+  opts.deflate = true;
+  snprintf(opts.url, sizeof(opts.url), "%s", "ws://127.0.0.1:7681/ws");
+
+  while ((c = getopt_long(argc, argv, "n:w:t:x:c:p:zd:h", options, NULL)) != -1) {
+    switch (c) {
+      case 'n':
+        opts.sessions = atoi(optarg);
+        break;
+      case 'w': {
+        int i = 0;
+        while (i < 4 && strcmp(optarg, workload_names[i]) != 0) i++;
+        if (i == 4) {
+          fprintf(stderr, "ttyd-bench: unknown workload: %s\n", optarg);
+          return -1;
+        }
+        opts.workload = (enum workload)i;
+      } break;
+      case 't':
+        opts.duration = atoi(optarg);
+        break;
+      case 'x':
+        opts.command = optarg;
+        break;
+      case 'c':
+        opts.token = optarg;
+        break;
+      case 'p':
+        opts.pid = atoi(optarg);
+        break;
+      case 'z':
+        opts.deflate = false;
+        break;
+      case 'd':
+        debug_level = atoi(optarg);
+        break;
+      case 'h':
+        print_help();
+        return 0;
+      default:
+        print_help();
+        return -1;
+    }
+  }
+  if (optind < argc) snprintf(opts.url, sizeof(opts.url), "%s", argv[optind]);
+  if (opts.sessions <= 0 || opts.duration <= 0) {
+    fprintf(stderr, "ttyd-bench: sessions and duration must be positive\n");
+    return -1;
+  }
+
+  const char *prot, *path;
+  char url[256];
+  snprintf(url, sizeof(url), "%s", opts.url);
+  if (lws_parse_uri(url, &prot, &opts.address, &opts.port, &path)) {
+    fprintf(stderr, "ttyd-bench: invalid url: %s\n", opts.url);
+    return -1;
+  }
+  char full_path[256];
+  snprintf(full_path, sizeof(full_path), "/%s", path);
+  opts.path = full_path;
+  opts.ssl = strcmp(prot, "wss") == 0 || strcmp(prot, "https") == 0;
+
+  lws_set_log_level(debug_level, NULL);
+
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof(info));
+  info.port = CONTEXT_PORT_NO_LISTEN;
+  info.protocols = protocols;
+  info.gid = -1;
+  info.uid = -1;
+  info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+#ifndef LWS_WITHOUT_EXTENSIONS
+  if (opts.deflate) info.extensions = extensions;
+#endif
+  context = lws_create_context(&info);
+  if (context == NULL) {
+    fprintf(stderr, "ttyd-bench: libwebsockets context creation failed\n");
+    return 1;
+  }
+
+  signal(SIGALRM, alarm_handler);
+  struct itimerval timer = {{1, 0}, {1, 0}};
+  setitimer(ITIMER_REAL, &timer, NULL);
+
+  double cpu_start = 0, cpu_end = 0;
+  long rss = 0, rss_max = 0;
+  bool proc = opts.pid > 0 && proc_sample(opts.pid, &cpu_start, &rss);
+  if (opts.pid > 0 && !proc) fprintf(stderr, "ttyd-bench: can not read /proc/%d/stat\n", opts.pid);
+
+  sessions = calloc((size_t)opts.sessions, sizeof(struct session));
+  double start = now();
+  for (int i = 0; i < opts.sessions; i++) connect_session(&sessions[i]);
+
+  int last_tick = 0;
+  while (tick < opts.duration) {
+    lws_service(context, 0);
+    if (tick != last_tick) {
+      last_tick = tick;
+      if (proc && proc_sample(opts.pid, &cpu_end, &rss) && rss > rss_max) rss_max = rss;
+    }
+
+    // bulk sessions end when the command exits
+    int open = 0;
+    for (int i = 0; i < opts.sessions; i++) open += !sessions[i].closed;
+    if (open == 0) break;
+  }
+  double elapsed = now() - start;
+  if (proc) proc_sample(opts.pid, &cpu_end, &rss);
+  running = false;  // no more reconnects
+
+  qsort(stats.samples, stats.nsamples, sizeof(double), compare_double);
+
+  printf("workload: %s, sessions: %d, duration: %.2f s\n", workload_names[opts.workload], opts.sessions, elapsed);
+  printf("received: %.2f MB (%.2f MB/s), %llu frames\n", stats.bytes_in / 1e6, stats.bytes_in / 1e6 / elapsed,
+         (unsigned long long)stats.frames_in);
+  printf("sent: %.2f MB, %llu messages (%.0f/s)\n", stats.bytes_out / 1e6, (unsigned long long)stats.messages_out,
+         stats.messages_out / elapsed);
+  printf("connects: %llu, errors: %llu\n", (unsigned long long)stats.connects, (unsigned long long)stats.errors);
+  if (stats.nsamples > 0)
+    printf("latency: %zu samples, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", stats.nsamples, percentile(0.5) * 1000,
+           percentile(0.99) * 1000, stats.samples[stats.nsamples - 1] * 1000);
+  if (proc)
+    printf("server: cpu %.1f%%, rss %.1f MB (max %.1f MB)\n", (cpu_end - cpu_start) / elapsed * 100, rss / 1024.0,
+           (rss_max > rss ? rss_max : rss) / 1024.0);
+
+  lws_context_destroy(context);
+  free(sessions);
+  free(stats.samples);
+  return 0;
+}
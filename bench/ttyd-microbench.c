@@ -0,0 +1,263 @@
+// ttyd-microbench: micro-benchmarks of the protocol encode/decode paths
+//
+// The sources are included so their static functions can be called directly; the libwebsockets calls that need a
+// live connection are replaced by the stubs below.
+#include <getopt.h>
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int bench_write(struct lws *wsi, unsigned char *buf, size_t len, enum lws_write_protocol wp);
+static int bench_hdr_copy(struct lws *wsi, char *dest, int len, enum lws_token_indexes h);
+static size_t bench_remaining_packet_payload(struct lws *wsi);
+static int bench_is_final_fragment(struct lws *wsi);
+
+#define lws_write bench_write
+#define lws_hdr_copy bench_hdr_copy
+#define lws_remaining_packet_payload bench_remaining_packet_payload
+#define lws_is_final_fragment bench_is_final_fragment
+#include "../src/protocol.c"
+#define check_auth http_check_auth
+#include "../src/http.c"
+#undef check_auth
+
+volatile bool force_exit = false;
+struct lws_context *context;
+struct server *server;
+struct endpoints endpoints = {"/ws", "/", "/token", "", "/playback", "/metrics"};
+
+static volatile size_t sink;
+static bool final_fragment = true;
+static const char *origin = "http://localhost:7681";
+static const char *host = "localhost:7681";
+
+static int bench_write(struct lws *wsi, unsigned char *buf, size_t len, enum lws_write_protocol wp) {
+  sink += buf[len - 1];
+  return (int)len;
+}
+
+static int bench_hdr_copy(struct lws *wsi, char *dest, int len, enum lws_token_indexes h) {
+  const char *value = h == WSI_TOKEN_ORIGIN ? origin : h == WSI_TOKEN_HOST ? host : "";
+  int n = (int)strlen(value);
+  if (n >= len) return -1;
+  memcpy(dest, value, n + 1);
+  return n;
+}
+
+static size_t bench_remaining_packet_payload(struct lws *wsi) { return 0; }
+
+static int bench_is_final_fragment(struct lws *wsi) { return final_fragment; }
+
+// allocations of the whole process, including the ones made by json-c and zlib
+static uint64_t allocs = 0;
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs++;
+  return __libc_realloc(ptr, size);
+}
+#define COUNT_ALLOCS 1
+#endif
+
+typedef struct {
+  const char *name;
+  void (*fn)(uint64_t iterations, size_t arg);
+  size_t arg;    // message size or fragment count
+  size_t bytes;  // processed per iteration, 0 if not meaningful
+} benchmark;
+
+static char *payload = NULL;  // random printable bytes, large enough for every benchmark
+
+static void bm_pty_buf_init(uint64_t iterations, size_t len) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    pty_buf_t *buf = pty_buf_init(payload, len);
+    sink += (unsigned char)buf->base[0];
+    pty_buf_free(buf);
+  }
+}
+
+static void bm_wsi_output(uint64_t iterations, size_t len) {
+  pty_buf_t buf = {.base = payload, .len = len};
+  struct pss_tty pss;
+  memset(&pss, 0, sizeof(pss));
+  for (uint64_t i = 0; i < iterations; i++) wsi_output(&pss, &buf);
+  free(pss.message);
+}
+
+static void bm_parse_window_size(uint64_t iterations, size_t unused) {
+  const char *msg = "{\"columns\":212,\"rows\":57}";
+  size_t len = strlen(msg);
+  uint16_t columns, rows;
+  for (uint64_t i = 0; i < iterations; i++) {
+    json_object_put(parse_window_size(msg, len, &columns, &rows));
+    sink += columns + rows;
+  }
+}
+
+// one 4096 byte INPUT message, split in <arg> fragments
+static void bm_receive(uint64_t iterations, size_t fragments) {
+  struct pss_tty pss;
+  size_t len = 4096, size = len / fragments;
+  memset(&pss, 0, sizeof(pss));
+  payload[0] = INPUT;
+  for (uint64_t i = 0; i < iterations; i++) {
+    for (size_t f = 0; f < fragments; f++) {
+      final_fragment = f == fragments - 1;
+      size_t n = final_fragment ? len - f * size : size;
+      callback_tty(NULL, LWS_CALLBACK_RECEIVE, &pss, payload + f * size, n);
+    }
+  }
+  final_fragment = true;
+  payload[0] = 'x';
+}
+
+static void bm_check_host_origin(uint64_t iterations, size_t unused) {
+  for (uint64_t i = 0; i < iterations; i++) sink += check_host_origin(NULL);
+}
+
+static void bm_uncompress_html(uint64_t iterations, size_t cached) {
+  char *output;
+  size_t output_len;
+  for (uint64_t i = 0; i < iterations; i++) {
+    if (!cached) {
+      body_free(html_bodies[ENCODING_IDENTITY]);
+      html_bodies[ENCODING_IDENTITY] = NULL;
+    }
+    if (!uncompress_html(&output, &output_len)) {
+      fprintf(stderr, "ttyd-microbench: uncompress_html failed\n");
+      exit(1);
+    }
+    sink += output_len;
+  }
+}
+
+static benchmark benchmarks[] = {
+    {"pty_buf_init/64", bm_pty_buf_init, 64, 64},
+    {"pty_buf_init/4096", bm_pty_buf_init, 4096, 4096},
+    {"pty_buf_init/65536", bm_pty_buf_init, 65536, 65536},
+    {"wsi_output/64", bm_wsi_output, 64, 64},
+    {"wsi_output/4096", bm_wsi_output, 4096, 4096},
+    {"wsi_output/65536", bm_wsi_output, 65536, 65536},
+    {"parse_window_size", bm_parse_window_size, 0, 0},
+    {"receive/1", bm_receive, 1, 4096},
+    {"receive/4", bm_receive, 4, 4096},
+    {"receive/16", bm_receive, 16, 4096},
+    {"check_host_origin", bm_check_host_origin, 0, 0},
+    {"uncompress_html/cold", bm_uncompress_html, 0, 0},
+    {"uncompress_html/cached", bm_uncompress_html, 1, 0},
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// grow the iteration count until a run takes at least min_time, like google benchmark does
+static void run(benchmark *b, double min_time) {
+  uint64_t iterations = 1, elapsed, count;
+  for (;;) {
+    count = allocs;
+    uint64_t start = now_ns();
+    b->fn(iterations, b->arg);
+    elapsed = now_ns() - start;
+    count = allocs - count;
+    if (elapsed >= min_time * 1e9 || iterations >= 1000000000) break;
+    double scale = elapsed > 0 ? min_time * 1e9 * 1.4 / elapsed : 100;
+    if (scale > 100) scale = 100;
+    if (scale < 2) scale = 2;
+    iterations = (uint64_t)(iterations * scale);
+  }
+
+  printf("%-28s %12.1f %12llu", b->name, (double)elapsed / iterations, (unsigned long long)iterations);
+  if (b->bytes > 0) {
+    printf(" %12.3f", (double)b->bytes * iterations / elapsed);
+  } else {
+    printf(" %12s", "-");
+  }
+#ifdef COUNT_ALLOCS
+  printf(" %12.2f\n", (double)count / iterations);
+#else
+  printf(" %12s\n", "-");
+#endif
+}
+
+static void print_help() {
+  // clang-format off
+  fprintf(stderr, "ttyd-microbench runs micro-benchmarks of the ttyd protocol code\n\n"
+          "USAGE:\n"
+          "    ttyd-microbench [options] [<filter>] (runs the benchmarks whose name contains the filter)\n\n"
+          "OPTIONS:\n"
+          "    -t, --min-time          Minimum seconds to run each benchmark (default: 0.5)\n"
+          "    -l, --list              List the benchmarks and exit\n"
+          "    -h, --help              Print this text and exit\n"
+  );
+  // clang-format on
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {{"min-time", required_argument, NULL, 't'},
+                                          {"list", no_argument, NULL, 'l'},
+                                          {"help", no_argument, NULL, 'h'},
+                                          {NULL, 0, 0, 0}};
+  double min_time = 0.5;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "t:lh", options, NULL)) != -1) {
+    switch (c) {
+      case 't':
+        min_time = atof(optarg);
+        if (min_time <= 0) {
+          fprintf(stderr, "ttyd-microbench: invalid min time: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'l':
+        for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) printf("%s\n", benchmarks[i].name);
+        return 0;
+      case 'h':
+        print_help();
+        return 0;
+      default:
+        print_help();
+        return -1;
+    }
+  }
+  const char *filter = optind < argc ? argv[optind] : NULL;
+
+  lws_set_log_level(LLL_ERR, NULL);
+  server = xmalloc(sizeof(struct server));
+  memset(server, 0, sizeof(struct server));
+
+  payload = xmalloc(65536);
+  srand(1);
+  for (size_t i = 0; i < 65536; i++) payload[i] = (char)(' ' + rand() % 95);
+  payload[0] = 'x';
+
+  printf("%-28s %12s %12s %12s %12s\n", "Benchmark", "Time(ns)", "Iterations", "Bytes/ns", "Allocs/op");
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL) continue;
+    run(&benchmarks[i], min_time);
+  }
+
+  free(payload);
+  free(server);
+  return 0;
+}
@@ -4,10 +4,11 @@ const gzip = require('gulp-gzip');
 const inlineSource = require('gulp-inline-source');
 const rename = require('gulp-rename');
 const through2 = require('through2');
+const zlib = require('zlib');
 
-const genHeader = (size, buf, len) => {
+const genArray = (name, buf) => {
     let idx = 0;
-    let data = 'unsigned char index_html[] = {\n  ';
+    let data = `unsigned char ${name}[] = {\n  `;
 
     for (const value of buf) {
         idx++;
@@ -18,19 +19,45 @@ const genHeader = (size, buf, len) => {
         data += (current >>> 4).toString(16);
         data += (current & 0xf).toString(16);
 
-        if (idx === len) {
+        if (idx === buf.length) {
             data += '\n';
         } else {
             data += idx % 12 === 0 ? ',\n  ' : ', ';
         }
     }
+    // C does not allow empty arrays
+    if (buf.length === 0) data += '0x00\n';
 
     data += '};\n';
-    data += `unsigned int index_html_len = ${len};\n`;
+    data += `unsigned int ${name}_len = ${buf.length};\n`;
+    return data;
+};
+
+const genHeader = (size, buf, br, zstd) => {
+    let data = genArray('index_html', buf);
     data += `unsigned int index_html_size = ${size};\n`;
+    data += genArray('index_html_br', br);
+    data += genArray('index_html_zstd', zstd);
     return data;
 };
+
+// zstd needs node >= 22.15, an empty variant is skipped by ttyd
+const compress = html => {
+    const br = zlib.brotliCompressSync(html, {
+        params: {
+            [zlib.constants.BROTLI_PARAM_MODE]: zlib.constants.BROTLI_MODE_TEXT,
+            [zlib.constants.BROTLI_PARAM_QUALITY]: zlib.constants.BROTLI_MAX_QUALITY,
+            [zlib.constants.BROTLI_PARAM_SIZE_HINT]: html.length,
+        },
+    });
+    const zstd = zlib.zstdCompressSync
+        ? zlib.zstdCompressSync(html, { params: { [zlib.constants.ZSTD_c_compressionLevel]: 19 } })
+        : Buffer.alloc(0);
+    return { br, zstd };
+};
+
 let fileSize = 0;
+let variants = null;
 
 task('clean', () => {
     return src('dist', { read: false, allowEmpty: true }).pipe(clean());
@@ -51,6 +78,7 @@ task(
             .pipe(
                 through2.obj((file, enc, cb) => {
                     fileSize = file.contents.length;
+                    variants = compress(file.contents);
                     return cb(null, file);
                 })
             )
@@ -58,7 +86,7 @@ task(
             .pipe(
                 through2.obj((file, enc, cb) => {
                     const buf = file.contents;
-                    file.contents = Buffer.from(genHeader(fileSize, buf, buf.length));
+                    file.contents = Buffer.from(genHeader(fileSize, buf, variants.br, variants.zstd));
                     return cb(null, file);
                 })
             )
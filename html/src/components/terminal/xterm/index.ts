@@ -15,6 +15,8 @@ import '@xterm/xterm/css/xterm.css';
 
 interface TtydTerminal extends Terminal {
     fit(): void;
+    latency(): void;
+    viewUrl(): string | undefined;
 }
 
 declare global {
@@ -28,12 +30,25 @@ enum Command {
     OUTPUT = '0',
     SET_WINDOW_TITLE = '1',
     SET_PREFERENCES = '2',
+    PONG = '3',
+    QUEUE_POSITION = '5',
+    SET_SESSION = '6',
+    OUTPUT_DEFLATED = '7',
 
     // client side
     INPUT = '0',
     RESIZE_TERMINAL = '1',
     PAUSE = '2',
     RESUME = '3',
+    VISIBILITY = '4',
+    PING = '5',
+}
+
+interface Latency {
+    last: number;
+    p50: number;
+    p99: number;
+    count: number;
 }
 type Preferences = ITerminalOptions & ClientOptions;
 
@@ -82,6 +97,7 @@ export class Xterm {
     private textDecoder = new TextDecoder();
     private written = 0;
     private pending = 0;
+    private showLatency = false;
 
     private terminal: Terminal;
     private fitAddon = new FitAddon();
@@ -98,9 +114,13 @@ export class Xterm {
     private title?: string;
     private titleFixed?: string;
     private resizeOverlay = true;
+    private queued = false;
+    private sessionId?: string;
     private reconnect = true;
     private doReconnect = true;
     private closeOnDisconnect = false;
+    // inflated output is written in the order it arrived
+    private outputQueue?: Promise<void>;
 
     private writeFunc = (data: ArrayBuffer) => this.writeData(new Uint8Array(data));
 
@@ -159,6 +179,17 @@ export class Xterm {
         window.term.fit = () => {
             this.fitAddon.fit();
         };
+        window.term.latency = () => {
+            this.showLatency = true;
+            this.sendPing();
+        };
+        // a read-only view of this session, with --max-viewers
+        window.term.viewUrl = () => {
+            if (!this.sessionId) return undefined;
+            const url = new URL(window.location.href);
+            url.searchParams.set('view', this.sessionId);
+            return url.toString();
+        };
 
         terminal.loadAddon(fitAddon);
         terminal.loadAddon(overlayAddon);
@@ -201,6 +232,42 @@ export class Xterm {
         );
         register(addEventListener(window, 'resize', () => fitAddon.fit()));
         register(addEventListener(window, 'beforeunload', this.onWindowUnload));
+        register(addEventListener(document, 'visibilitychange', this.sendVisibility));
+        if (document.hidden) this.sendVisibility();
+
+        // keep the server side latency histograms fed
+        const timer = window.setInterval(this.sendPing, 5000);
+        register(toDisposable(() => window.clearInterval(timer)));
+    }
+
+    @bind
+    private sendPing() {
+        const { socket, textEncoder } = this;
+        if (socket?.readyState !== WebSocket.OPEN) return;
+        socket.send(textEncoder.encode(Command.PING + performance.now().toFixed(3)));
+    }
+
+    @bind
+    private onPong(data: { ts: number; rtt: Latency; echo: Latency }) {
+        const rtt = performance.now() - data.ts;
+        if (!this.showLatency) return;
+        this.showLatency = false;
+
+        const { rtt: server, echo } = data;
+        const msg = [
+            `rtt ${rtt.toFixed(1)} ms`,
+            `server rtt p50/p99 ${server.p50}/${server.p99} ms`,
+            `echo p50/p99 ${echo.p50}/${echo.p99} ms`,
+        ].join(', ');
+        console.log(`[ttyd] latency: ${msg}`);
+        this.overlayAddon.showOverlay(msg, 3000);
+    }
+
+    @bind
+    private sendVisibility() {
+        const { socket, textEncoder } = this;
+        if (socket?.readyState !== WebSocket.OPEN) return;
+        socket.send(textEncoder.encode(Command.VISIBILITY + (document.hidden ? '0' : '1')));
     }
 
     @bind
@@ -246,7 +313,10 @@ export class Xterm {
 
     @bind
     public connect() {
-        this.socket = new WebSocket(this.options.wsUrl, ['tty']);
+        const url = new URL(this.options.wsUrl);
+        // each output message inflates on its own, instead of permessage-deflate
+        if (typeof DecompressionStream !== 'undefined') url.searchParams.set('compress', 'deflate');
+        this.socket = new WebSocket(url.toString(), ['tty']);
         const { socket, register } = this;
 
         socket.binaryType = 'arraybuffer';
@@ -261,11 +331,19 @@ export class Xterm {
         console.log('[ttyd] websocket connection opened');
 
         const { textEncoder, terminal, overlayAddon } = this;
-        const msg = JSON.stringify({ AuthToken: this.token, columns: terminal.cols, rows: terminal.rows });
+        const { sessionId } = this;
+        const msg = JSON.stringify({
+            AuthToken: this.token,
+            columns: terminal.cols,
+            rows: terminal.rows,
+            SessionId: sessionId,
+            ViewSessionId: new URLSearchParams(window.location.search).get('view') ?? undefined,
+        });
         this.socket?.send(textEncoder.encode(msg));
 
         if (this.opened) {
-            terminal.reset();
+            // a session kept by the server across its restart goes on where it was
+            if (!sessionId) terminal.reset();
             terminal.options.disableStdin = false;
             overlayAddon.showOverlay('Reconnected', 300);
         } else {
@@ -348,12 +426,32 @@ export class Xterm {
 
         switch (cmd) {
             case Command.OUTPUT:
-                this.writeFunc(data);
+                this.writeOutput(data);
+                break;
+            case Command.OUTPUT_DEFLATED:
+                this.writeOutput(this.inflate(data));
                 break;
             case Command.SET_WINDOW_TITLE:
+                // the first message of an admitted session
+                if (this.queued) this.overlayAddon.showOverlay('Connected', 300);
+                this.queued = false;
                 this.title = textDecoder.decode(data);
                 document.title = this.title;
                 break;
+            case Command.PONG:
+                this.onPong(JSON.parse(textDecoder.decode(data)));
+                break;
+            case Command.SET_SESSION: {
+                const id = textDecoder.decode(data) || undefined;
+                // not resumed, the new session starts on a clean screen
+                if (this.sessionId && id !== this.sessionId) this.terminal.reset();
+                this.sessionId = id;
+                break;
+            }
+            case Command.QUEUE_POSITION:
+                this.queued = true;
+                this.overlayAddon.showOverlay(`Waiting for a free slot, position ${textDecoder.decode(data)}`);
+                break;
             case Command.SET_PREFERENCES:
                 this.applyPreferences({
                     ...this.options.clientOptions,
@@ -367,6 +465,26 @@ export class Xterm {
         }
     }
 
+    private inflate(data: ArrayBuffer): Promise<ArrayBuffer> {
+        const stream = new Blob([data]).stream().pipeThrough(new DecompressionStream('deflate-raw'));
+        return new Response(stream).arrayBuffer();
+    }
+
+    private writeOutput(data: ArrayBuffer | Promise<ArrayBuffer>) {
+        if (!this.outputQueue && data instanceof ArrayBuffer) {
+            this.writeFunc(data);
+            return;
+        }
+        const queue = (this.outputQueue ?? Promise.resolve())
+            .then(() => data)
+            .then(buf => this.writeFunc(buf))
+            .catch(e => console.error('[ttyd] failed to inflate output:', e))
+            .finally(() => {
+                if (this.outputQueue === queue) this.outputQueue = undefined;
+            });
+        this.outputQueue = queue;
+    }
+
     @bind
     private applyPreferences(prefs: Preferences) {
         const { terminal, fitAddon, register } = this;
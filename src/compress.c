@@ -0,0 +1,210 @@
+#include "compress.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+// smaller messages go as they are, mostly the echo of keystrokes
+#define COMPRESS_MIN_SIZE 128
+// compressed to raw size above which compression does not pay for itself
+#define COMPRESS_MAX_RATIO 0.9
+// output sent as is between two attempts, once compression did not pay
+#define COMPRESS_PROBE_SIZE (64 * 1024)
+
+// a deflater per thread, reset between messages, so every message inflates on its own
+static uv_once_t deflater_once = UV_ONCE_INIT;
+static uv_key_t deflater_key;
+static bool deflater_key_ready = false;
+
+static compress_cb pool_cb = NULL;
+
+int compress_peer_class(const char *address) {
+  if (strncmp(address, "::ffff:", 7) == 0) address += 7;  // IPv4 mapped
+  if (*address == '\0' || strncmp(address, "127.", 4) == 0 || strcmp(address, "::1") == 0) return COMPRESS_LOOPBACK;
+
+  unsigned a, b;
+  if (sscanf(address, "%u.%u.", &a, &b) == 2) {
+    bool local = a == 10 || (a == 172 && b >= 16 && b < 32) || (a == 192 && b == 168) || (a == 169 && b == 254) ||
+                 (a == 100 && b >= 64 && b < 128);
+    return local ? COMPRESS_PRIVATE : COMPRESS_PUBLIC;
+  }
+  // unique local fc00::/7 and link local fe80::/10, the first group has all its digits then
+  if (strcspn(address, ":") == 4) {
+    char c0 = (char)tolower(address[0]), c1 = (char)tolower(address[1]), c2 = (char)tolower(address[2]);
+    if (c0 == 'f' && (c1 == 'c' || c1 == 'd')) return COMPRESS_PRIVATE;
+    if (c0 == 'f' && c1 == 'e' && c2 >= '8' && c2 <= 'b') return COMPRESS_PRIVATE;
+  }
+  return COMPRESS_PUBLIC;
+}
+
+int compress_parse_classes(const char *str) {
+  static const struct {
+    const char *name;
+    int classes;
+  } names[] = {{"loopback", COMPRESS_LOOPBACK},
+               {"private", COMPRESS_PRIVATE},
+               {"public", COMPRESS_PUBLIC},
+               {"all", COMPRESS_LOOPBACK | COMPRESS_PRIVATE | COMPRESS_PUBLIC},
+               {"none", 0}};
+  int classes = 0;
+  while (*str != '\0') {
+    size_t len = strcspn(str, ",");
+    size_t i = 0;
+    while (i < sizeof(names) / sizeof(names[0]) && (strlen(names[i].name) != len || strncmp(names[i].name, str, len)))
+      i++;
+    if (i == sizeof(names) / sizeof(names[0])) return -1;
+    classes |= names[i].classes;
+    str += len;
+    if (*str == ',') str++;
+  }
+  return classes;
+}
+
+static void deflater_key_init() { deflater_key_ready = uv_key_create(&deflater_key) == 0; }
+
+// NULL if zlib is out of memory, the streams live as long as the threads
+static z_stream *thread_deflater() {
+  uv_once(&deflater_once, deflater_key_init);
+  if (!deflater_key_ready) return NULL;
+  z_stream *deflater = uv_key_get(&deflater_key);
+  if (deflater != NULL) return deflater;
+  // not xmalloc: it may run on a thread of the pool
+  deflater = calloc(1, sizeof(z_stream));
+  if (deflater == NULL) return NULL;
+  if (deflateInit2(deflater, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(deflater);
+    return NULL;
+  }
+  uv_key_set(&deflater_key, deflater);
+  return deflater;
+}
+
+// the compressed length, len if it does not fit in it
+static size_t deflate_message(const char *data, size_t len, char *out) {
+  z_stream *deflater = thread_deflater();
+  if (deflater == NULL) return len;
+  deflater->next_in = (Bytef *)data;
+  deflater->avail_in = (uInt)len;
+  deflater->next_out = (Bytef *)out;
+  deflater->avail_out = (uInt)len;
+  int ret = deflate(deflater, Z_FINISH);
+  size_t n = len - deflater->avail_out;
+  deflateReset(deflater);
+  return ret == Z_STREAM_END ? n : len;
+}
+
+static bool compress_wanted(compress_state *c, size_t len) {
+  if (len < COMPRESS_MIN_SIZE) return false;
+  // it did not pay lately, try again once in a while in case the output changed (eg: a file transfer ended)
+  if (c->ratio > COMPRESS_MAX_RATIO && c->skipped < COMPRESS_PROBE_SIZE) {
+    c->skipped += len;
+    metrics.output_deflate_skipped_total++;
+    return false;
+  }
+  c->skipped = 0;
+  return true;
+}
+
+// the last attempts weigh the most
+static size_t compress_account(compress_state *c, size_t len, size_t n) {
+  c->ratio = (c->ratio + (double)n / len) / 2;
+  if (n >= len) return 0;
+  metrics.output_deflate_messages_total++;
+  metrics.output_deflate_in_bytes_total += len;
+  metrics.output_deflate_out_bytes_total += n;
+  return n;
+}
+
+size_t compress_output(compress_state *c, const char *data, size_t len, char *out) {
+  if (!compress_wanted(c, len)) return 0;
+  return compress_account(c, len, deflate_message(data, len, out));
+}
+
+bool compress_pool_init(int threads, compress_cb cb) {
+  char size[16];
+  snprintf(size, sizeof(size), "%d", threads);
+  // read by libuv when the pool starts, on the first work queued
+  if (uv_os_setenv("UV_THREADPOOL_SIZE", size) != 0) return false;
+  pool_cb = cb;
+  return true;
+}
+
+bool compress_pooled(compress_state *c) { return pool_cb != NULL && c->enabled; }
+
+static void job_work_cb(uv_work_t *work) {
+  compress_job *job = (compress_job *)work->data;
+  job->len = deflate_message(job->buf->base, job->buf->len, job->message + job->headroom);
+}
+
+static void job_after_work_cb(uv_work_t *work, int status) {
+  compress_job *job = (compress_job *)work->data;
+  job->done = true;
+  metrics.output_deflate_jobs--;
+  if (job->state == NULL) {
+    compress_job_free(job);
+    return;
+  }
+  job->len = status == 0 ? compress_account(job->state, job->buf->len, job->len) : 0;
+  if (job->state->head == job) pool_cb(job->ctx);
+}
+
+bool compress_submit(uv_loop_t *loop, compress_state *c, pty_buf_t *buf, size_t headroom, void *ctx) {
+  compress_job *job = xmalloc(sizeof(compress_job));
+  memset(job, 0, sizeof(compress_job));
+  job->work.data = job;
+  job->state = c;
+  job->ctx = ctx;
+  job->buf = buf;
+  job->headroom = headroom;
+  job->message = xmalloc(headroom + buf->len);
+  if (c->tail != NULL) {
+    c->tail->next = job;
+  } else {
+    c->head = job;
+  }
+  c->tail = job;
+  c->jobs++;
+
+  // the loop sends it as is, after the ones before it
+  job->done = !compress_wanted(c, buf->len) || uv_queue_work(loop, &job->work, job_work_cb, job_after_work_cb) != 0;
+  if (!job->done) metrics.output_deflate_jobs++;
+  return c->jobs < COMPRESS_PIPELINE;
+}
+
+compress_job *compress_take(compress_state *c) {
+  compress_job *job = c->head;
+  if (job == NULL || !job->done) return NULL;
+  c->head = job->next;
+  if (c->head == NULL) c->tail = NULL;
+  c->jobs--;
+  return job;
+}
+
+void compress_job_free(compress_job *job) {
+  pty_buf_free(job->buf);
+  free(job->message);
+  free(job);
+}
+
+size_t compress_cancel(compress_state *c) {
+  size_t dropped = 0;
+  while (c->head != NULL) {
+    compress_job *job = c->head;
+    c->head = job->next;
+    dropped += job->buf->len;
+    if (job->done) {
+      compress_job_free(job);
+    } else {
+      job->state = NULL;
+    }
+  }
+  c->tail = NULL;
+  c->jobs = 0;
+  return dropped;
+}
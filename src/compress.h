@@ -0,0 +1,65 @@
+#ifndef TTYD_COMPRESS_H
+#define TTYD_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+#include "pty.h"
+
+// classes of peer addresses, the ones in --compress get compression
+#define COMPRESS_LOOPBACK 1  // the reverse proxy on the same host, or a UNIX domain socket
+#define COMPRESS_PRIVATE 2   // private, link local and shared address space
+#define COMPRESS_PUBLIC 4
+
+// output of a connection the thread pool may hold, before the pty is read on
+#define COMPRESS_PIPELINE 4
+
+typedef struct compress_job_ compress_job;
+
+// OUTPUT compression of a connection, decided per message
+typedef struct {
+  bool enabled;        // the client inflates OUTPUT_DEFLATED
+  double ratio;        // compressed to raw size of the last messages compressed
+  size_t skipped;      // output bytes sent as is since the last message compressed
+  compress_job *head;  // output handed to the thread pool, in the order it was read
+  compress_job *tail;
+  int jobs;
+} compress_state;
+
+// a message of output, compressed in the thread pool
+struct compress_job_ {
+  uv_work_t work;
+  compress_job *next;
+  compress_state *state;  // NULL once the connection is gone
+  void *ctx;              // of the callback
+  pty_buf_t *buf;         // the output as it was read
+  char *message;          // headroom bytes, then the compressed output
+  size_t headroom;        // for the framing of the caller
+  size_t len;             // compressed length, 0 to send buf as it is
+  bool done;
+};
+
+// called on the loop when the next job of a connection may be done
+typedef void (*compress_cb)(void *ctx);
+
+// Class of a numeric address, an empty one is a UNIX domain socket
+int compress_peer_class(const char *address);
+// Parse a comma separated list of classes, -1 if invalid
+int compress_parse_classes(const char *str);
+// Compress data into out, which holds len bytes, if it is likely to pay off: the compressed length, 0 to send data as
+// it is. Each message is a complete raw deflate stream.
+size_t compress_output(compress_state *c, const char *data, size_t len, char *out);
+
+// Compress the output in a pool of threads instead of on the loop
+bool compress_pool_init(int threads, compress_cb cb);
+bool compress_pooled(compress_state *c);
+// Queue buf (taken over) behind the output in flight, false if the connection has as much in flight as it may have
+bool compress_submit(uv_loop_t *loop, compress_state *c, pty_buf_t *buf, size_t headroom, void *ctx);
+// The oldest job once it is done, NULL if there is none or it is still being compressed
+compress_job *compress_take(compress_state *c);
+void compress_job_free(compress_job *job);
+// Drop the output in flight, the jobs still running are freed when they are done: the bytes dropped
+size_t compress_cancel(compress_state *c);
+
+#endif  // TTYD_COMPRESS_H
@@ -0,0 +1,273 @@
+#include "fakepty.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define PATTERN_SIZE (64 * 1024)
+
+static struct {
+  bool enabled;
+  char *data;  // bytes to replay, a file or a synthetic pattern
+  size_t len;
+  bool loop;          // start over at the end of the file
+  size_t chunk;       // bytes per read
+  int burst;          // reads per interval
+  uint64_t interval;  // ms between bursts, 0 to read as fast as the output is consumed
+  uint64_t total;     // bytes before the fake command exits, 0 for no limit
+} config;
+
+typedef struct {
+  uv_timer_t *timer;
+  size_t offset;  // in config.data
+  uint64_t sent;
+  int budget;     // reads left in the current burst
+  uint64_t next;  // loop time of the next burst
+  bool reading;
+  bool killed;
+  bool exited;
+  char *echo;  // input to echo back, like a tty does
+  size_t echo_len;
+} fake_state;
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static bool read_file(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size <= 0) {
+    fclose(fp);
+    return false;
+  }
+  config.data = xmalloc((size_t)size);
+  config.len = fread(config.data, 1, (size_t)size, fp);
+  fclose(fp);
+  return config.len > 0;
+}
+
+// colored, numbered lines, the same on every run
+static void make_pattern() {
+  config.data = xmalloc(PATTERN_SIZE);
+  config.len = 0;
+  for (int i = 0; config.len + 128 < PATTERN_SIZE; i++) {
+    const char *fmt = "\x1b[3%dm%06d\x1b[0m the quick brown fox jumps over the lazy dog %d\r\n";
+    config.len += sprintf(config.data + config.len, fmt, i % 7 + 1, i, i * 7919 % 10007);
+  }
+  config.loop = true;
+}
+
+// spec: comma separated options, eg: file=out.raw,chunk=4096,rate=1000000,burst=4,total=100000000,loop
+bool fake_pty_init(const char *spec) {
+  char *copy = strdup(spec), *save = NULL;
+  const char *file = NULL;
+  uint64_t rate = 0;
+  bool ok = true;
+
+  config.chunk = 4096;
+  config.burst = 1;
+  for (char *opt = strtok_r(copy, ",", &save); opt != NULL && ok; opt = strtok_r(NULL, ",", &save)) {
+    char *value = strchr(opt, '=');
+    if (value != NULL) *value++ = '\0';
+    if (strcmp(opt, "loop") == 0) {
+      config.loop = true;
+    } else if (value == NULL) {
+      ok = false;
+    } else if (strcmp(opt, "file") == 0) {
+      file = value;
+    } else if (strcmp(opt, "chunk") == 0) {
+      config.chunk = strtoul(value, NULL, 0);
+    } else if (strcmp(opt, "burst") == 0) {
+      config.burst = atoi(value);
+    } else if (strcmp(opt, "interval") == 0) {
+      config.interval = strtoull(value, NULL, 0);
+    } else if (strcmp(opt, "rate") == 0) {
+      rate = strtoull(value, NULL, 0);
+    } else if (strcmp(opt, "total") == 0) {
+      config.total = strtoull(value, NULL, 0);
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok || config.chunk == 0 || config.burst <= 0) {
+    fprintf(stderr, "ttyd: invalid fake pty spec: %s\n", spec);
+    free(copy);
+    return false;
+  }
+
+  if (file != NULL) {
+    if (!read_file(file)) {
+      fprintf(stderr, "ttyd: can not read fake pty file: %s\n", file);
+      free(copy);
+      return false;
+    }
+    if (!config.loop && config.total == 0) config.total = config.len;
+  } else {
+    make_pattern();
+  }
+  free(copy);
+
+  // a rate is turned into bursts, at most one per ms
+  if (rate > 0) {
+    config.interval = config.chunk * config.burst * 1000 / rate;
+    if (config.interval == 0) {
+      config.interval = 1;
+      config.burst = (int)(rate / 1000 / config.chunk);
+      if (config.burst == 0) config.burst = 1;
+    }
+  }
+  config.enabled = true;
+  return true;
+}
+
+bool fake_pty_enabled() { return config.enabled; }
+
+static void timer_cb(uv_timer_t *timer);
+
+static void schedule(fake_state *st, uint64_t delay) {
+  if (!uv_is_active((uv_handle_t *)st->timer)) uv_timer_start(st->timer, timer_cb, delay, 0);
+}
+
+static pty_buf_t *next_chunk(fake_state *st) {
+  size_t n = config.chunk;
+  if (st->offset == config.len) {
+    if (!config.loop) return NULL;
+    st->offset = 0;
+  }
+  if (n > config.len - st->offset) n = config.len - st->offset;
+  if (config.total > 0) {
+    if (st->sent >= config.total) return NULL;
+    if (n > config.total - st->sent) n = (size_t)(config.total - st->sent);
+  }
+
+  pty_buf_t *buf = pty_buf_init(config.data + st->offset, n);
+  st->offset += n;
+  st->sent += n;
+  return buf;
+}
+
+static void timer_cb(uv_timer_t *timer) {
+  pty_process *process = (pty_process *)timer->data;
+  fake_state *st = (fake_state *)process->fake;
+
+  if (st->killed) {
+    process->exit_cb(process);
+    process_free(process);
+    // freed by the close of its async handle on the real path
+    free(process);
+    return;
+  }
+  if (!st->reading || st->exited) return;
+
+  if (st->echo_len > 0) {
+    pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
+    buf->base = st->echo;
+    buf->len = st->echo_len;
+    buf->size = 0;
+    st->echo = NULL;
+    st->echo_len = 0;
+    st->reading = false;
+    process->read_cb(process, buf, false);
+    return;
+  }
+
+  if (config.interval > 0 && st->budget == 0) {
+    uint64_t now = uv_now(process->loop);
+    if (now < st->next) {
+      schedule(st, st->next - now);
+      return;
+    }
+    st->budget = config.burst;
+    st->next = (st->next + config.interval > now ? st->next : now) + config.interval;
+  }
+
+  pty_buf_t *buf = next_chunk(st);
+  if (buf == NULL) {
+    // the end of the stream, exit like a command would
+    st->exited = true;
+    process->exit_code = 0;
+    process->read_cb(process, NULL, true);
+    process->exit_cb(process);
+    process_free(process);
+    free(process);
+    return;
+  }
+  if (st->budget > 0) st->budget--;
+  st->reading = false;
+  process->read_cb(process, buf, false);
+}
+
+int fake_pty_spawn(pty_process *process) {
+  fake_state *st = xmalloc(sizeof(fake_state));
+  memset(st, 0, sizeof(fake_state));
+  st->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(process->loop, st->timer);
+  st->timer->data = process;
+  st->next = uv_now(process->loop);
+  process->fake = st;
+  process->paused = true;
+  return 0;
+}
+
+bool fake_pty_running(pty_process *process) {
+  fake_state *st = (fake_state *)process->fake;
+  return !st->exited;
+}
+
+void fake_pty_free(pty_process *process) {
+  fake_state *st = (fake_state *)process->fake;
+  uv_timer_stop(st->timer);
+  uv_close((uv_handle_t *)st->timer, close_cb);
+  free(st->echo);
+  free(st);
+  process->fake = NULL;
+}
+
+void fake_pty_pause(pty_process *process) {
+  fake_state *st = (fake_state *)process->fake;
+  st->reading = false;
+}
+
+void fake_pty_resume(pty_process *process) {
+  fake_state *st = (fake_state *)process->fake;
+  if (st->reading || st->exited) return;
+  st->reading = true;
+  schedule(st, 0);
+}
+
+// echo the input back, as a tty in canonical mode would
+int fake_pty_write(pty_process *process, pty_buf_t *buf) {
+  fake_state *st = (fake_state *)process->fake;
+  st->echo = xrealloc(st->echo, st->echo_len + buf->len * 3);
+  for (size_t i = 0; i < buf->len; i++) {
+    char c = buf->base[i];
+    if (c == '\r') {
+      memcpy(st->echo + st->echo_len, "\r\n", 2);
+      st->echo_len += 2;
+    } else if (c == '\x7f') {
+      memcpy(st->echo + st->echo_len, "\b \b", 3);
+      st->echo_len += 3;
+    } else {
+      st->echo[st->echo_len++] = c;
+    }
+  }
+  pty_buf_free(buf);
+  if (st->reading) schedule(st, 0);
+  return 0;
+}
+
+bool fake_pty_kill(pty_process *process, int sig) {
+  fake_state *st = (fake_state *)process->fake;
+  if (st->exited) return false;
+  st->exited = true;
+  st->killed = true;
+  process->exit_signal = sig;
+  process->exit_code = 128 + sig;
+  uv_timer_stop(st->timer);
+  schedule(st, 0);
+  return true;
+}
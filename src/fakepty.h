@@ -0,0 +1,20 @@
+#ifndef TTYD_FAKEPTY_H
+#define TTYD_FAKEPTY_H
+
+#include <stdbool.h>
+
+#include "pty.h"
+
+// a pty backend replaying a byte stream instead of running a command, for benchmarks
+
+bool fake_pty_init(const char *spec);
+bool fake_pty_enabled();
+int fake_pty_spawn(pty_process *process);
+bool fake_pty_running(pty_process *process);
+void fake_pty_free(pty_process *process);
+void fake_pty_pause(pty_process *process);
+void fake_pty_resume(pty_process *process);
+int fake_pty_write(pty_process *process, pty_buf_t *buf);
+bool fake_pty_kill(pty_process *process, int sig);
+
+#endif  // TTYD_FAKEPTY_H
@@ -0,0 +1,351 @@
+#include "history.h"
+
+#include <errno.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "utils.h"
+
+// the streams are reset between blocks, so every block inflates on its own
+static z_stream deflater;
+static z_stream inflater;
+static bool deflater_ready = false;
+static bool inflater_ready = false;
+
+// all histories, the least recently active first
+static history_t *lru_head = NULL;
+static history_t *lru_tail = NULL;
+static char *spill_dir = NULL;
+static size_t spill_budget = 0;
+
+static void account(history_t *h, ssize_t mem, ssize_t raw) {
+  h->mem_len += mem;
+  h->raw_len += raw;
+  metrics.history_bytes += mem;
+  metrics.history_raw_bytes += raw;
+}
+
+static void lru_unlink(history_t *h) {
+  if (h->prev != NULL) {
+    h->prev->next = h->next;
+  } else {
+    lru_head = h->next;
+  }
+  if (h->next != NULL) {
+    h->next->prev = h->prev;
+  } else {
+    lru_tail = h->prev;
+  }
+  h->prev = h->next = NULL;
+}
+
+static void lru_touch(history_t *h) {
+  if (lru_tail == h) return;
+  if (h->prev != NULL || lru_head == h) lru_unlink(h);
+  h->prev = lru_tail;
+  if (lru_tail != NULL) {
+    lru_tail->next = h;
+  } else {
+    lru_head = h;
+  }
+  lru_tail = h;
+}
+
+void history_spill(const char *dir, size_t budget) {
+  free(spill_dir);
+  spill_dir = dir != NULL ? strdup(dir) : NULL;
+  spill_budget = budget;
+}
+
+history_t *history_init(size_t limit) {
+  history_t *h = xmalloc(sizeof(history_t));
+  memset(h, 0, sizeof(history_t));
+  h->limit = limit;
+  h->fd = -1;
+  lru_touch(h);
+  metrics.history_sessions++;
+  return h;
+}
+
+#ifndef _WIN32
+// give the disk space of the blocks before end back, the file keeps its size; all before end is dropped, so a page
+// shared with the previous block is freed too
+static void spill_punch(history_t *h, uint64_t end) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, (off_t)end) != 0 && errno != EOPNOTSUPP)
+    lwsl_warn("history: can not punch the spill file: %s\n", strerror(errno));
+#endif
+}
+#endif
+
+static void block_free(history_t *h, history_block *block) {
+  if (block->data != NULL) {
+    account(h, -(ssize_t)(sizeof(history_block) + block->len), -(ssize_t)block->raw_len);
+    free(block->data);
+  } else {
+    account(h, -(ssize_t)sizeof(history_block), -(ssize_t)block->raw_len);
+    h->spilled -= block->len;
+    metrics.history_spilled_bytes -= block->len;
+#ifndef _WIN32
+    // the spilled blocks go first, the file is empty once the last one went
+    if (h->spilled == 0 && h->fd >= 0 && ftruncate(h->fd, 0) == 0) {
+      h->file_len = 0;
+    } else if (h->fd >= 0) {
+      spill_punch(h, block->offset + block->len);
+    }
+#endif
+  }
+  free(block);
+}
+
+// unlink the oldest block
+static history_block *block_shift(history_t *h) {
+  history_block *block = h->head;
+  h->head = block->next;
+  if (h->head == NULL) h->tail = NULL;
+  if (h->resident == block) h->resident = block->next;
+  return block;
+}
+
+void history_free(history_t *h) {
+  if (h == NULL) return;
+  while (h->head != NULL) block_free(h, block_shift(h));
+  if (h->open != NULL) {
+    account(h, -HISTORY_BLOCK_SIZE, -(ssize_t)h->open_len);
+    free(h->open);
+  }
+#ifndef _WIN32
+  if (h->fd >= 0) close(h->fd);
+#endif
+  lru_unlink(h);
+  metrics.history_sessions--;
+  free(h);
+}
+
+#ifndef _WIN32
+static bool spill_open(history_t *h) {
+  size_t len = strlen(spill_dir) + sizeof("/ttyd-history-XXXXXX");
+  char *path = xmalloc(len);
+  snprintf(path, len, "%s/ttyd-history-XXXXXX", spill_dir);
+  h->fd = mkstemp(path);
+  if (h->fd >= 0) {
+    // nothing else opens it, it goes away with the descriptor
+    unlink(path);
+    fcntl(h->fd, F_SETFD, FD_CLOEXEC);
+  } else {
+    lwsl_warn("history: can not create a spill file in %s: %s\n", spill_dir, strerror(errno));
+    h->fd = -2;
+  }
+  free(path);
+  return h->fd >= 0;
+}
+
+// move the oldest block in memory to the spill file
+static bool block_spill(history_t *h) {
+  history_block *block = h->resident;
+  if (h->fd < 0 && !spill_open(h)) return false;
+
+  for (uint32_t done = 0; done < block->len;) {
+    ssize_t n = pwrite(h->fd, block->data + done, block->len - done, (off_t)(h->file_len + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      lwsl_warn("history: can not spill to disk: %s\n", n < 0 ? strerror(errno) : "short write");
+      return false;
+    }
+    done += (uint32_t)n;
+  }
+  block->offset = h->file_len;
+  h->file_len += block->len;
+  h->spilled += block->len;
+  metrics.history_spilled_bytes += block->len;
+  account(h, -(ssize_t)block->len, 0);
+  free(block->data);
+  block->data = NULL;
+  h->resident = block->next;
+  return true;
+}
+#endif
+
+static void spill_over_budget() {
+#ifndef _WIN32
+  if (spill_budget == 0 || spill_dir == NULL) return;
+  history_t *h = lru_head;
+  while (h != NULL && metrics.history_bytes > (int64_t)spill_budget) {
+    // a history that can not spill stays in memory, the next one goes
+    if (h->resident == NULL || h->fd == -2 || !block_spill(h)) h = h->next;
+  }
+#endif
+}
+
+static void block_add(history_t *h, history_block *block) {
+  block->next = NULL;
+  if (h->tail != NULL) {
+    h->tail->next = block;
+  } else {
+    h->head = block;
+  }
+  h->tail = block;
+  if (h->resident == NULL) h->resident = block;
+  account(h, sizeof(history_block) + block->len, block->raw_len);
+
+  // the open block stays, so a client gets the latest output at least
+  while (h->raw_len > h->limit && h->head != NULL) {
+    history_block *oldest = block_shift(h);
+    h->dropped += oldest->raw_len;
+    block_free(h, oldest);
+  }
+  spill_over_budget();
+}
+
+void history_seal(history_t *h) {
+  if (h->open == NULL || h->open_len == 0) return;
+  if (!deflater_ready) {
+    // level 1: the output of a terminal compresses well already
+    deflater_ready = deflateInit2(&deflater, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  history_block *block = xmalloc(sizeof(history_block));
+  block->raw_len = h->open_len;
+  block->data = NULL;
+  if (deflater_ready) {
+    block->data = xmalloc(h->open_len);
+    deflater.next_in = (Bytef *)h->open;
+    deflater.avail_in = h->open_len;
+    deflater.next_out = (Bytef *)block->data;
+    deflater.avail_out = h->open_len;
+    int ret = deflate(&deflater, Z_FINISH);
+    block->len = h->open_len - deflater.avail_out;
+    deflateReset(&deflater);
+    if (ret == Z_STREAM_END && block->len < block->raw_len) {
+      block->data = xrealloc(block->data, block->len);
+    } else {
+      free(block->data);
+      block->data = NULL;
+    }
+  }
+  if (block->data == NULL) {
+    // did not get smaller, kept as is
+    block->data = h->open;
+    block->len = h->open_len;
+    h->open = NULL;
+    account(h, -HISTORY_BLOCK_SIZE, 0);
+  }
+  account(h, 0, -(ssize_t)h->open_len);
+  h->open_len = 0;
+  block_add(h, block);
+}
+
+void history_append(history_t *h, const char *data, size_t len) {
+  lru_touch(h);
+  while (len > 0) {
+    if (h->open == NULL) {
+      h->open = xmalloc(HISTORY_BLOCK_SIZE);
+      account(h, HISTORY_BLOCK_SIZE, 0);
+    }
+    size_t n = HISTORY_BLOCK_SIZE - h->open_len;
+    if (n > len) n = len;
+    memcpy(h->open + h->open_len, data, n);
+    h->open_len += n;
+    account(h, 0, n);
+    data += n;
+    len -= n;
+    if (h->open_len == HISTORY_BLOCK_SIZE) history_seal(h);
+  }
+}
+
+bool history_add_block(history_t *h, const char *data, uint32_t len, uint32_t raw_len) {
+  if (raw_len == 0 || raw_len > HISTORY_BLOCK_SIZE || len > raw_len) return false;
+  history_block *block = xmalloc(sizeof(history_block));
+  block->data = xmalloc(len);
+  memcpy(block->data, data, len);
+  block->len = len;
+  block->raw_len = raw_len;
+  block_add(h, block);
+  return true;
+}
+
+// the data of a block, mapped from the spill file if it is there, NULL on failure
+static const char *block_map(history_t *h, history_block *block, void **map, size_t *map_len) {
+  *map = NULL;
+  if (block->data != NULL) return block->data;
+#ifndef _WIN32
+  // the mapping starts on a page boundary, only the pages of the block are read in
+  uint64_t start = block->offset - block->offset % (uint64_t)sysconf(_SC_PAGESIZE);
+  *map_len = block->len + (size_t)(block->offset - start);
+  *map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, h->fd, (off_t)start);
+  if (*map != MAP_FAILED) return (const char *)*map + (block->offset - start);
+  lwsl_warn("history: can not map the spill file: %s\n", strerror(errno));
+  *map = NULL;
+#endif
+  return NULL;
+}
+
+static void block_unmap(void *map, size_t map_len) {
+#ifndef _WIN32
+  if (map != NULL) munmap(map, map_len);
+#endif
+}
+
+bool history_block_copy(history_t *h, history_block *block, char *dst) {
+  void *map;
+  size_t map_len = 0;
+  const char *data = block_map(h, block, &map, &map_len);
+  if (data == NULL) return false;
+  memcpy(dst, data, block->len);
+  block_unmap(map, map_len);
+  return true;
+}
+
+pty_buf_t *history_take(history_t *h) {
+  lru_touch(h);
+  history_block *block = h->head;
+  if (block == NULL) {
+    if (h->open_len == 0) return NULL;
+    pty_buf_t *buf = pty_buf_init(h->open, h->open_len);
+    account(h, 0, -(ssize_t)h->open_len);
+    h->open_len = 0;
+    return buf;
+  }
+  block_shift(h);
+
+  pty_buf_t *buf = NULL;
+  void *map;
+  size_t map_len = 0;
+  const char *data = block_map(h, block, &map, &map_len);
+  if (data != NULL && block->len == block->raw_len) {
+    buf = pty_buf_init((char *)data, block->len);
+  } else if (data != NULL) {
+    if (!inflater_ready) inflater_ready = inflateInit2(&inflater, -15) == Z_OK;
+    if (inflater_ready) {
+      buf = xmalloc(sizeof(pty_buf_t));
+      buf->base = xmalloc(block->raw_len);
+      buf->size = 0;
+      inflater.next_in = (Bytef *)data;
+      inflater.avail_in = block->len;
+      inflater.next_out = (Bytef *)buf->base;
+      inflater.avail_out = block->raw_len;
+      int ret = inflate(&inflater, Z_FINISH);
+      buf->len = block->raw_len - inflater.avail_out;
+      inflateReset(&inflater);
+      if (ret != Z_STREAM_END) {
+        pty_buf_free(buf);
+        buf = NULL;
+      }
+    }
+  }
+  block_unmap(map, map_len);
+  block_free(h, block);
+  // a block that does not inflate is skipped
+  return buf != NULL ? buf : history_take(h);
+}
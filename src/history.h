@@ -0,0 +1,54 @@
+#ifndef TTYD_HISTORY_H
+#define TTYD_HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pty.h"
+
+// raw bytes of a block, sealed (compressed) once full
+#define HISTORY_BLOCK_SIZE 65536
+
+typedef struct history_block_ {
+  char *data;        // raw deflate, or the raw bytes if they did not compress, NULL once spilled
+  uint32_t len;
+  uint32_t raw_len;  // len if data is raw
+  uint64_t offset;   // in the spill file, once spilled
+  struct history_block_ *next;
+} history_block;
+
+// output of a detached session, kept for its client to come back to
+typedef struct history_ {
+  history_block *head;      // oldest
+  history_block *tail;
+  history_block *resident;  // the oldest block in memory, the ones before it are spilled
+  char *open;               // the block being filled, raw
+  size_t open_len;
+  size_t raw_len;           // of all blocks, the open one included
+  size_t mem_len;           // memory used, the blocks and the open buffer
+  size_t limit;             // raw bytes kept, the oldest blocks are dropped beyond it
+  uint64_t dropped;         // raw bytes dropped
+  int fd;                   // spill file, unlinked, -1 until the first spill, -2 if it could not be created
+  uint64_t file_len;
+  uint64_t spilled;         // bytes of the blocks in the spill file
+  struct history_ *prev;    // less recently active
+  struct history_ *next;    // more recently active
+} history_t;
+
+// Spill the oldest blocks of the least recently active histories to files in dir once all of them use more than
+// budget bytes of memory, 0 to never spill
+void history_spill(const char *dir, size_t budget);
+history_t *history_init(size_t limit);
+void history_free(history_t *h);
+void history_append(history_t *h, const char *data, size_t len);
+// Compress the open block, if any
+void history_seal(history_t *h);
+// Append a block sealed by another history (of the session daemon)
+bool history_add_block(history_t *h, const char *data, uint32_t len, uint32_t raw_len);
+// Copy the data of a block, paged back in from the spill file if needed
+bool history_block_copy(history_t *h, history_block *block, char *dst);
+// Remove the oldest block and return its content, NULL once empty
+pty_buf_t *history_take(history_t *h);
+
+#endif  // TTYD_HISTORY_H
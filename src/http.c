@@ -8,11 +8,12 @@
 
 enum { AUTH_OK, AUTH_FAIL, AUTH_ERROR };
 
-static char *html_cache = NULL;
-static size_t html_cache_len = 0;
+// browsers and proxies may keep the index for a day, revalidating it with If-None-Match after that
+#define INDEX_MAX_AGE "86400"
 
 static int send_unauthorized(struct lws *wsi, unsigned int code, enum lws_token_indexes header) {
   unsigned char buffer[1024 + LWS_PRE], *p, *end;
+  metrics.auth_failures_total++;
   p = buffer + LWS_PRE;
   end = p + sizeof(buffer) - LWS_PRE;
 
@@ -43,44 +44,158 @@ static int check_auth(struct lws *wsi, struct pss_http *pss) {
   return AUTH_OK;
 }
 
-static bool accept_gzip(struct lws *wsi) {
+// variants of the index, the embedded identity one is inflated from gzip on demand
+enum { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BR, ENCODING_ZSTD, ENCODING_COUNT };
+static const char *encoding_names[] = {"identity", "gzip", "br", "zstd"};
+// the embedded index, copied on first use behind LWS_PRE bytes that lws_write may use, the identity one inflated
+static char *html_bodies[ENCODING_COUNT];
+
+// the smallest variant allowed by Accept-Encoding (q=0 refuses a coding, * stands for the others), size 0: missing
+static int accept_encoding(struct lws *wsi, const size_t sizes[ENCODING_COUNT]) {
   char buf[256];
-  int len = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_ACCEPT_ENCODING);
-  return len > 0 && strstr(buf, "gzip") != NULL;
+  int accepted[ENCODING_COUNT] = {1, -1, -1, -1};  // 1: yes, 0: refused, -1: not listed
+  int star = -1;
+
+  if (lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0) {
+    char *save = NULL;
+    for (char *coding = strtok_r(buf, ",", &save); coding != NULL; coding = strtok_r(NULL, ",", &save)) {
+      while (*coding == ' ' || *coding == '\t') coding++;
+      char *params = strchr(coding, ';');
+      int ok = 1;
+      if (params != NULL) {
+        *params++ = '\0';
+        char *q = strstr(params, "q=");
+        if (q != NULL && strtod(q + 2, NULL) <= 0) ok = 0;
+      }
+      size_t n = strcspn(coding, " \t");
+      coding[n] = '\0';
+      if (strcmp(coding, "*") == 0) {
+        star = ok;
+        continue;
+      }
+      if (strcmp(coding, "x-gzip") == 0) coding = "gzip";
+      for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (strcmp(coding, encoding_names[i]) == 0) accepted[i] = ok;
+      }
+    }
+  }
+
+  int best = ENCODING_IDENTITY;
+  for (int i = ENCODING_GZIP; i < ENCODING_COUNT; i++) {
+    int ok = accepted[i] >= 0 ? accepted[i] : star == 1;
+    if (ok && sizes[i] > 0 && sizes[i] < sizes[best]) best = i;
+  }
+  return best;
+}
+
+// hash of the embedded index, TTYD_HTML_HASH is the hash of html.h computed by cmake
+static const char *html_hash() {
+#ifdef TTYD_HTML_HASH
+  return TTYD_HTML_HASH;
+#else
+  static char hash[17];
+  if (hash[0] == '\0') {
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+    for (unsigned int i = 0; i < index_html_len; i++) h = (h ^ index_html[i]) * 1099511628211ULL;
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)h);
+  }
+  return hash;
+#endif
+}
+
+// strong ETag, every encoding is another representation and needs its own tag
+static void make_etag(char *etag, size_t len, const char *hash, int encoding) {
+  static const char *suffixes[] = {"", "-gz", "-br", "-zst"};
+  snprintf(etag, len, "\"%s%s\"", hash, suffixes[encoding]);
+}
+
+// whether one of the tags in If-None-Match is etag, W/ prefixes are ignored (weak comparison)
+static bool etag_match(struct lws *wsi, const char *etag) {
+  char buf[1024];
+  if (lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_IF_NONE_MATCH) <= 0) return false;
+
+  char *save = NULL;
+  for (char *tag = strtok_r(buf, ",", &save); tag != NULL; tag = strtok_r(NULL, ",", &save)) {
+    while (*tag == ' ' || *tag == '\t') tag++;
+    if (strncmp(tag, "W/", 2) == 0) tag += 2;
+    size_t n = strlen(tag);
+    while (n > 0 && (tag[n - 1] == ' ' || tag[n - 1] == '\t')) n--;
+    if ((n == 1 && tag[0] == '*') || (n == strlen(etag) && strncmp(tag, etag, n) == 0)) return true;
+  }
+  return false;
+}
+
+// a custom index may change at any time, caches have to revalidate it
+static int add_cache_headers(struct lws *wsi, const char *etag, bool revalidate, unsigned char **p,
+                             unsigned char *end) {
+  // do not let shared caches keep a page behind authentication
+  bool private = server->credential != NULL || server->auth_header != NULL;
+  const char *cache_control = revalidate ? (private ? "private, no-cache" : "no-cache")
+                                         : (private ? "private, max-age=" INDEX_MAX_AGE : "public, max-age=" INDEX_MAX_AGE);
+  return lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_ETAG, (const unsigned char *)etag, (int)strlen(etag), p,
+                                      end) ||
+         lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (const unsigned char *)cache_control,
+                                      (int)strlen(cache_control), p, end) ||
+         lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_VARY, (const unsigned char *)"Accept-Encoding", 15, p, end);
+}
+
+static char *body_alloc(size_t len) { return (char *)xmalloc(LWS_PRE + len) + LWS_PRE; }
+
+static void body_free(char *body) {
+  if (body != NULL) free(body - LWS_PRE);
 }
 
 static bool uncompress_html(char **output, size_t *output_len) {
-  if (html_cache == NULL || html_cache_len == 0) {
+  char **body = &html_bodies[ENCODING_IDENTITY];
+  if (*body == NULL) {
     z_stream stream;
     memset(&stream, 0, sizeof(stream));
     if (inflateInit2(&stream, 16 + 15) != Z_OK) return false;
 
-    html_cache_len = index_html_size;
-    html_cache = xmalloc(html_cache_len);
+    *body = body_alloc(index_html_size);
 
     stream.avail_in = index_html_len;
-    stream.avail_out = html_cache_len;
+    stream.avail_out = index_html_size;
     stream.next_in = (void *)index_html;
-    stream.next_out = (void *)html_cache;
+    stream.next_out = (void *)*body;
 
     int ret = inflate(&stream, Z_SYNC_FLUSH);
     inflateEnd(&stream);
     if (ret != Z_STREAM_END) {
-      free(html_cache);
-      html_cache = NULL;
-      html_cache_len = 0;
+      body_free(*body);
+      *body = NULL;
       return false;
     }
   }
 
-  *output = html_cache;
-  *output_len = html_cache_len;
+  *output = *body;
+  *output_len = index_html_size;
 
   return true;
 }
 
+static char *html_body(int encoding, const unsigned char *data, size_t len) {
+  if (html_bodies[encoding] == NULL) {
+    html_bodies[encoding] = body_alloc(len);
+    memcpy(html_bodies[encoding], data, len);
+  }
+  return html_bodies[encoding];
+}
+
 static void pss_buffer_free(struct pss_http *pss) {
-  if (pss->buffer != (char *)index_html && pss->buffer != html_cache) free(pss->buffer);
+  bool shared = false;
+  for (int i = 0; i < ENCODING_COUNT; i++) shared = shared || pss->buffer == html_bodies[i];
+  if (pss->index != NULL) {
+    index_file_put(pss->index);
+    pss->index = NULL;
+  } else if (!shared) {
+    free(pss->buffer);
+  }
+  pss->buffer = NULL;
+}
+
+static bool is_playback_path(const char *path, const char *suffix) {
+  return server->playback_dir != NULL && playback_parse_path(endpoints.playback, path, suffix, NULL, 0);
 }
 
 static void access_log(struct lws *wsi, const char *path) {
@@ -90,11 +205,12 @@ static void access_log(struct lws *wsi, const char *path) {
   lwsl_notice("HTTP %s - %s\n", path, rip);
 }
 
-int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+static int http_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
   struct pss_http *pss = (struct pss_http *)user;
   unsigned char buffer[4096 + LWS_PRE], *p, *end;
   char buf[256];
   bool done = false;
+  bool direct;
 
   switch (reason) {
     case LWS_CALLBACK_HTTP:
@@ -113,7 +229,7 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       p = buffer + LWS_PRE;
       end = p + sizeof(buffer) - LWS_PRE;
 
-      if (strcmp(pss->path, endpoints.token) == 0) {
+      if (strcmp(pss->path, endpoints.token) == 0 || is_playback_path(pss->path, "/token")) {
         const char *credential = server->credential != NULL ? server->credential : "";
         size_t n = sprintf(buf, "{\"token\": \"%s\"}", credential);
         if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
@@ -126,6 +242,28 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
         pss->buffer = pss->ptr = strdup(buf);
         pss->len = n;
+        pss->headroom = false;
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
+      if (server->metrics && strcmp(pss->path, endpoints.metrics) == 0) {
+        char *output;
+        size_t output_len = metrics_render(&output, server->client_count);
+        const char *type = "text/plain; version=0.0.4; charset=utf-8";
+        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)type,
+                                         (int)strlen(type), &p, end) ||
+            lws_add_http_header_content_length(wsi, (unsigned long)output_len, &p, end) ||
+            lws_finalize_http_header(wsi, &p, end) ||
+            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0) {
+          free(output);
+          return 1;
+        }
+
+        pss->buffer = pss->ptr = output;
+        pss->len = output_len;
+        pss->headroom = false;
         lws_callback_on_writable(wsi);
         break;
       }
@@ -141,40 +279,84 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         goto try_to_reuse;
       }
 
-      if (strcmp(pss->path, endpoints.index) != 0) {
+      if (strcmp(pss->path, endpoints.index) != 0 && !is_playback_path(pss->path, "")) {
         lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
         goto try_to_reuse;
       }
 
       const char *content_type = "text/html";
-      if (server->index != NULL) {
+      index_file_t *file = server->index != NULL ? index_file_get() : NULL;
+      if (server->index != NULL && file == NULL) {
         int n = lws_serve_http_file(wsi, server->index, content_type, NULL, 0);
         if (n < 0 || (n > 0 && lws_http_transaction_completed(wsi))) return 1;
       } else {
-        char *output = (char *)index_html;
-        size_t output_len = index_html_len;
-        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
-            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)content_type, 9, &p,
-                                         end))
-          return 1;
-#ifdef LWS_WITH_HTTP_STREAM_COMPRESSION
-        if (!uncompress_html(&output, &output_len)) return 1;
-#else
-        if (accept_gzip(wsi)) {
-          if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)"gzip", 4, &p, end))
-            return 1;
+        char *output = NULL;
+        size_t output_len = 0;
+        size_t sizes[ENCODING_COUNT] = {0};
+        char etag[48];
+        if (file != NULL) {
+          sizes[ENCODING_IDENTITY] = file->len;
+          sizes[ENCODING_GZIP] = file->gz_len;
         } else {
-          if (!uncompress_html(&output, &output_len)) return 1;
+          sizes[ENCODING_IDENTITY] = index_html_size;
+          sizes[ENCODING_GZIP] = index_html_len;
+          sizes[ENCODING_BR] = index_html_br_len;
+          sizes[ENCODING_ZSTD] = index_html_zstd_len;
         }
+        int encoding = ENCODING_IDENTITY;
+#ifndef LWS_WITH_HTTP_STREAM_COMPRESSION
+        encoding = accept_encoding(wsi, sizes);
 #endif
+        make_etag(etag, sizeof(etag), file != NULL ? file->hash : html_hash(), encoding);
+        if (etag_match(wsi, etag)) {
+          index_file_put(file);
+          // no Content-Length: on a 304 it would have to be the one of the 200, caches may store it
+          if (lws_add_http_header_status(wsi, HTTP_STATUS_NOT_MODIFIED, &p, end) ||
+              add_cache_headers(wsi, etag, file != NULL, &p, end) || lws_finalize_http_header(wsi, &p, end) ||
+              lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+            return 1;
+          goto try_to_reuse;
+        }
+
+        switch (encoding) {
+          case ENCODING_GZIP:
+            output = file != NULL ? file->gz : html_body(encoding, index_html, index_html_len);
+            break;
+          case ENCODING_BR:
+            output = html_body(encoding, index_html_br, index_html_br_len);
+            break;
+          case ENCODING_ZSTD:
+            output = html_body(encoding, index_html_zstd, index_html_zstd_len);
+            break;
+          default:
+            if (file != NULL) {
+              output = file->data;
+            } else if (!uncompress_html(&output, &output_len)) {
+              return 1;
+            }
+            break;
+        }
+        output_len = sizes[encoding];
 
-        if (lws_add_http_header_content_length(wsi, (unsigned long)output_len, &p, end) ||
+        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)content_type, 9, &p,
+                                         end) ||
+            add_cache_headers(wsi, etag, file != NULL, &p, end) ||
+            (encoding != ENCODING_IDENTITY &&
+             lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING,
+                                          (const unsigned char *)encoding_names[encoding],
+                                          (int)strlen(encoding_names[encoding]), &p, end)) ||
+            lws_add_http_header_content_length(wsi, (unsigned long)output_len, &p, end) ||
             lws_finalize_http_header(wsi, &p, end) ||
-            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0) {
+          index_file_put(file);
           return 1;
+        }
 
         pss->buffer = pss->ptr = output;
         pss->len = output_len;
+        pss->index = file;
+        pss->headroom = true;
         lws_callback_on_writable(wsi);
       }
       break;
@@ -184,8 +366,11 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         goto try_to_reuse;
       }
 
+      // the index is written straight from memory on http/1, lws_write may use the LWS_PRE bytes it has in front;
+      // h2 streams put the frame header there, which a body shared by several streams can not take
+      direct = pss->headroom && lws_get_network_wsi(wsi) == wsi;
       do {
-        int n = sizeof(buffer) - LWS_PRE;
+        int n = direct ? server->serv_buf_size : (int)(sizeof(buffer) - LWS_PRE);
         int m = lws_get_peer_write_allowance(wsi);
         if (m == 0) {
           lws_callback_on_writable(wsi);
@@ -197,9 +382,13 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
           n = (int)(pss->len - (pss->ptr - pss->buffer));
           done = true;
         }
-        memcpy(buffer + LWS_PRE, pss->ptr, n);
+        unsigned char *data = (unsigned char *)pss->ptr;
+        if (!direct) {
+          memcpy(buffer + LWS_PRE, pss->ptr, n);
+          data = buffer + LWS_PRE;
+        }
         pss->ptr += n;
-        if (lws_write_http(wsi, buffer + LWS_PRE, (size_t)n) < n) {
+        if (lws_write_http(wsi, data, (size_t)n) < n) {
           pss_buffer_free(pss);
           return -1;
         }
@@ -215,6 +404,11 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
     case LWS_CALLBACK_HTTP_FILE_COMPLETION:
       goto try_to_reuse;
+
+    case LWS_CALLBACK_CLOSED_HTTP:
+      // closed in the middle of a body
+      if (pss->buffer != NULL) pss_buffer_free(pss);
+      break;
 #if (defined(LWS_OPENSSL_SUPPORT) || defined(LWS_WITH_TLS)) && !defined(LWS_WITH_MBEDTLS)
     case LWS_CALLBACK_OPENSSL_PERFORM_CLIENT_CERT_VERIFICATION:
       if (!len || (SSL_get_verify_result((SSL *)in) != X509_V_OK)) {
@@ -238,3 +432,11 @@ try_to_reuse:
 
   return 0;
 }
+
+int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  watchdog_scope scope;
+  watchdog_enter(&scope, "callback_http", reason);
+  int ret = http_callback(wsi, reason, user, in, len);
+  watchdog_leave(&scope);
+  return ret;
+}
@@ -0,0 +1,238 @@
+#include "index.h"
+
+#include <libwebsockets.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "utils.h"
+
+// wait for the writes of an editor to settle before reloading (ms)
+#define RELOAD_DELAY 100
+
+static char *path = NULL;
+static const char *name;  // of the file, in the watched directory
+static index_file_t *current = NULL;
+static uv_fs_event_t *watcher = NULL;
+static uv_timer_t *timer = NULL;
+
+// a reload in the thread pool
+typedef struct {
+  uv_work_t work;
+  index_file_t *file;
+  char *path;
+  bool loaded;
+} reload_job;
+
+static reload_job *reloading = NULL;
+static bool reload_again = false;  // the file changed while it was reloaded
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static char *last_separator(const char *s) {
+  char *p = strrchr(s, '/');
+#ifdef _WIN32
+  char *q = strrchr(s, '\\');
+  if (q != NULL && (p == NULL || q > p)) p = q;
+#endif
+  return p;
+}
+
+// the variants are written straight from memory, lws_write may use the LWS_PRE bytes in front of them; not xmalloc:
+// reloads run on a thread of the pool
+static char *body_alloc(size_t len) {
+  char *body = malloc(LWS_PRE + len);
+  return body != NULL ? body + LWS_PRE : NULL;
+}
+
+static void body_free(char *body) {
+  if (body != NULL) free(body - LWS_PRE);
+}
+
+static bool read_file(index_file_t *file, const char *file_path) {
+  FILE *fp = fopen(file_path, "rb");
+  if (fp == NULL) return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size <= 0 || (file->data = body_alloc((size_t)size)) == NULL) {
+    fclose(fp);
+    return false;
+  }
+  file->len = fread(file->data, 1, (size_t)size, fp);
+  fclose(fp);
+  return file->len == (size_t)size;
+}
+
+// gz_len is left 0 if it does not pay off, load_done drops the variant
+static void compress_file(index_file_t *file) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;
+
+  size_t bound = deflateBound(&stream, file->len);
+  file->gz = body_alloc(bound);
+  if (file->gz == NULL) {
+    deflateEnd(&stream);
+    return;
+  }
+  stream.avail_in = file->len;
+  stream.next_in = (void *)file->data;
+  stream.avail_out = bound;
+  stream.next_out = (void *)file->gz;
+
+  int ret = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (ret == Z_STREAM_END && bound - stream.avail_out < file->len) file->gz_len = bound - stream.avail_out;
+}
+
+// read, compress and hash the file; on a thread of the pool for a reload, so what it can not use is freed by
+// load_done on the loop
+static bool load_file(index_file_t *file, const char *file_path) {
+  if (!read_file(file, file_path)) return false;
+  compress_file(file);
+
+  uint64_t h = 14695981039346656037ULL;  // FNV-1a
+  for (size_t i = 0; i < file->len; i++) h = (h ^ (unsigned char)file->data[i]) * 1099511628211ULL;
+  snprintf(file->hash, sizeof(file->hash), "%016llx", (unsigned long long)h);
+  return true;
+}
+
+static index_file_t *load_init() {
+  index_file_t *file = xmalloc(sizeof(index_file_t));
+  memset(file, 0, sizeof(index_file_t));
+  file->refs = 1;
+  return file;
+}
+
+static index_file_t *load_done(index_file_t *file, bool loaded) {
+  if (!loaded) {
+    index_file_put(file);
+    return NULL;
+  }
+  if (file->gz_len == 0) {
+    body_free(file->gz);
+    file->gz = NULL;
+  }
+  return file;
+}
+
+static void reload(uv_timer_t *handle);
+
+static void reload_work_cb(uv_work_t *work) {
+  reload_job *job = (reload_job *)work->data;
+  job->loaded = load_file(job->file, job->path);
+}
+
+static void reload_after_work_cb(uv_work_t *work, int status) {
+  reload_job *job = (reload_job *)work->data;
+  index_file_t *file = load_done(job->file, status == 0 && job->loaded);
+  bool stopped = job != reloading;  // by index_file_free
+  free(job->path);
+  free(job);
+  if (stopped) {
+    index_file_put(file);
+    return;
+  }
+  reloading = NULL;
+
+  if (file == NULL) {
+    lwsl_warn("can not reload index.html: %s, keep serving the previous one\n", path);
+  } else if (strcmp(file->hash, current->hash) == 0) {
+    index_file_put(file);
+  } else {
+    index_file_put(current);
+    current = file;
+    lwsl_notice("reloaded index.html: %s (%zu bytes, %zu gzipped)\n", path, file->len, file->gz_len);
+  }
+  // changed again while it was read
+  if (reload_again) {
+    reload_again = false;
+    reload(timer);
+  }
+}
+
+// the file is read and compressed in the thread pool, one reload at a time
+static void reload(uv_timer_t *handle) {
+  if (reloading != NULL) {
+    reload_again = true;
+    return;
+  }
+  reload_job *job = xmalloc(sizeof(reload_job));
+  memset(job, 0, sizeof(reload_job));
+  job->work.data = job;
+  job->file = load_init();
+  job->path = strdup(path);
+  reloading = job;
+  if (uv_queue_work(handle->loop, &job->work, reload_work_cb, reload_after_work_cb) != 0) {
+    reload_work_cb(&job->work);
+    reload_after_work_cb(&job->work, 0);
+  }
+}
+
+// the directory is watched, so editors replacing the file by a rename are seen too
+static void watch_cb(uv_fs_event_t *handle, const char *filename, int events, int status) {
+  if (status != 0 || (filename != NULL && strcmp(filename, name) != 0)) return;
+  uv_timer_start(timer, reload, RELOAD_DELAY, 0);
+}
+
+bool index_file_init(uv_loop_t *loop, const char *file_path) {
+  path = strdup(file_path);
+  index_file_t *file = load_init();
+  current = load_done(file, load_file(file, path));
+  if (current == NULL) {
+    fprintf(stderr, "ttyd: can not read index.html: %s\n", path);
+    return false;
+  }
+
+  char *dir = strdup(path);
+  char *slash = last_separator(dir);
+  name = last_separator(path) != NULL ? last_separator(path) + 1 : path;
+  if (slash == dir) {
+    slash[1] = '\0';
+  } else if (slash != NULL) {
+    *slash = '\0';
+  } else {
+    strcpy(dir, ".");
+  }
+
+  timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, timer);
+  watcher = xmalloc(sizeof(uv_fs_event_t));
+  uv_fs_event_init(loop, watcher);
+  int err = uv_fs_event_start(watcher, watch_cb, dir, 0);
+  if (err) lwsl_warn("can not watch %s for index.html changes: %s\n", dir, uv_strerror(err));
+  free(dir);
+  return true;
+}
+
+void index_file_free() {
+  if (watcher != NULL) {
+    uv_fs_event_stop(watcher);
+    uv_close((uv_handle_t *)watcher, close_cb);
+    uv_timer_stop(timer);
+    uv_close((uv_handle_t *)timer, close_cb);
+    watcher = NULL;
+  }
+  // a reload still running drops what it read
+  reloading = NULL;
+  reload_again = false;
+  if (current != NULL) index_file_put(current);
+  current = NULL;
+  free(path);
+  path = NULL;
+}
+
+index_file_t *index_file_get() {
+  if (current != NULL) current->refs++;
+  return current;
+}
+
+void index_file_put(index_file_t *file) {
+  if (file == NULL || --file->refs > 0) return;
+  body_free(file->data);
+  body_free(file->gz);
+  free(file);
+}
@@ -0,0 +1,27 @@
+#ifndef TTYD_INDEX_H
+#define TTYD_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+// a version of the custom index (--index), kept in memory until the last response sending it is done; data and gz
+// have LWS_PRE bytes of headroom
+typedef struct {
+  int refs;
+  char *data;
+  size_t len;
+  char *gz;  // gzip variant, NULL if it is not smaller
+  size_t gz_len;
+  char hash[17];  // of data, for the ETag
+} index_file_t;
+
+// Load the file and reload it when it changes
+bool index_file_init(uv_loop_t *loop, const char *path);
+void index_file_free();
+
+// Current version with a reference taken, NULL if none was loaded
+index_file_t *index_file_get();
+void index_file_put(index_file_t *file);
+
+#endif  // TTYD_INDEX_H
@@ -0,0 +1,140 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+struct metrics metrics;
+
+static const double buckets[METRICS_BUCKETS] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+                                                0.05,   0.1,   0.25,   0.5,   1,    5};
+
+typedef struct {
+  char *base;
+  size_t len;
+  size_t cap;
+} text_t;
+
+void metrics_observe(metrics_histogram *h, double value) {
+  int i = 0;
+  while (i < METRICS_BUCKETS && value > buckets[i]) i++;
+  h->counts[i]++;
+  h->count++;
+  h->sum += value;
+}
+
+// upper bound of the bucket holding the quantile, the largest bound for the +Inf bucket
+double metrics_quantile(const metrics_histogram *h, double q) {
+  if (h->count == 0) return 0;
+  uint64_t rank = (uint64_t)(q * h->count + 0.5), count = 0;
+  for (int i = 0; i < METRICS_BUCKETS; i++) {
+    count += h->counts[i];
+    if (count >= rank) return buckets[i];
+  }
+  return buckets[METRICS_BUCKETS - 1];
+}
+
+static void append(text_t *t, const char *fmt, ...) {
+  va_list args;
+  for (;;) {
+    va_start(args, fmt);
+    int n = vsnprintf(t->base + t->len, t->cap - t->len, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    if ((size_t)n < t->cap - t->len) {
+      t->len += n;
+      return;
+    }
+    t->cap = t->cap * 2 + n;
+    t->base = xrealloc(t->base, t->cap);
+  }
+}
+
+static void counter(text_t *t, const char *name, const char *help, uint64_t value) {
+  append(t, "# HELP ttyd_%s %s\n# TYPE ttyd_%s counter\nttyd_%s %llu\n", name, help, name, name,
+         (unsigned long long)value);
+}
+
+static void gauge(text_t *t, const char *name, const char *help, long long value) {
+  append(t, "# HELP ttyd_%s %s\n# TYPE ttyd_%s gauge\nttyd_%s %lld\n", name, help, name, name, value);
+}
+
+static void histogram(text_t *t, const char *name, const char *help, const metrics_histogram *h) {
+  uint64_t count = 0;
+  append(t, "# HELP ttyd_%s %s\n# TYPE ttyd_%s histogram\n", name, help, name);
+  for (int i = 0; i < METRICS_BUCKETS; i++) {
+    count += h->counts[i];
+    append(t, "ttyd_%s_bucket{le=\"%g\"} %llu\n", name, buckets[i], (unsigned long long)count);
+  }
+  append(t, "ttyd_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+  append(t, "ttyd_%s_sum %g\nttyd_%s_count %llu\n", name, h->sum, name, (unsigned long long)h->count);
+}
+
+size_t metrics_render(char **out, int sessions) {
+  text_t t = {xmalloc(4096), 0, 4096};
+
+  gauge(&t, "sessions", "Connected websocket sessions.", sessions);
+  counter(&t, "sessions_total", "Websocket sessions accepted.", metrics.sessions_total);
+  counter(&t, "spawns_total", "Processes started.", metrics.spawns_total);
+  counter(&t, "spawn_failures_total", "Processes failed to start.", metrics.spawn_failures_total);
+  histogram(&t, "spawn_seconds", "Time to start a process.", &metrics.spawn_seconds);
+  counter(&t, "input_bytes_total", "Input bytes received from clients.", metrics.input_bytes_total);
+  counter(&t, "output_bytes_total", "Output bytes sent to clients.", metrics.output_bytes_total);
+  counter(&t, "output_frames_total", "Output messages sent to clients.", metrics.output_frames_total);
+  counter(&t, "output_deflate_messages_total", "Output messages sent compressed.",
+          metrics.output_deflate_messages_total);
+  counter(&t, "output_deflate_in_bytes_total", "Output bytes sent compressed, before compression.",
+          metrics.output_deflate_in_bytes_total);
+  counter(&t, "output_deflate_out_bytes_total", "Output bytes sent compressed, after compression.",
+          metrics.output_deflate_out_bytes_total);
+  counter(&t, "output_deflate_skipped_total", "Output messages sent as is, compression did not pay for itself.",
+          metrics.output_deflate_skipped_total);
+  counter(&t, "deflate_peer_refused_total", "Connections refused compression for the class of their peer.",
+          metrics.deflate_peer_refused_total);
+  counter(&t, "pause_total", "Flow control pauses requested by clients.", metrics.pause_total);
+  counter(&t, "resume_total", "Flow control resumes requested by clients.", metrics.resume_total);
+  gauge(&t, "output_queue_bytes", "Output bytes waiting to be sent.", (long long)metrics.output_queue_bytes);
+  gauge(&t, "output_deflate_jobs", "Output messages being compressed in the thread pool.",
+        (long long)metrics.output_deflate_jobs);
+  counter(&t, "resize_total", "Terminal resizes requested by clients.", metrics.resize_total);
+  counter(&t, "auth_failures_total", "Rejected credentials and tokens.", metrics.auth_failures_total);
+  gauge(&t, "queue_length", "Sessions waiting for a free slot.", (long long)metrics.queue_length);
+  counter(&t, "queued_total", "Sessions that waited for a free slot.", metrics.queued_total);
+  counter(&t, "queue_timeouts_total", "Sessions closed after waiting too long.", metrics.queue_timeouts_total);
+  gauge(&t, "viewers", "Read-only viewers of sessions.", (long long)metrics.viewers);
+  counter(&t, "view_frames_total", "Output messages built once for all the viewers of a session.",
+          metrics.view_frames_total);
+  counter(&t, "viewers_behind_total", "Viewers closed for falling behind the output.", metrics.viewers_behind_total);
+  gauge(&t, "hibernated_sessions", "Idle sessions with their buffers released.", (long long)metrics.hibernated_sessions);
+  gauge(&t, "history_sessions", "Detached sessions keeping their output.", (long long)metrics.history_sessions);
+  gauge(&t, "history_bytes", "Memory used by the kept output of detached sessions.", (long long)metrics.history_bytes);
+  gauge(&t, "history_raw_bytes", "Kept output of detached sessions, uncompressed.", (long long)metrics.history_raw_bytes);
+  gauge(&t, "history_spilled_bytes", "Kept output of detached sessions spilled to disk.",
+        (long long)metrics.history_spilled_bytes);
+  gauge(&t, "pressure_stage", "Memory pressure load shedding stage, 0 for none.", (long long)metrics.pressure_stage);
+  gauge(&t, "cgroup_memory_bytes", "Memory used by the cgroup of ttyd.", (long long)metrics.cgroup_memory_bytes);
+  append(&t, "# HELP ttyd_pressure_stage_entries_total Memory pressure stages entered.\n"
+             "# TYPE ttyd_pressure_stage_entries_total counter\n");
+  for (int i = PRESSURE_SHRINK; i < PRESSURE_STAGES; i++) {
+    append(&t, "ttyd_pressure_stage_entries_total{stage=\"%s\"} %llu\n", pressure_stage_name(i),
+           (unsigned long long)metrics.pressure_stage_entries_total[i]);
+  }
+  counter(&t, "pressure_shrinks_total", "Sessions whose buffers were released under memory pressure.",
+          metrics.pressure_shrinks_total);
+  counter(&t, "pressure_deflate_refused_total", "Connections refused compression under memory pressure.",
+          metrics.pressure_deflate_refused_total);
+  counter(&t, "pressure_spawns_refused_total", "Clients refused a process under memory pressure.",
+          metrics.pressure_spawns_refused_total);
+  counter(&t, "pressure_evictions_total", "Idle sessions closed under memory pressure.",
+          metrics.pressure_evictions_total);
+  histogram(&t, "loop_lag_seconds", "Time the event loop was busy per iteration.", &metrics.loop_lag_seconds);
+  counter(&t, "loop_stalls_total", "Event loop iterations over the stall threshold.", metrics.loop_stalls_total);
+  histogram(&t, "rtt_seconds", "Websocket round trip time.", &metrics.rtt_seconds);
+  histogram(&t, "echo_seconds", "Time from INPUT arrival to the next OUTPUT sent.", &metrics.echo_seconds);
+
+  *out = t.base;
+  return t.len;
+}
@@ -0,0 +1,69 @@
+#ifndef TTYD_METRICS_H
+#define TTYD_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pressure.h"
+
+// histogram buckets, shared by all histograms (seconds)
+#define METRICS_BUCKETS 12
+
+typedef struct {
+  uint64_t counts[METRICS_BUCKETS + 1];  // per bucket, the last one is +Inf
+  uint64_t count;
+  double sum;
+} metrics_histogram;
+
+// updated from the event loop thread only, so plain fields are enough
+struct metrics {
+  uint64_t sessions_total;        // websocket sessions accepted
+  uint64_t spawns_total;          // processes started
+  uint64_t spawn_failures_total;  // processes failed to start
+  metrics_histogram spawn_seconds;
+  uint64_t input_bytes_total;     // INPUT payload received
+  uint64_t output_bytes_total;    // OUTPUT payload sent
+  uint64_t output_frames_total;   // OUTPUT messages sent
+  uint64_t output_deflate_messages_total;  // OUTPUT_DEFLATED messages sent
+  uint64_t output_deflate_in_bytes_total;  // their output, before compression
+  uint64_t output_deflate_out_bytes_total;
+  uint64_t output_deflate_skipped_total;   // messages sent as is, compression did not pay
+  uint64_t deflate_peer_refused_total;     // connections refused compression for their peer (--compress)
+  uint64_t pause_total;           // PAUSE received
+  uint64_t resume_total;          // RESUME received
+  int64_t output_queue_bytes;     // output read from the pty, not sent yet
+  int64_t output_deflate_jobs;    // output being compressed in the thread pool (--compress-threads)
+  uint64_t resize_total;          // RESIZE_TERMINAL received
+  uint64_t auth_failures_total;   // rejected credentials or tokens
+  int64_t queue_length;           // sessions waiting for a free slot
+  uint64_t queued_total;          // sessions that had to wait
+  uint64_t queue_timeouts_total;  // sessions closed after --queue-timeout
+  int64_t viewers;                // read-only viewers of sessions (--max-viewers)
+  uint64_t view_frames_total;     // output messages built once for the viewers of a session
+  uint64_t viewers_behind_total;  // viewers closed for falling behind
+  int64_t hibernated_sessions;    // sessions idle for --idle-timeout
+  int64_t history_sessions;       // detached sessions keeping their output (--history)
+  int64_t history_bytes;          // memory used by the kept output, compressed
+  int64_t history_raw_bytes;      // kept output, before compression
+  int64_t history_spilled_bytes;  // kept output moved to disk (--history-budget)
+  int64_t pressure_stage;         // load shedding stage (--memory-pressure)
+  int64_t cgroup_memory_bytes;    // memory.current of the cgroup
+  uint64_t pressure_stage_entries_total[PRESSURE_STAGES];
+  uint64_t pressure_shrinks_total;          // sessions whose buffers were released
+  uint64_t pressure_deflate_refused_total;  // connections refused permessage-deflate
+  uint64_t pressure_spawns_refused_total;   // clients refused a new process
+  uint64_t pressure_evictions_total;        // idle or detached sessions closed
+  metrics_histogram loop_lag_seconds;
+  uint64_t loop_stalls_total;  // iterations over the stall threshold
+  metrics_histogram rtt_seconds;
+  metrics_histogram echo_seconds;
+};
+
+extern struct metrics metrics;
+
+void metrics_observe(metrics_histogram *h, double value);
+double metrics_quantile(const metrics_histogram *h, double q);
+size_t metrics_render(char **out, int sessions);
+
+#endif  // TTYD_METRICS_H
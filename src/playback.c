@@ -0,0 +1,434 @@
+#include "playback.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "watchdog.h"
+
+#define READAHEAD_SIZE (64 * 1024)
+#define OUTPUT_SIZE PTY_BUF_SIZE
+#define HEADER_SIZE 12
+#define SEEK_STEP 5000000
+#define MIN_SPEED 0.0625
+#define MAX_SPEED 16
+
+#ifdef _WIN32
+#define pread(fd, buf, n, off) (lseek(fd, off, SEEK_SET) < 0 ? -1 : read(fd, buf, n))
+#endif
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static uint32_t read_le32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t header_ts(const unsigned char *p) { return (uint64_t)read_le32(p) * 1000000 + read_le32(p + 4); }
+
+bool playback_parse_path(const char *prefix, const char *path, const char *suffix, char *name, size_t len) {
+  size_t prefix_len = strlen(prefix);
+  if (strncmp(path, prefix, prefix_len) != 0 || path[prefix_len] != '/') return false;
+
+  const char *start = path + prefix_len + 1;
+  const char *end = start + strcspn(start, "/");
+  if (end == start || *start == '.' || strcmp(end, suffix) != 0) return false;
+
+  if (name != NULL) {
+    size_t n = (size_t)(end - start);
+    if (n >= len) return false;
+    memcpy(name, start, n);
+    name[n] = '\0';
+  }
+  return true;
+}
+
+// a read of the next readahead buffer, in the thread pool
+struct playback_read_ {
+  uv_fs_t req;
+  playback_t *pb;  // NULL once the playback is freed, the read then closes fd and frees base
+  int fd;
+  char *base;
+};
+
+static void schedule(playback_t *pb);
+
+static void readahead_cb(uv_fs_t *req);
+
+// read the bytes after buf into next, each readahead buffer has HEADER_SIZE bytes of headroom
+static void readahead_start(playback_t *pb) {
+  if (pb->reading || pb->next_ready) return;
+  struct playback_read_ *rd = pb->read;
+  rd->req.data = rd;
+  rd->fd = pb->fd;
+  rd->base = pb->next;
+  uv_buf_t b = uv_buf_init(pb->next + HEADER_SIZE, READAHEAD_SIZE);
+  if (uv_fs_read(pb->loop, &rd->req, pb->fd, &b, 1, pb->offset, readahead_cb) != 0) {
+    pb->next_len = 0;
+    pb->next_ready = true;
+    return;
+  }
+  pb->reading = true;
+}
+
+static void readahead_cb(uv_fs_t *req) {
+  struct playback_read_ *rd = (struct playback_read_ *)req->data;
+  playback_t *pb = rd->pb;
+  ssize_t n = req->result;
+  uv_fs_req_cleanup(req);
+
+  if (pb == NULL) {
+    close(rd->fd);
+    free(rd->base);
+    free(rd);
+    return;
+  }
+
+  pb->reading = false;
+  if (pb->stale) {
+    pb->stale = false;
+    readahead_start(pb);
+    return;
+  }
+  pb->next_len = n > 0 ? (size_t)n : 0;
+  pb->next_ready = true;
+  if (pb->starved) {
+    pb->starved = false;
+    schedule(pb);
+  }
+}
+
+// swap in the buffer read ahead, keeping the unconsumed bytes (fewer than HEADER_SIZE) in its headroom,
+// false at the end of the file, or with pb->starved set while the read is still in flight
+static bool fill(playback_t *pb) {
+  if (!pb->next_ready) {
+    pb->starved = true;
+    readahead_start(pb);
+    return false;
+  }
+  if (pb->next_len == 0) return false;
+
+  size_t left = pb->buf_len - pb->buf_pos;
+  char *base = pb->next;
+  memcpy(base + HEADER_SIZE - left, pb->buf + pb->buf_pos, left);
+  pb->next = pb->buf;
+  pb->buf = base;
+  pb->buf_pos = HEADER_SIZE - left;
+  pb->buf_len = HEADER_SIZE + pb->next_len;
+  pb->offset += pb->next_len;
+  pb->next_ready = false;
+  readahead_start(pb);
+  return true;
+}
+
+static bool next_frame(playback_t *pb) {
+  while (pb->buf_len - pb->buf_pos < HEADER_SIZE) {
+    if (!fill(pb)) return false;
+  }
+
+  const unsigned char *p = (unsigned char *)pb->buf + pb->buf_pos;
+  uint64_t ts = header_ts(p);
+  if (pb->offset - (int64_t)pb->buf_len + (int64_t)pb->buf_pos == 0) pb->start = ts;
+  pb->frame_ts = ts > pb->start ? ts - pb->start : 0;
+  pb->frame_left = read_le32(p + 8);
+  pb->buf_pos += HEADER_SIZE;
+  pb->has_frame = true;
+  return true;
+}
+
+static void rewind_file(playback_t *pb) {
+  pb->offset = 0;
+  pb->buf_len = pb->buf_pos = 0;
+  pb->next_ready = false;
+  pb->stale = pb->reading;
+  readahead_start(pb);
+  pb->has_frame = false;
+  pb->position = 0;
+  pb->eof = false;
+}
+
+// a scan of the duration, it reads the whole recording so it runs in the thread pool
+struct playback_scan_ {
+  uv_work_t work;
+  playback_t *pb;  // NULL once the playback is freed
+  char *path;
+  uint64_t duration;
+};
+
+static uint64_t scan_duration(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  unsigned char p[HEADER_SIZE];
+  int64_t off = 0;
+  uint64_t start = 0, ts = 0;
+
+  while (pread(fd, p, HEADER_SIZE, off) == HEADER_SIZE) {
+    ts = header_ts(p);
+    if (off == 0) start = ts;
+    off += HEADER_SIZE + read_le32(p + 8);
+  }
+  close(fd);
+  return ts > start ? ts - start : 0;
+}
+
+static void advance_clock(playback_t *pb) {
+  uint64_t now = uv_now(pb->loop);
+  if (!pb->paused && !pb->held && !pb->seeking && !pb->eof) pb->position += (uint64_t)((now - pb->tick) * 1000 * pb->speed);
+  pb->tick = now;
+}
+
+static void timer_cb(uv_timer_t *timer);
+
+static void schedule(playback_t *pb) {
+  uv_timer_stop(pb->timer);
+  if (pb->waiting || pb->starved || pb->held || pb->eof || (pb->paused && !pb->seeking)) return;
+
+  // rounded up, libuv runs a timer of 0 rearmed in its callback again before the clock moves
+  uint64_t delay = 0;
+  if (!pb->seeking && pb->frame_ts > pb->position) {
+    double ms = (pb->frame_ts - pb->position) / 1000.0 / pb->speed;
+    delay = (uint64_t)ms;
+    if (delay < ms) delay++;
+  }
+  uv_timer_start(pb->timer, timer_cb, delay, 0);
+}
+
+static void emit(playback_t *pb) {
+  pty_buf_t *buf = pty_buf_get(OUTPUT_SIZE);
+  char *out = buf->base;
+  size_t len = 0;
+
+  if (pb->reset) {
+    len = sprintf(out, "\x1b" "c");
+    pb->reset = false;
+  }
+
+  while (len < OUTPUT_SIZE && !pb->starved) {
+    if (!pb->has_frame && !next_frame(pb)) {
+      if (!pb->starved) pb->eof = true;
+      break;
+    }
+    if (pb->frame_ts > (pb->seeking ? pb->target : pb->position)) break;
+
+    while (pb->frame_left > 0 && len < OUTPUT_SIZE) {
+      if (pb->buf_pos == pb->buf_len && !fill(pb)) {
+        if (!pb->starved) pb->frame_left = 0;
+        break;
+      }
+      size_t n = pb->buf_len - pb->buf_pos;
+      if (n > pb->frame_left) n = pb->frame_left;
+      if (n > OUTPUT_SIZE - len) n = OUTPUT_SIZE - len;
+      memcpy(out + len, pb->buf + pb->buf_pos, n);
+      pb->buf_pos += n;
+      pb->frame_left -= (uint32_t)n;
+      len += n;
+    }
+    if (pb->frame_left == 0) pb->has_frame = false;
+  }
+
+  if (pb->seeking && (pb->eof || (pb->has_frame && pb->frame_ts > pb->target))) {
+    pb->seeking = false;
+    pb->position = pb->target;
+    pb->tick = uv_now(pb->loop);
+  }
+
+  if (len == 0) {
+    pty_buf_free(buf);
+    return;
+  }
+
+  buf->len = len;
+  pb->waiting = true;
+  pb->read_cb(pb, buf, false);
+}
+
+static void timer_cb(uv_timer_t *timer) {
+  playback_t *pb = (playback_t *)timer->data;
+  watchdog_scope scope;
+  watchdog_enter(&scope, "playback", -1);
+  advance_clock(pb);
+  emit(pb);
+  schedule(pb);
+  watchdog_leave(&scope);
+}
+
+static void seek(playback_t *pb, uint64_t target) {
+  advance_clock(pb);
+  if (target < pb->position) {
+    rewind_file(pb);
+    pb->reset = true;
+  }
+  pb->target = target;
+  pb->seeking = true;
+  pb->eof = false;
+  schedule(pb);
+}
+
+static void scan_work_cb(uv_work_t *work) {
+  struct playback_scan_ *scan = (struct playback_scan_ *)work->data;
+  scan->duration = scan_duration(scan->path);
+}
+
+static void scan_after_work_cb(uv_work_t *work, int status) {
+  struct playback_scan_ *scan = (struct playback_scan_ *)work->data;
+  playback_t *pb = scan->pb;
+  if (pb != NULL) {
+    pb->scan = NULL;
+    pb->scanned = true;
+    pb->duration = status == 0 ? scan->duration : 0;
+    if (pb->seek_tenths >= 0) seek(pb, pb->duration / 10 * (uint64_t)pb->seek_tenths);
+    pb->seek_tenths = -1;
+  }
+  free(scan->path);
+  free(scan);
+}
+
+// seek to tenths of the duration, once it is known
+static void seek_percent(playback_t *pb, int tenths) {
+  if (pb->scanned) {
+    seek(pb, pb->duration / 10 * (uint64_t)tenths);
+    return;
+  }
+  pb->seek_tenths = tenths;
+  if (pb->scan != NULL) return;
+
+  struct playback_scan_ *scan = xmalloc(sizeof(struct playback_scan_));
+  memset(scan, 0, sizeof(struct playback_scan_));
+  scan->work.data = scan;
+  scan->pb = pb;
+  scan->path = strdup(pb->path);
+  pb->scan = scan;
+  if (uv_queue_work(pb->loop, &scan->work, scan_work_cb, scan_after_work_cb) != 0) {
+    scan->duration = scan_duration(scan->path);
+    scan_after_work_cb(&scan->work, 0);
+  }
+}
+
+playback_t *playback_init(void *ctx, uv_loop_t *loop, const char *dir, const char *name) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  playback_t *pb = xmalloc(sizeof(playback_t));
+  memset(pb, 0, sizeof(playback_t));
+  pb->fd = fd;
+  pb->name = strdup(name);
+  pb->path = strdup(path);
+  pb->buf = xmalloc(HEADER_SIZE + READAHEAD_SIZE);
+  pb->next = xmalloc(HEADER_SIZE + READAHEAD_SIZE);
+  pb->speed = 1;
+  pb->seek_tenths = -1;
+  pb->ctx = ctx;
+  pb->loop = loop;
+  pb->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, pb->timer);
+  pb->timer->data = pb;
+  pb->read = xmalloc(sizeof(struct playback_read_));
+  pb->read->pb = pb;
+  readahead_start(pb);
+  return pb;
+}
+
+void playback_free(playback_t *pb) {
+  if (pb == NULL) return;
+  uv_timer_stop(pb->timer);
+  uv_close((uv_handle_t *)pb->timer, close_cb);
+  // a scan still running frees itself when it is done
+  if (pb->scan != NULL) pb->scan->pb = NULL;
+  // so does a read still in flight, with the fd and the buffer it reads into
+  if (pb->reading) {
+    pb->read->pb = NULL;
+  } else {
+    close(pb->fd);
+    free(pb->next);
+    free(pb->read);
+  }
+  free(pb->name);
+  free(pb->path);
+  free(pb->buf);
+  free(pb);
+}
+
+void playback_start(playback_t *pb, playback_read_cb read_cb) {
+  pb->read_cb = read_cb;
+  pb->tick = uv_now(pb->loop);
+  if (!pb->has_frame && !next_frame(pb) && !pb->starved) pb->eof = true;
+  schedule(pb);
+}
+
+void playback_pause(playback_t *pb) {
+  if (pb == NULL || pb->held) return;
+  advance_clock(pb);
+  pb->held = true;
+  schedule(pb);
+}
+
+void playback_resume(playback_t *pb) {
+  if (pb == NULL || !pb->held) return;
+  advance_clock(pb);
+  pb->held = false;
+  schedule(pb);
+}
+
+void playback_next(playback_t *pb) {
+  if (pb == NULL) return;
+  pb->waiting = false;
+  schedule(pb);
+}
+
+// keyboard controls: space to pause/resume, +/- to change speed,
+// left/right arrow to seek by 5 seconds, 0-9 to seek to 0%-90%
+void playback_control(playback_t *pb, const char *buf, size_t len) {
+  if (pb == NULL || pb->read_cb == NULL) return;
+
+  for (size_t i = 0; i < len; i++) {
+    char c = buf[i];
+    if (c == '\x1b' && i + 2 < len && (buf[i + 1] == '[' || buf[i + 1] == 'O')) {
+      c = buf[i + 2];
+      i += 2;
+      if (c == 'C') {
+        seek(pb, pb->position + SEEK_STEP);
+      } else if (c == 'D') {
+        seek(pb, pb->position > SEEK_STEP ? pb->position - SEEK_STEP : 0);
+      }
+      continue;
+    }
+
+    advance_clock(pb);
+    switch (c) {
+      case ' ':
+      case 'p':
+        if (pb->eof) {
+          pb->paused = false;
+          seek(pb, 0);
+          break;
+        }
+        pb->paused = !pb->paused;
+        break;
+      case '+':
+      case '=':
+        if (pb->speed < MAX_SPEED) pb->speed *= 2;
+        break;
+      case '-':
+      case '_':
+        if (pb->speed > MIN_SPEED) pb->speed /= 2;
+        break;
+      default:
+        if (c >= '0' && c <= '9') seek_percent(pb, c - '0');
+        continue;
+    }
+    schedule(pb);
+  }
+}
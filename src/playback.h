@@ -0,0 +1,72 @@
+#ifndef TTYD_PLAYBACK_H
+#define TTYD_PLAYBACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "pty.h"
+
+struct playback_;
+typedef struct playback_ playback_t;
+struct playback_scan_;
+struct playback_read_;
+typedef void (*playback_read_cb)(playback_t *, pty_buf_t *, bool);
+
+struct playback_ {
+  int fd;
+  char *name;
+  char *path;
+
+  // readahead, double buffered: buf is parsed while next is read into in the thread pool
+  char *buf;
+  size_t buf_len;
+  size_t buf_pos;
+  int64_t offset;  // file offset of buf end
+  char *next;
+  size_t next_len;
+  bool next_ready;  // next holds the next_len bytes after buf, 0 at the end of the file
+  bool reading;     // a read into next is in flight
+  bool stale;       // the read in flight is from before a rewind
+  bool starved;     // output waits for the read in flight
+
+  // current frame, timestamps are relative to the first frame (us)
+  bool has_frame;
+  uint64_t start;
+  uint64_t frame_ts;
+  uint32_t frame_left;
+
+  uint64_t position;  // playback clock (us)
+  uint64_t target;    // fast forward target when seeking (us)
+  uint64_t duration;  // recording duration, scanned in the thread pool on the first seek by percent (us)
+  uint64_t tick;      // loop time of last clock update (ms)
+  double speed;
+
+  bool paused;   // paused by user
+  bool held;     // paused by client flow control
+  bool waiting;  // output handed to consumer, waiting for resume
+  bool seeking;  // fast forwarding to target
+  bool reset;    // terminal reset must precede next output
+  bool eof;
+  bool scanned;     // duration is known
+  int seek_tenths;  // seek by percent waiting for the duration, -1 if none
+
+  uv_loop_t *loop;
+  struct playback_scan_ *scan;
+  struct playback_read_ *read;
+  uv_timer_t *timer;
+
+  playback_read_cb read_cb;
+  void *ctx;
+};
+
+bool playback_parse_path(const char *prefix, const char *path, const char *suffix, char *name, size_t len);
+playback_t *playback_init(void *ctx, uv_loop_t *loop, const char *dir, const char *name);
+void playback_free(playback_t *pb);
+void playback_start(playback_t *pb, playback_read_cb read_cb);
+void playback_pause(playback_t *pb);
+void playback_resume(playback_t *pb);
+void playback_next(playback_t *pb);
+void playback_control(playback_t *pb, const char *buf, size_t len);
+
+#endif  // TTYD_PLAYBACK_H
@@ -0,0 +1,151 @@
+#include "pressure.h"
+
+#include <libwebsockets.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+// mount point of the unified (v2) hierarchy
+#ifndef PRESSURE_CGROUP_ROOT
+#define PRESSURE_CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+// time between two checks (ms)
+#define PRESSURE_INTERVAL 1000
+// checks in a row below the current stage before it is lowered by one
+#define PRESSURE_COOLDOWN 10
+
+static const char *stage_names[PRESSURE_STAGES] = {"none", "shrink", "no-deflate", "no-spawn", "evict"};
+// share of the last 10 seconds some task waited for memory (%, PSI "some avg10") at which each stage starts
+static const double psi_thresholds[PRESSURE_STAGES] = {0, 5, 10, 20, 40};
+
+static uv_timer_t *timer = NULL;
+static char *cgroup = NULL;  // directory of the cgroup of ttyd
+static int start_percent;
+static pressure_cb callback;
+static int stage = PRESSURE_NONE;
+static int calm = 0;
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static bool read_file(const char *name, char *buf, size_t size) {
+  size_t len = strlen(cgroup) + strlen(name) + 2;
+  char *path = xmalloc(len);
+  snprintf(path, len, "%s/%s", cgroup, name);
+  FILE *f = fopen(path, "r");
+  free(path);
+  if (f == NULL) return false;
+  size_t n = fread(buf, 1, size - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  return n > 0;
+}
+
+// 0 if missing or "max"
+static uint64_t read_bytes(const char *name) {
+  char buf[32];
+  return read_file(name, buf, sizeof(buf)) ? strtoull(buf, NULL, 10) : 0;
+}
+
+// -1 if missing, the kernel has no PSI or it is disabled
+static double read_psi() {
+  char buf[256];
+  if (!read_file("memory.pressure", buf, sizeof(buf))) return -1;
+  char *p = strstr(buf, "some avg10=");
+  return p != NULL ? strtod(p + strlen("some avg10="), NULL) : -1;
+}
+
+// the stage the cgroup is at now: from start_percent of the limit to the limit in equal steps, or by the stalls
+static int measure(uint64_t *current, double *psi) {
+  int target = PRESSURE_NONE;
+  uint64_t limit = read_bytes("memory.max");
+  if (limit == 0) limit = read_bytes("memory.high");
+  *current = read_bytes("memory.current");
+  if (*current > 0 && limit > 0) {
+    double percent = *current * 100.0 / limit;
+    if (percent >= start_percent)
+      target = PRESSURE_SHRINK + (int)((percent - start_percent) * (PRESSURE_STAGES - 1) / (100 - start_percent));
+  }
+  *psi = read_psi();
+  for (int s = PRESSURE_STAGES - 1; s > target; s--) {
+    if (*psi >= psi_thresholds[s]) target = s;
+  }
+  return target < PRESSURE_EVICT ? target : PRESSURE_EVICT;
+}
+
+// up at once, down one stage at a time once it stayed lower for PRESSURE_COOLDOWN checks
+static void timer_cb(uv_timer_t *handle) {
+  uint64_t current;
+  double psi;
+  int target = measure(&current, &psi);
+  int previous = stage;
+  if (target >= stage) {
+    while (stage < target) metrics.pressure_stage_entries_total[++stage]++;
+    calm = 0;
+  } else if (++calm >= PRESSURE_COOLDOWN) {
+    stage--;
+    calm = 0;
+  }
+  metrics.pressure_stage = stage;
+  metrics.cgroup_memory_bytes = (int64_t)current;
+
+  if (stage > previous) {
+    lwsl_warn("memory pressure: stage %s, cgroup memory: %llu bytes, stalled: %.2f%%\n", stage_names[stage],
+              (unsigned long long)current, psi < 0 ? 0 : psi);
+  } else if (stage < previous) {
+    lwsl_notice("memory pressure: back to stage %s\n", stage_names[stage]);
+  }
+  if (stage > PRESSURE_NONE || previous > PRESSURE_NONE) callback(stage);
+}
+
+bool pressure_init(uv_loop_t *loop, int percent, pressure_cb cb) {
+  // the path of the cgroup on the unified hierarchy, "0::/path"
+  char line[512];
+  char *path = NULL;
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  while (f != NULL && path == NULL && fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "0::", 3) != 0) continue;
+    line[strcspn(line, "\n")] = '\0';
+    path = line + 3;
+  }
+  if (f != NULL) fclose(f);
+  if (path == NULL) {
+    lwsl_err("memory pressure: ttyd is not in a cgroup v2\n");
+    return false;
+  }
+
+  size_t len = strlen(PRESSURE_CGROUP_ROOT) + strlen(path) + 1;
+  cgroup = xmalloc(len);
+  snprintf(cgroup, len, "%s%s", PRESSURE_CGROUP_ROOT, strcmp(path, "/") == 0 ? "" : path);
+  if (read_bytes("memory.current") == 0 && read_psi() < 0) {
+    lwsl_err("memory pressure: no memory controller in the cgroup %s\n", cgroup);
+    free(cgroup);
+    cgroup = NULL;
+    return false;
+  }
+
+  start_percent = percent;
+  callback = cb;
+  timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, timer);
+  uv_timer_start(timer, timer_cb, PRESSURE_INTERVAL, PRESSURE_INTERVAL);
+  // ttyd exits on its own terms, not when only the checks are left
+  uv_unref((uv_handle_t *)timer);
+  return true;
+}
+
+void pressure_free() {
+  if (timer == NULL) return;
+  uv_timer_stop(timer);
+  uv_close((uv_handle_t *)timer, close_cb);
+  timer = NULL;
+  free(cgroup);
+  cgroup = NULL;
+}
+
+int pressure_stage() { return stage; }
+
+const char *pressure_stage_name(int s) { return stage_names[s]; }
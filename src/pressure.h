@@ -0,0 +1,26 @@
+#ifndef TTYD_PRESSURE_H
+#define TTYD_PRESSURE_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+// load shedding stages, each one keeps the measures of the ones below
+enum pressure_stage {
+  PRESSURE_NONE,
+  PRESSURE_SHRINK,      // hidden clients buffer less output, idle buffers are released
+  PRESSURE_NO_DEFLATE,  // new connections go without permessage-deflate
+  PRESSURE_NO_SPAWN,    // no new process is started
+  PRESSURE_EVICT,       // idle and detached sessions are closed, one per check
+  PRESSURE_STAGES,
+};
+
+// called after every check while the stage is not PRESSURE_NONE, and once when it goes back to it
+typedef void (*pressure_cb)(int stage);
+
+// Watch the memory of the cgroup (v2) ttyd runs in, escalate from percent of its limit, or on memory stalls (PSI)
+bool pressure_init(uv_loop_t *loop, int percent, pressure_cb cb);
+void pressure_free();
+int pressure_stage();
+const char *pressure_stage_name(int stage);
+
+#endif  // TTYD_PRESSURE_H
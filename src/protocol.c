@@ -1,38 +1,91 @@
 #include <errno.h>
 #include <json.h>
 #include <libwebsockets.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "pty.h"
 #include "server.h"
 #include "utils.h"
 
+// output buffered for a hidden client before the pty is paused
+#define HIDDEN_BUF_SIZE (256 * 1024)
+// the same under memory pressure (--memory-pressure)
+#define PRESSURE_HIDDEN_BUF_SIZE (16 * 1024)
+// screen-diff frame interval for a hidden client (ms)
+#define HIDDEN_FRAME_INTERVAL 1000
+// a session handed over on upgrade is killed if its client does not come back in time (ms)
+#define DETACHED_TIMEOUT 60000
+// output a viewer (--max-viewers) may have waiting before it is closed
+#define VIEW_QUEUE_SIZE (1024 * 1024)
+// at most one malloc_trim per interval, when sessions hibernate (ms)
+#define TRIM_INTERVAL 1000
+
 // initial message list
-static char initial_cmds[] = {SET_WINDOW_TITLE, SET_PREFERENCES};
+static char initial_cmds[] = {SET_WINDOW_TITLE, SET_PREFERENCES, SET_SESSION};
 
-static int send_initial_message(struct lws *wsi, int index) {
-  unsigned char message[LWS_PRE + 1 + 4096];
-  unsigned char *p = &message[LWS_PRE];
+// sessions with a process, linked by session_next
+static struct pss_tty *sessions = NULL;
+// the sessions were handed over to a new ttyd, their processes are left running
+static bool handed_off = false;
+
+static int tty_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+static void detached_exited(pty_process *process);
+
+// ask for a writable callback, a tty-mux connection serves the channels asking in turn
+static void request_write(struct pss_tty *pss) {
+  pss->want_write = true;
+  lws_callback_on_writable(pss->wsi);
+}
+
+static size_t hidden_buf_size() {
+  return pressure_stage() >= PRESSURE_SHRINK ? PRESSURE_HIDDEN_BUF_SIZE : HIDDEN_BUF_SIZE;
+}
+
+// write a message built after LWS_PRE + MUX_HEADER bytes, the id of a tty-mux channel goes in front
+static int pss_write(struct pss_tty *pss, unsigned char *p, size_t n, enum lws_write_protocol protocol) {
+  if (pss->mux == NULL) return lws_write(pss->wsi, p, n, protocol);
+
+  p -= MUX_HEADER;
+  p[0] = (unsigned char)(pss->channel >> 8);
+  p[1] = (unsigned char)(pss->channel & 0xff);
+  int ret = lws_write(pss->wsi, p, n + MUX_HEADER, protocol);
+  return ret < MUX_HEADER ? ret : ret - MUX_HEADER;
+}
+
+static int send_initial_message(struct lws *wsi, struct pss_tty *pss, int index) {
+  unsigned char message[LWS_PRE + MUX_HEADER + 1 + 4096];
+  unsigned char *p = &message[LWS_PRE + MUX_HEADER];
   char buffer[128];
   int n = 0;
 
   char cmd = initial_cmds[index];
   switch (cmd) {
     case SET_WINDOW_TITLE:
+      if (pss->playback != NULL) {
+        n = snprintf((char *)p, 4096, "%c%s (playback)", cmd, pss->playback->name);
+        break;
+      }
       gethostname(buffer, sizeof(buffer) - 1);
       n = sprintf((char *)p, "%c%s (%s)", cmd, server->command, buffer);
       break;
     case SET_PREFERENCES:
       n = sprintf((char *)p, "%c%s", cmd, server->prefs_json);
       break;
+    case SET_SESSION:
+      n = sprintf((char *)p, "%c%s", cmd, pss->session);
+      break;
     default:
       break;
   }
 
-  return lws_write(wsi, p, (size_t)n, LWS_WRITE_BINARY);
+  return pss_write(pss, p, (size_t)n, LWS_WRITE_BINARY);
 }
 
 static json_object *parse_window_size(const char *buf, size_t len, uint16_t *cols, uint16_t *rows) {
@@ -73,41 +126,231 @@ static pty_ctx_t *pty_ctx_init(struct pss_tty *pss) {
   pty_ctx_t *ctx = xmalloc(sizeof(pty_ctx_t));
   ctx->pss = pss;
   ctx->ws_closed = false;
+  ctx->remote = NULL;
+  ctx->history = NULL;
   return ctx;
 }
 
-static void pty_ctx_free(pty_ctx_t *ctx) { free(ctx); }
+static void pty_ctx_free(pty_ctx_t *ctx) {
+  history_free(ctx->history);
+  free(ctx);
+}
+
+static void frame_close_cb(uv_handle_t *handle) { free(handle); }
+
+static void frame_timer_cb(uv_timer_t *timer) {
+  struct pss_tty *pss = (struct pss_tty *)timer->data;
+  request_write(pss);
+}
+
+// send at most diff_fps frames per second, intermediate screen states are dropped
+static void schedule_frame(struct pss_tty *pss) {
+  if (pss->paused || !pss->screen->dirty || uv_is_active((uv_handle_t *)pss->frame_timer)) return;
+
+  uint64_t next = pss->frame_time + (pss->hidden ? HIDDEN_FRAME_INTERVAL : 1000 / server->diff_fps);
+  uint64_t now = uv_now(server->loop);
+  uv_timer_start(pss->frame_timer, frame_timer_cb, next > now ? next - now : 0, 0);
+}
+
+static void screen_read(struct pss_tty *pss, pty_process *process, pty_buf_t *buf) {
+  screen_t *screen = pss->screen;
+  screen_feed(screen, buf->base, buf->len);
+  pty_buf_free(buf);
+
+  // the client never sees the queries, so answer them here
+  if (screen->reply_len > 0) {
+    pty_write(process, pty_buf_init(screen->reply, screen->reply_len));
+    screen->reply_len = 0;
+  }
+
+  // keep draining the pty, the screen holds the latest state
+  pty_resume(process);
+  schedule_frame(pss);
+}
+
+// a hidden client gets nothing until it is visible again, collect the output
+// and keep reading until the buffer is full, then let the pty block the command
+static void hidden_read(struct pss_tty *pss, pty_process *process, pty_buf_t *buf) {
+  if (pss->pty_buf == NULL) {
+    pss->pty_buf = buf;
+  } else {
+    pty_buf_t *pending = pss->pty_buf;
+    if (pending->size < pending->len + buf->len) {
+      pending->base = xrealloc(pending->base, pending->len + buf->len);
+      pending->size = 0;
+    }
+    memcpy(pending->base + pending->len, buf->base, buf->len);
+    pending->len += buf->len;
+    pty_buf_free(buf);
+  }
+  if (!pss->paused && pss->pty_buf->len < hidden_buf_size()) pty_resume(process);
+}
+
+static void idle_close_cb(uv_handle_t *handle) { free(handle); }
+
+// give the memory freed by hibernating sessions back to the system
+static void trim_memory() {
+#ifdef __GLIBC__
+  static uint64_t last = 0;
+  uint64_t now = uv_now(server->loop);
+  if (last > 0 && now - last < TRIM_INTERVAL) return;
+  last = now;
+  malloc_trim(0);
+#endif
+}
+
+// stop the processes of a hidden client, with --idle-stop
+static void idle_stop(struct pss_tty *pss) {
+#ifndef _WIN32
+  if (!server->idle_stop || !pss->hidden || pss->stopped) return;
+  pss->stopped = pty_kill(pss->process, SIGSTOP);
+#endif
+}
+
+static void idle_continue(struct pss_tty *pss) {
+#ifndef _WIN32
+  if (pss->stopped && pss->process != NULL) pty_kill(pss->process, SIGCONT);
+#endif
+  pss->stopped = false;
+}
+
+// no input or output for --idle-timeout: release what the next activity can rebuild
+static void hibernate(struct pss_tty *pss) {
+  pss->hibernated = true;
+  metrics.hibernated_sessions++;
+  pty_hibernate(pss->process);
+  free(pss->message);
+  pss->message = NULL;
+  pss->message_size = 0;
+  if (pss->screen != NULL) screen_compact(pss->screen);
+  idle_stop(pss);
+  lwsl_info("session of %s is idle, hibernated%s\n", pss->address, pss->stopped ? " and stopped" : "");
+  trim_memory();
+}
+
+static void idle_timer_cb(uv_timer_t *timer) {
+  struct pss_tty *pss = (struct pss_tty *)timer->data;
+  uint64_t timeout = (uint64_t)server->idle_timeout * 60 * 1000;
+  uint64_t idle = uv_now(server->loop) - pss->active_time;
+  if (idle < timeout) {
+    uv_timer_start(timer, idle_timer_cb, timeout - idle, 0);
+    return;
+  }
+  if (pss->process != NULL) hibernate(pss);
+}
+
+// activity of a session, the timer is only moved when it fires
+static void session_wake(struct pss_tty *pss) {
+  if (pss->idle_timer == NULL) return;
+  pss->active_time = uv_now(server->loop);
+  if (!pss->hibernated) return;
+
+  pss->hibernated = false;
+  metrics.hibernated_sessions--;
+  idle_continue(pss);
+  uv_timer_start(pss->idle_timer, idle_timer_cb, (uint64_t)server->idle_timeout * 60 * 1000, 0);
+  lwsl_info("session of %s is active again\n", pss->address);
+}
+
+static void output_next(struct pss_tty *pss);
+
+// output goes on once neither the client (PAUSE) nor its hidden tab holds it back
+static void output_resume(struct pss_tty *pss) {
+  if (pss->paused) return;
+  if (pss->playback != NULL) {
+    if (!pss->hidden) playback_resume(pss->playback);
+  } else if (pss->hidden) {
+    // the pending output is held back, keep collecting
+    if (pss->pty_buf == NULL || pss->pty_buf->len < hidden_buf_size()) pty_resume(pss->process);
+  } else if (pss->pty_buf != NULL) {
+    // it reads on once this is sent
+    request_write(pss);
+  } else if (pss->compress.jobs < COMPRESS_PIPELINE) {
+    output_next(pss);
+  }
+}
+
+static void set_visibility(struct pss_tty *pss, bool hidden) {
+  if (pss->hidden == hidden) return;
+  pss->hidden = hidden;
+  lwsl_info("WS client %s is %s\n", pss->address, hidden ? "hidden" : "visible");
+  if (!hidden)
+    session_wake(pss);
+  else if (pss->hibernated)
+    idle_stop(pss);
+
+  if (pss->screen != NULL) {
+    // reschedule with the new frame rate, a visible client is synced at once
+    uv_timer_stop(pss->frame_timer);
+    if (!hidden) pss->frame_time = 0;
+    schedule_frame(pss);
+    return;
+  }
+
+  if (hidden) {
+    playback_pause(pss->playback);
+    if (pss->playback == NULL) output_resume(pss);
+  } else {
+    output_resume(pss);
+  }
+}
 
 static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
   if (ctx->ws_closed) {
+    // a detached session runs on, its output is kept for the client
+    if (ctx->history != NULL && buf != NULL) {
+      history_append(ctx->history, buf->base, buf->len);
+      pty_resume(process);
+    }
     pty_buf_free(buf);
     return;
   }
+  session_wake(ctx->pss);
 
-  if (eof && !process_running(process))
+  if (eof && !process_running(process)) {
     ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
-  else
+  } else if (eof) {
+    // the exit of the process follows
+    return;
+  } else if (ctx->pss->screen != NULL) {
+    screen_read(ctx->pss, process, buf);
+    return;
+  } else if (ctx->pss->hidden) {
+    metrics.output_queue_bytes += buf->len;
+    hidden_read(ctx->pss, process, buf);
+    return;
+  } else {
+    metrics.output_queue_bytes += buf->len;
     ctx->pss->pty_buf = buf;
-  lws_callback_on_writable(ctx->pss->wsi);
+  }
+  request_write(ctx->pss);
 }
 
 static void process_exit_cb(pty_process *process) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
   if (ctx->ws_closed) {
     lwsl_notice("process killed with signal %d, pid: %d\n", process->exit_signal, process->pid);
+    detached_exited(process);
     goto done;
   }
 
   lwsl_notice("process exited with code %d, pid: %d\n", process->exit_code, process->pid);
   ctx->pss->process = NULL;
   ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
-  lws_callback_on_writable(ctx->pss->wsi);
+  request_write(ctx->pss);
 
 done:
   pty_ctx_free(ctx);
 }
 
+static void replay_read_cb(playback_t *pb, pty_buf_t *buf, bool eof) {
+  struct pss_tty *pss = (struct pss_tty *)pb->ctx;
+  metrics.output_queue_bytes += buf->len;
+  pss->pty_buf = buf;
+  request_write(pss);
+}
+
 static char **build_args(struct pss_tty *pss) {
   int i, n = 0;
   char **argv = xmalloc((server->argc + pss->argc + 1) * sizeof(char *));
@@ -147,37 +390,795 @@ static char **build_env(struct pss_tty *pss) {
   return envp;
 }
 
+static void session_start(struct pss_tty *pss, pty_process *process) {
+  pss->process = process;
+  pss->session_next = sessions;
+  sessions = pss;
+  if (server->diff_fps > 0) {
+    pss->screen = screen_init(process->columns, process->rows);
+    pss->frame_timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(server->loop, pss->frame_timer);
+    pss->frame_timer->data = pss;
+  }
+  if (server->idle_timeout > 0) {
+    pss->active_time = uv_now(server->loop);
+    pss->idle_timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(server->loop, pss->idle_timer);
+    pss->idle_timer->data = pss;
+    uv_timer_start(pss->idle_timer, idle_timer_cb, (uint64_t)server->idle_timeout * 60 * 1000, 0);
+  }
+  request_write(pss);
+}
+
+#ifndef _WIN32
+static void remote_exit_cb(void *ctx, int exit_code, int exit_signal) {
+  pty_process *process = (pty_process *)ctx;
+  ((pty_ctx_t *)process->ctx)->remote = NULL;
+  if (exit_code < 0) {
+    lwsl_warn("lost the session daemon, pid: %d\n", process->pid);
+    exit_code = 1;
+  }
+  pty_exited(process, exit_code, exit_signal);
+}
+#endif
+
+static void spawn_done(struct pss_tty *pss, pty_process *process, uint64_t start) {
+  metrics_observe(&metrics.spawn_seconds, (uv_hrtime() - start) / 1e9);
+  metrics.spawns_total++;
+  lwsl_notice("started process, pid: %d\n", process->pid);
+  session_start(pss, process);
+}
+
+static void process_discard(pty_process *process) {
+  pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
+  process_free(process);
+  free(process);
+  pty_ctx_free(ctx);
+}
+
+static void spawn_failed(pty_process *process, int err) {
+  lwsl_err("pty_spawn: %d (%s)\n", err, strerror(err));
+  metrics.spawn_failures_total++;
+  process_discard(process);
+}
+
+#ifndef _WIN32
+static void remote_spawn_cb(void *data, sessiond_client *client, upgrade_session *session, history_t *history,
+                            int err) {
+  pty_process *process = (pty_process *)data;
+  pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
+  struct pss_tty *pss = ctx->pss;
+  // the client went away meanwhile
+  if (err == ECANCELED) {
+    process_discard(process);
+    return;
+  }
+  pss->pending = NULL;
+  if (err == 0) {
+    err = -pty_attach(process, session->fd, session->pid, process_read_cb, process_exit_cb);
+    if (err != 0) {
+      sessiond_kill(client, SIGKILL);
+      sessiond_close(client);
+    }
+  }
+  if (err != 0) {
+    spawn_failed(process, err);
+    pss->lws_close_status = LWS_CLOSE_STATUS_UNEXPECTED_CONDITION;
+    request_write(pss);
+    return;
+  }
+  ctx->remote = client;
+  sessiond_watch(client, remote_exit_cb, process);
+  spawn_done(pss, process, pss->spawn_time);
+}
+
+// the session daemon runs the process, the pty master is passed over to read and write it directly; the session
+// starts once it replied
+static bool remote_spawn(struct pss_tty *pss, pty_process *process) {
+  upgrade_session session;
+  memset(&session, 0, sizeof(session));
+  strcpy(session.id, pss->session);
+  memcpy(session.user, pss->user, sizeof(session.user));
+  session.columns = process->columns;
+  session.rows = process->rows;
+  pss->spawn_time = uv_hrtime();
+  pss->pending = sessiond_spawn(server->loop, server->session_socket, &session, process->argv, process->envp,
+                                process->cwd, remote_spawn_cb, process);
+  return pss->pending != NULL;
+}
+#endif
+
 static bool spawn_process(struct pss_tty *pss, uint16_t columns, uint16_t rows) {
   pty_process *process = process_init((void *)pty_ctx_init(pss), server->loop, build_args(pss), build_env(pss));
   if (server->cwd != NULL) process->cwd = strdup(server->cwd);
   if (columns > 0) process->columns = columns;
   if (rows > 0) process->rows = rows;
-  if (pty_spawn(process, process_read_cb, process_exit_cb) != 0) {
-    lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+
+  unsigned char id[SESSION_ID_LEN / 2];
+  lws_get_random(context, id, sizeof(id));
+  for (size_t i = 0; i < sizeof(id); i++) sprintf(pss->session + i * 2, "%02x", id[i]);
+
+#ifndef _WIN32
+  if (server->session_socket != NULL) {
+    if (remote_spawn(pss, process)) return true;
+    spawn_failed(process, errno);
+    return false;
+  }
+#endif
+  uint64_t start = uv_hrtime();
+  int err = pty_spawn(process, process_read_cb, process_exit_cb);
+  if (err != 0) {
+    spawn_failed(process, err < 0 ? -err : errno);
+    return false;
+  }
+  spawn_done(pss, process, start);
+  return true;
+}
+
+static void session_remove(struct pss_tty *pss) {
+  for (struct pss_tty **p = &sessions; *p != NULL; p = &(*p)->session_next) {
+    if (*p != pss) continue;
+    *p = pss->session_next;
+    break;
+  }
+}
+
+// a session handed over by the previous ttyd, until its client comes back
+typedef struct detached_session_ {
+  pty_process *process;
+  char id[SESSION_ID_LEN + 1];
+  char user[30];
+  uv_timer_t *timer;  // gives up on the client
+  struct detached_session_ *next;
+} detached_session;
+
+static detached_session *detached = NULL;
+
+static void detached_close_cb(uv_handle_t *handle) { free(handle); }
+
+static void detached_free(detached_session *d) {
+  for (detached_session **p = &detached; *p != NULL; p = &(*p)->next) {
+    if (*p != d) continue;
+    *p = d->next;
+    break;
+  }
+  uv_timer_stop(d->timer);
+  uv_close((uv_handle_t *)d->timer, detached_close_cb);
+  free(d);
+}
+
+static void detached_kill(detached_session *d) {
+  pty_process *process = d->process;
+  detached_free(d);
+  pty_kill(process, server->sig_code);
+  // the end of the output frees the process
+  pty_resume(process);
+}
+
+static void detached_timer_cb(uv_timer_t *timer) {
+  detached_session *d = (detached_session *)timer->data;
+  lwsl_notice("client of session %.8s did not come back, killing process, pid: %d\n", d->id, d->process->pid);
+  detached_kill(d);
+}
+
+// a detached session reading its output (--history) sees the end of it
+static void detached_exited(pty_process *process) {
+  for (detached_session *d = detached; d != NULL; d = d->next) {
+    if (d->process != process) continue;
+    lwsl_notice("process of detached session %.8s exited, pid: %d\n", d->id, process->pid);
+    detached_free(d);
+    return;
+  }
+}
+
+// the output kept while the session was detached goes first, a block at a time
+static void history_replay(struct pss_tty *pss, history_t *history) {
+  if (history == NULL) return;
+  lwsl_notice("replaying %zu bytes of session %.8s, kept in %zu bytes, dropped: %llu\n", history->raw_len,
+              pss->session, history->mem_len, (unsigned long long)history->dropped);
+  if (pss->screen == NULL) {
+    pss->history = history;
+    return;
+  }
+  // the screen takes it at once, the next frame shows the result
+  pty_buf_t *buf;
+  while ((buf = history_take(history)) != NULL) {
+    screen_feed(pss->screen, buf->base, buf->len);
+    pty_buf_free(buf);
+  }
+  // the queries were meant for a client long gone
+  pss->screen->reply_len = 0;
+  history_free(history);
+  schedule_frame(pss);
+}
+
+// queue the next block of the history, false once it was all sent
+static bool history_next(struct pss_tty *pss) {
+  if (pss->history == NULL) return false;
+  pty_buf_t *buf = history_take(pss->history);
+  if (buf == NULL) {
+    history_free(pss->history);
+    pss->history = NULL;
+    return false;
+  }
+  metrics.output_queue_bytes += buf->len;
+  pss->pty_buf = buf;
+  request_write(pss);
+  return true;
+}
+
+#ifndef _WIN32
+static bool spawn_refused(struct pss_tty *pss);
+
+static bool remote_attached(struct pss_tty *pss, sessiond_client *client, upgrade_session *session,
+                            history_t *history) {
+  pty_ctx_t *ctx = pty_ctx_init(pss);
+  pty_process *process = process_init((void *)ctx, server->loop, NULL, NULL);
+  process->columns = session->columns;
+  process->rows = session->rows;
+  int err = pty_attach(process, session->fd, session->pid, process_read_cb, process_exit_cb);
+  if (err != 0) {
+    lwsl_err("failed to attach session %.8s, pid: %d (%s)\n", session->id, session->pid, strerror(-err));
+    history_free(history);
+    sessiond_close(client);
+    process_discard(process);
+    return false;
+  }
+  ctx->remote = client;
+  sessiond_watch(client, remote_exit_cb, process);
+
+  lwsl_notice("resumed session %.8s of the session daemon, pid: %d\n", session->id, process->pid);
+  strcpy(pss->session, session->id);
+  if (pss->columns > 0 && pss->rows > 0) {
+    process->columns = pss->columns;
+    process->rows = pss->rows;
+    pty_resize(process);
+  }
+  session_start(pss, process);
+  history_replay(pss, history);
+  return true;
+}
+
+static void remote_attach_cb(void *data, sessiond_client *client, upgrade_session *session, history_t *history,
+                             int err) {
+  struct pss_tty *pss = (struct pss_tty *)data;
+  if (err == ECANCELED) return;
+  pss->pending = NULL;
+  if (err == 0 && remote_attached(pss, client, session, history)) return;
+
+  // the daemon does not have it, a new session starts as if none was asked for
+  if (pss->playback != NULL) {
+    request_write(pss);
+    return;
+  }
+  if (spawn_refused(pss)) return;
+  if (!spawn_process(pss, pss->columns, pss->rows)) {
+    pss->lws_close_status = LWS_CLOSE_STATUS_UNEXPECTED_CONDITION;
+    request_write(pss);
+  }
+}
+
+// a session the daemon kept after the front end it was started by went away, the reply decides whether it is resumed
+static bool remote_attach(struct pss_tty *pss, const char *id, uint16_t columns, uint16_t rows) {
+  if (strlen(id) != SESSION_ID_LEN) return false;
+  upgrade_session session;
+  memset(&session, 0, sizeof(session));
+  strcpy(session.id, id);
+  memcpy(session.user, pss->user, sizeof(session.user));
+  pss->columns = columns;
+  pss->rows = rows;
+  pss->pending = sessiond_attach(server->loop, server->session_socket, &session, remote_attach_cb, pss);
+  return pss->pending != NULL;
+}
+#endif
+
+static bool session_attach(struct pss_tty *pss, const char *id, uint16_t columns, uint16_t rows) {
+  detached_session *d = detached;
+  while (d != NULL && (id == NULL || strcmp(d->id, id) != 0 || strcmp(d->user, pss->user) != 0)) d = d->next;
+#ifndef _WIN32
+  if (d == NULL && id != NULL && server->session_socket != NULL) return remote_attach(pss, id, columns, rows);
+#endif
+  if (d == NULL) return false;
+
+  pty_process *process = d->process;
+  pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
+  ctx->pss = pss;
+  ctx->ws_closed = false;
+  detached_free(d);
+  // the live output waits for the history
+  pty_pause(process);
+  history_t *history = ctx->history;
+  ctx->history = NULL;
+
+  lwsl_notice("resumed session %.8s, pid: %d\n", id, process->pid);
+  strcpy(pss->session, id);
+  if (columns > 0 && rows > 0) {
+    process->columns = columns;
+    process->rows = rows;
+    pty_resize(process);
+  }
+  session_start(pss, process);
+  history_replay(pss, history);
+  return true;
+}
+
+// memory pressure: release what the next activity can rebuild, then close the idle sessions
+void session_shed(int stage) {
+  static int previous = PRESSURE_NONE;
+  if (stage >= PRESSURE_SHRINK && previous < PRESSURE_SHRINK) {
+    for (struct pss_tty *p = sessions; p != NULL; p = p->session_next) {
+      if (!p->hidden && !p->hibernated) continue;
+      pty_hibernate(p->process);
+      if (p->screen != NULL) screen_compact(p->screen);
+      metrics.pressure_shrinks_total++;
+    }
+    trim_memory();
+  }
+  previous = stage;
+  if (stage < PRESSURE_EVICT) return;
+
+  // one per check, the sessions without a client first, then the one idle the longest
+  if (detached != NULL) {
+    detached_session *d = detached;
+    while (d->next != NULL) d = d->next;
+    lwsl_warn("memory pressure: closing detached session %.8s, pid: %d\n", d->id, d->process->pid);
+    metrics.pressure_evictions_total++;
+    detached_kill(d);
+    return;
+  }
+  struct pss_tty *idle = NULL;
+  for (struct pss_tty *p = sessions; p != NULL; p = p->session_next) {
+    if (!p->hibernated || p->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) continue;
+    if (idle == NULL || p->active_time < idle->active_time) idle = p;
+  }
+  if (idle == NULL) return;
+  lwsl_warn("memory pressure: closing idle session of %s\n", idle->address);
+  metrics.pressure_evictions_total++;
+  // the process is killed once the connection is closed
+  idle->lws_close_status = 1013;  // try again later
+  request_write(idle);
+}
+
+// under memory pressure no new process is started, the client may try again later
+static bool spawn_refused(struct pss_tty *pss) {
+  if (pressure_stage() < PRESSURE_NO_SPAWN) return false;
+  lwsl_warn("memory pressure: refuse to start a process for %s\n", pss->address);
+  metrics.pressure_spawns_refused_total++;
+  pss->lws_close_status = 1013;  // try again later
+  request_write(pss);
+  return true;
+}
+
+#ifndef _WIN32
+// the live and the detached sessions, the pty fds stay owned by their processes
+int session_export(upgrade_session **out) {
+  int count = 0;
+  for (struct pss_tty *p = sessions; p != NULL; p = p->session_next) count++;
+  for (detached_session *d = detached; d != NULL; d = d->next) count++;
+  upgrade_session *list = xmalloc((count + 1) * sizeof(upgrade_session));
+  memset(list, 0, (count + 1) * sizeof(upgrade_session));
+
+  int n = 0;
+  for (struct pss_tty *p = sessions; p != NULL; p = p->session_next) {
+    pty_process *process = p->process;
+    if (process == NULL || !process_running(process)) continue;
+    // the daemon keeps it, for the client to resume on the new process
+    if (((pty_ctx_t *)process->ctx)->remote != NULL) continue;
+#ifdef TTYD_FAKE_PTY
+    if (process->fake != NULL) continue;
+#endif
+    strcpy(list[n].id, p->session);
+    memcpy(list[n].user, p->user, sizeof(list[n].user));
+    list[n].pid = process->pid;
+    list[n].columns = process->columns;
+    list[n].rows = process->rows;
+    list[n++].fd = process->pty;
+  }
+  for (detached_session *d = detached; d != NULL; d = d->next) {
+    strcpy(list[n].id, d->id);
+    memcpy(list[n].user, d->user, sizeof(list[n].user));
+    list[n].pid = d->process->pid;
+    list[n].columns = d->process->columns;
+    list[n].rows = d->process->rows;
+    list[n++].fd = d->process->pty;
+  }
+  *out = list;
+  return n;
+}
+
+void session_handed_off() {
+  handed_off = true;
+  while (detached != NULL) detached_free(detached);
+}
+
+// wait for the client of a session of the previous ttyd, the output stays in the pty meanwhile
+void session_adopt(upgrade_session *session) {
+  pty_ctx_t *ctx = pty_ctx_init(NULL);
+  ctx->ws_closed = true;
+  pty_process *process = process_init((void *)ctx, server->loop, NULL, NULL);
+  process->columns = session->columns;
+  process->rows = session->rows;
+  int err = pty_adopt(process, session->fd, session->pid, process_read_cb, process_exit_cb);
+  if (err != 0) {
+    lwsl_err("failed to adopt session %.8s, pid: %d (%s)\n", session->id, session->pid, strerror(-err));
     process_free(process);
+    free(process);
+    pty_ctx_free(ctx);
+    return;
+  }
+
+  detached_session *d = xmalloc(sizeof(detached_session));
+  memcpy(d->id, session->id, sizeof(d->id));
+  memcpy(d->user, session->user, sizeof(d->user));
+  d->process = process;
+  d->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(server->loop, d->timer);
+  d->timer->data = d;
+  uv_timer_start(d->timer, detached_timer_cb, DETACHED_TIMEOUT, 0);
+  d->next = detached;
+  detached = d;
+  lwsl_notice("adopted session %.8s, pid: %d\n", session->id, session->pid);
+  if (server->history_size > 0) {
+    ctx->history = history_init(server->history_size);
+    pty_resume(process);
+  }
+}
+#endif
+
+// clients waiting for a free slot at --max-clients, oldest first
+static struct pss_tty *queue_head = NULL;
+static int queue_count = 0;
+
+static void queue_close_cb(uv_handle_t *handle) { free(handle); }
+
+static void queue_notify() {
+  for (struct pss_tty *p = queue_head; p != NULL; p = p->queue_next) {
+    p->queue_notify = true;
+    request_write(p);
+  }
+}
+
+static void queue_remove(struct pss_tty *pss) {
+  for (struct pss_tty **p = &queue_head; *p != NULL; p = &(*p)->queue_next) {
+    if (*p != pss) continue;
+    *p = pss->queue_next;
+    pss->queue_next = NULL;
+    queue_count--;
+    metrics.queue_length = queue_count;
+    break;
+  }
+  if (pss->queue_timer != NULL) {
+    uv_timer_stop(pss->queue_timer);
+    uv_close((uv_handle_t *)pss->queue_timer, queue_close_cb);
+    pss->queue_timer = NULL;
+  }
+}
+
+static void queue_timer_cb(uv_timer_t *timer) {
+  struct pss_tty *pss = (struct pss_tty *)timer->data;
+  lwsl_notice("WS   %s - %s, gave up waiting in the queue\n", pss->path, pss->address);
+  metrics.queue_timeouts_total++;
+  queue_remove(pss);
+  pss->lws_close_status = 1013;  // try again later
+  request_write(pss);
+  queue_notify();
+}
+
+static void queue_push(struct pss_tty *pss) {
+  struct pss_tty **p = &queue_head;
+  while (*p != NULL) p = &(*p)->queue_next;
+  *p = pss;
+  pss->queued = true;
+  pss->queue_notify = true;
+  queue_count++;
+  metrics.queue_length = queue_count;
+  metrics.queued_total++;
+  if (server->queue_timeout > 0) {
+    pss->queue_timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(server->loop, pss->queue_timer);
+    pss->queue_timer->data = pss;
+    uv_timer_start(pss->queue_timer, queue_timer_cb, (uint64_t)server->queue_timeout * 1000, 0);
+  }
+  request_write(pss);
+}
+
+// promote the oldest waiting clients to the free slots, as if they had just connected
+static void queue_admit() {
+  if (queue_head == NULL) return;
+  while (queue_head != NULL && server->client_count < server->max_clients) {
+    struct pss_tty *pss = queue_head;
+    queue_remove(pss);
+    pss->queued = false;
+    server->client_count++;
+    metrics.sessions_total++;
+    lwsl_notice("WS   %s - %s, admitted from the queue, clients: %d\n", pss->path, pss->address, server->client_count);
+    if (!pss->handshake) continue;
+    if (pss->playback != NULL) {
+      request_write(pss);
+    } else if (spawn_refused(pss)) {
+      continue;
+    } else if (!spawn_process(pss, pss->columns, pss->rows)) {
+      pss->lws_close_status = LWS_CLOSE_STATUS_UNEXPECTED_CONDITION;
+      request_write(pss);
+    }
+  }
+  queue_notify();
+}
+
+static void view_frame_free(view_frame *f) {
+  free(f->raw);
+  free(f->deflated);
+  free(f);
+}
+
+// the viewer sent f or gave up on it, the last one frees it
+static void view_unref(struct pss_tty *viewer, view_frame *f) {
+  if (--f->refs > 0) return;
+  if (viewer->viewed != NULL && viewer->viewed->view_tail == f) viewer->viewed->view_tail = NULL;
+  view_frame_free(f);
+}
+
+// stop viewing, the output not sent yet is dropped
+static void view_detach(struct pss_tty *viewer) {
+  struct pss_tty *viewed = viewer->viewed;
+  if (viewed != NULL) {
+    for (struct pss_tty **p = &viewed->viewers; *p != NULL; p = &(*p)->viewer_next) {
+      if (*p != viewer) continue;
+      *p = viewer->viewer_next;
+      break;
+    }
+    viewed->viewer_count--;
+  }
+  while (viewer->view_cursor != NULL) {
+    view_frame *f = viewer->view_cursor;
+    viewer->view_cursor = f->next;
+    view_unref(viewer, f);
+  }
+  viewer->viewed = NULL;
+  viewer->viewer_next = NULL;
+  viewer->view_bytes = 0;
+}
+
+// a read-only viewer of the live session with this id, it gets the output from now on
+static bool view_attach(struct pss_tty *pss, const char *id) {
+  struct pss_tty *viewed = sessions;
+  while (viewed != NULL && (id == NULL || strcmp(viewed->session, id) != 0 || strcmp(viewed->user, pss->user) != 0))
+    viewed = viewed->session_next;
+  if (viewed == NULL || viewed->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) {
+    lwsl_warn("WS   %s - %s, no session to view\n", pss->path, pss->address);
+    pss->lws_close_status = LWS_CLOSE_STATUS_POLICY_VIOLATION;
     return false;
   }
-  lwsl_notice("started process, pid: %d\n", process->pid);
-  pss->process = process;
-  lws_callback_on_writable(pss->wsi);
+  if (viewed->viewer_count >= server->max_viewers) {
+    lwsl_warn("WS   %s - %s, session %.8s has too many viewers\n", pss->path, pss->address, id);
+    pss->lws_close_status = 1013;  // try again later
+    return false;
+  }
+  pss->viewer = true;
+  pss->viewed = viewed;
+  pss->viewer_next = viewed->viewers;
+  viewed->viewers = pss;
+  viewed->viewer_count++;
+  metrics.viewers++;
+  lwsl_notice("WS   %s - %s, viewing session %.8s, viewers: %d\n", pss->path, pss->address, id, viewed->viewer_count);
+  return true;
+}
+
+// share the message just sent to the client of a session with its viewers: built, and compressed, once for all of them
+static void view_broadcast(struct pss_tty *pss, const char *ptr, size_t n, pty_buf_t *buf) {
+  bool raw = false, deflate = false;
+  for (struct pss_tty *v = pss->viewers; v != NULL; v = v->viewer_next) {
+    if (v->compress.enabled)
+      deflate = true;
+    else
+      raw = true;
+  }
 
+  view_frame *f = xmalloc(sizeof(view_frame));
+  memset(f, 0, sizeof(view_frame));
+  f->len = buf->len;
+  if (deflate && *ptr == OUTPUT_DEFLATED) {
+    f->deflated = xmalloc(LWS_PRE + MUX_HEADER + n);
+    memcpy(f->deflated + LWS_PRE + MUX_HEADER, ptr, n);
+    f->deflated_len = n;
+  } else if (deflate && !pss->compress.enabled) {
+    // the client of the session does not inflate, the viewers have a compression of their own
+    f->deflated = xmalloc(LWS_PRE + MUX_HEADER + 1 + buf->len);
+    char *p = f->deflated + LWS_PRE + MUX_HEADER;
+    f->deflated_len = compress_output(&pss->view_compress, buf->base, buf->len, p + 1);
+    if (f->deflated_len > 0) {
+      *p = OUTPUT_DEFLATED;
+      f->deflated_len++;
+    } else {
+      free(f->deflated);
+      f->deflated = NULL;
+    }
+  }
+  if (raw || f->deflated == NULL) {
+    f->raw = xmalloc(LWS_PRE + MUX_HEADER + 1 + buf->len);
+    f->raw[LWS_PRE + MUX_HEADER] = OUTPUT;
+    memcpy(f->raw + LWS_PRE + MUX_HEADER + 1, buf->base, buf->len);
+    f->raw_len = buf->len + 1;
+  }
+  metrics.view_frames_total++;
+
+  if (pss->view_tail != NULL) pss->view_tail->next = f;
+  pss->view_tail = f;
+  for (struct pss_tty *v = pss->viewers; v != NULL; v = v->viewer_next) {
+    f->refs++;
+    if (v->view_cursor == NULL) v->view_cursor = f;
+    v->view_bytes += v->compress.enabled && f->deflated != NULL ? f->deflated_len : f->raw_len;
+    request_write(v);
+  }
+  // a viewer too far behind would hold the output for all
+  struct pss_tty *v = pss->viewers;
+  while (v != NULL) {
+    struct pss_tty *next = v->viewer_next;
+    if (v->view_bytes > VIEW_QUEUE_SIZE) {
+      lwsl_notice("WS   %s - %s, viewer fell behind, closing\n", v->path, v->address);
+      metrics.viewers_behind_total++;
+      view_detach(v);
+      v->lws_close_status = 1013;
+    }
+    v = next;
+  }
+}
+
+// send the next output of the viewed session, false if there is none
+static bool view_output(struct pss_tty *pss) {
+  view_frame *f = pss->view_cursor;
+  if (f == NULL) return false;
+  bool deflated = pss->compress.enabled && f->deflated != NULL;
+  char *message = deflated ? f->deflated : f->raw;
+  size_t n = deflated ? f->deflated_len : f->raw_len;
+  if (pss_write(pss, (unsigned char *)message + LWS_PRE + MUX_HEADER, n, LWS_WRITE_BINARY) < n) {
+    lwsl_err("write OUTPUT to WS\n");
+  }
+  metrics.output_frames_total++;
+  metrics.output_bytes_total += f->len;
+  pss->view_bytes -= n;
+  pss->view_cursor = f->next;
+  view_unref(pss, f);
+  if (pss->view_cursor != NULL) request_write(pss);
   return true;
 }
 
-static void wsi_output(struct lws *wsi, pty_buf_t *buf) {
+// send buf, or the n bytes compressed from it if n > 0, in a message built at ptr
+static void output_frame(struct pss_tty *pss, char *ptr, size_t n, pty_buf_t *buf) {
+  if (n > 0) {
+    *ptr = OUTPUT_DEFLATED;
+  } else {
+    *ptr = OUTPUT;
+    memcpy(ptr + 1, buf->base, buf->len);
+    n = buf->len;
+  }
+  n++;
+
+  if (pss_write(pss, (unsigned char *)ptr, n, LWS_WRITE_BINARY) < n) {
+    lwsl_err("write OUTPUT to WS\n");
+  }
+  metrics.output_frames_total++;
+  metrics.output_bytes_total += buf->len;
+#ifdef TTYD_ALLOC_STATS
+  alloc_stats_output(buf->len);
+#endif
+  if (pss->viewers != NULL) view_broadcast(pss, ptr, n, buf);
+}
+
+static void wsi_output(struct pss_tty *pss, pty_buf_t *buf) {
   if (buf == NULL) return;
-  char *message = xmalloc(LWS_PRE + 1 + buf->len);
-  char *ptr = message + LWS_PRE;
+  size_t size = LWS_PRE + MUX_HEADER + 1 + buf->len;
+  if (size > pss->message_size) {
+    pss->message = xrealloc(pss->message, size);
+    pss->message_size = size;
+  }
+  char *ptr = pss->message + LWS_PRE + MUX_HEADER;
+  size_t n = pss->compress.enabled ? compress_output(&pss->compress, buf->base, buf->len, ptr + 1) : 0;
+  output_frame(pss, ptr, n, buf);
+}
+
+// INPUT arrival to the first OUTPUT after it, usually the echo of a keystroke
+static void observe_echo(struct pss_tty *pss) {
+  if (pss->input_time == 0) return;
+  pss->last_echo = (uv_hrtime() - pss->input_time) / 1e9;
+  pss->input_time = 0;
+  metrics_observe(&pss->echo, pss->last_echo);
+  metrics_observe(&metrics.echo_seconds, pss->last_echo);
+}
 
-  *ptr = OUTPUT;
-  memcpy(ptr + 1, buf->base, buf->len);
-  size_t n = buf->len + 1;
+// read on from the playback, the history, or else the pty
+static void output_next(struct pss_tty *pss) {
+  if (pss->playback != NULL)
+    playback_next(pss->playback);
+  else if (!pss->paused && !history_next(pss))
+    pty_resume(pss->process);
+}
 
-  if (lws_write(wsi, (unsigned char *)ptr, n, LWS_WRITE_BINARY) < n) {
-    lwsl_err("write OUTPUT to WS\n");
+void output_compressed(void *ctx) { request_write((struct pss_tty *)ctx); }
+
+// with --compress-threads: hand the output to the pool, reading on while it compresses, and send it back in order.
+// true while some is in flight, it goes before anything else
+static bool pool_output(struct pss_tty *pss) {
+  if (!compress_pooled(&pss->compress)) return false;
+  if (pss->pty_buf != NULL && !pss->hidden) {
+    bool room = compress_submit(server->loop, &pss->compress, pss->pty_buf, LWS_PRE + MUX_HEADER + 1, pss);
+    pss->pty_buf = NULL;
+    if (room) output_next(pss);
   }
 
-  free(message);
+  bool full = pss->compress.jobs >= COMPRESS_PIPELINE;
+  compress_job *job = compress_take(&pss->compress);
+  if (job == NULL) return pss->compress.head != NULL;
+  metrics.output_queue_bytes -= job->buf->len;
+  output_frame(pss, job->message + LWS_PRE + MUX_HEADER, job->len, job->buf);
+  observe_echo(pss);
+  compress_job_free(job);
+  if (full) output_next(pss);
+  // the next one may be done already
+  if (pss->compress.head != NULL) request_write(pss);
+  return true;
+}
+
+static int send_pong(struct lws *wsi, struct pss_tty *pss) {
+  unsigned char message[LWS_PRE + MUX_HEADER + 1 + 512];
+  unsigned char *p = &message[LWS_PRE + MUX_HEADER];
+  const metrics_histogram *rtt = &pss->rtt, *echo = &pss->echo;
+
+  // latencies in ms, quantiles are bucket bounds
+  int n = snprintf((char *)p, 512,
+                   "%c{\"ts\": %s, "
+                   "\"rtt\": {\"last\": %.3f, \"p50\": %g, \"p99\": %g, \"count\": %llu}, "
+                   "\"echo\": {\"last\": %.3f, \"p50\": %g, \"p99\": %g, \"count\": %llu}}",
+                   PONG, pss->pong, pss->last_rtt * 1000, metrics_quantile(rtt, 0.5) * 1000,
+                   metrics_quantile(rtt, 0.99) * 1000, (unsigned long long)rtt->count, pss->last_echo * 1000,
+                   metrics_quantile(echo, 0.5) * 1000, metrics_quantile(echo, 0.99) * 1000,
+                   (unsigned long long)echo->count);
+  pss->pong[0] = '\0';
+  return pss_write(pss, p, (size_t)n, LWS_WRITE_BINARY);
+}
+
+// the payload is the send time, followed by the channel id on tty-mux
+static int send_ping(struct lws *wsi, struct pss_tty *pss) {
+  unsigned char message[LWS_PRE + sizeof(uint64_t) + MUX_HEADER];
+  unsigned char *p = &message[LWS_PRE];
+  size_t n = sizeof(uint64_t);
+  uint64_t now = uv_hrtime();
+  memcpy(p, &now, sizeof(now));
+  if (pss->mux != NULL) {
+    p[n++] = (unsigned char)(pss->channel >> 8);
+    p[n++] = (unsigned char)(pss->channel & 0xff);
+  }
+  pss->ping_pending = false;
+  return lws_write(wsi, p, n, LWS_WRITE_PING);
+}
+
+// tell the client a channel is gone, with the close status its websocket would have got
+static int send_channel_closed(struct pss_tty *pss) {
+  unsigned char message[LWS_PRE + MUX_HEADER + 16];
+  unsigned char *p = &message[LWS_PRE + MUX_HEADER];
+  int n = snprintf((char *)p, 16, "%c%d", CHANNEL_CLOSED, pss->lws_close_status);
+  pss->channel_closed = true;
+  return pss_write(pss, p, (size_t)n, LWS_WRITE_BINARY) < 0 ? -1 : 0;
+}
+
+static int send_queue_position(struct pss_tty *pss) {
+  unsigned char message[LWS_PRE + MUX_HEADER + 16];
+  unsigned char *p = &message[LWS_PRE + MUX_HEADER];
+  int position = 1;
+  for (struct pss_tty *q = queue_head; q != NULL && q != pss; q = q->queue_next) position++;
+  int n = snprintf((char *)p, 16, "%c%d", QUEUE_POSITION, position);
+  pss->queue_notify = false;
+  return pss_write(pss, p, (size_t)n, LWS_WRITE_BINARY);
+}
+
+static void screen_output(struct lws *wsi, struct pss_tty *pss) {
+  pty_buf_t buf;
+  buf.len = screen_render(pss->screen, &buf.base);
+  if (buf.len > 0) {
+    wsi_output(pss, &buf);
+    observe_echo(pss);
+  }
+  pss->frame_time = uv_now(server->loop);
 }
 
 static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
@@ -194,7 +1195,38 @@ static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
   return true;
 }
 
-int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+// the reverse proxy in front of ttyd compresses for its clients, the hop to it is not worth it (--compress)
+static bool compress_peer(struct lws *wsi) {
+  char address[50] = "";
+  if (strlen(server->socket_path) == 0) lws_get_peer_simple(lws_get_network_wsi(wsi), address, sizeof(address));
+  return (compress_peer_class(address) & server->compress_peers) != 0;
+}
+
+// a client inflating OUTPUT_DEFLATED asks for it in the url, so permessage-deflate can be refused
+static bool wants_output_deflate(struct lws *wsi) {
+  char buf[256];
+  for (int n = 0; lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, n) > 0; n++) {
+    if (strcmp(buf, "compress=deflate") == 0) return true;
+  }
+  return false;
+}
+
+static bool output_deflate(struct lws *wsi) {
+  return wants_output_deflate(wsi) && pressure_stage() < PRESSURE_NO_DEFLATE && compress_peer(wsi);
+}
+
+static void parse_url_args(struct lws *wsi, struct pss_tty *pss) {
+  char buf[256];
+  for (int n = 0; lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, n) > 0; n++) {
+    if (strncmp(buf, "arg=", 4) == 0) {
+      pss->args = xrealloc(pss->args, (pss->argc + 1) * sizeof(char *));
+      pss->args[pss->argc] = strdup(&buf[4]);
+      pss->argc++;
+    }
+  }
+}
+
+static int tty_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
   struct pss_tty *pss = (struct pss_tty *)user;
   char buf[256];
   size_t n = 0;
@@ -205,17 +1237,22 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         lwsl_warn("refuse to serve WS client due to the --once option.\n");
         return 1;
       }
-      if (server->max_clients > 0 && server->client_count == server->max_clients) {
+      if (server->max_clients > 0 && server->client_count >= server->max_clients && queue_count >= server->max_queue) {
         lwsl_warn("refuse to serve WS client due to the --max-clients option.\n");
         return 1;
       }
-      if (!check_auth(wsi, pss)) return 1;
+      if (!check_auth(wsi, pss)) {
+        metrics.auth_failures_total++;
+        return 1;
+      }
 
       n = lws_hdr_copy(wsi, pss->path, sizeof(pss->path), WSI_TOKEN_GET_URI);
 #if defined(LWS_ROLE_H2)
       if (n <= 0) n = lws_hdr_copy(wsi, pss->path, sizeof(pss->path), WSI_TOKEN_HTTP_COLON_PATH);
 #endif
-      if (strncmp(pss->path, endpoints.ws, n) != 0) {
+      if (server->playback_dir != NULL && playback_parse_path(endpoints.playback, pss->path, "/ws", NULL, 0)) {
+        // served from a recording, no command is spawned
+      } else if (server->argv == NULL || strncmp(pss->path, endpoints.ws, n) != 0) {
         lwsl_warn("refuse to serve WS client for illegal ws path: %s\n", pss->path);
         return 1;
       }
@@ -228,58 +1265,152 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       }
       break;
 
+    case LWS_CALLBACK_CONFIRM_EXTENSION_OKAY:
+      // compression costs memory per connection, the ones already open keep it
+      if (pressure_stage() >= PRESSURE_NO_DEFLATE) {
+        metrics.pressure_deflate_refused_total++;
+        return 1;
+      }
+      if (!compress_peer(wsi)) {
+        metrics.deflate_peer_refused_total++;
+        return 1;
+      }
+      // OUTPUT_DEFLATED instead, decided per message
+      if (wants_output_deflate(wsi)) return 1;
+      break;
+
     case LWS_CALLBACK_ESTABLISHED:
+      // refused before pss->wsi is set, so CLOSED leaves the client count alone
+      if (server->max_clients > 0 && server->client_count >= server->max_clients &&
+          queue_count >= server->max_queue) {
+        lws_close_reason(wsi, 1013, NULL, 0);
+        return -1;
+      }
+      if (server->playback_dir != NULL && playback_parse_path(endpoints.playback, pss->path, "/ws", buf, sizeof(buf))) {
+        pss->playback = playback_init(pss, server->loop, server->playback_dir, buf);
+        if (pss->playback == NULL) {
+          lwsl_warn("failed to open recording: %s (%s)\n", buf, strerror(errno));
+          return -1;
+        }
+        for (int i = 0; lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, i) > 0; i++) {
+          if (strncmp(buf, "speed=", 6) == 0 && atof(&buf[6]) > 0) pss->playback->speed = atof(&buf[6]);
+        }
+      }
+
       pss->initialized = false;
       pss->authenticated = false;
       pss->wsi = wsi;
       pss->lws_close_status = LWS_CLOSE_STATUS_NOSTATUS;
+      pss->compress.enabled = output_deflate(wsi);
 
-      if (server->url_arg) {
-        while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, n++) > 0) {
-          if (strncmp(buf, "arg=", 4) == 0) {
-            pss->args = xrealloc(pss->args, (pss->argc + 1) * sizeof(char *));
-            pss->args[pss->argc] = strdup(&buf[4]);
-            pss->argc++;
-          }
-        }
+      if (server->url_arg) parse_url_args(wsi, pss);
+
+      lws_get_peer_simple(lws_get_network_wsi(wsi), pss->address, sizeof(pss->address));
+
+      // parked without a process until a slot frees up, instead of refused and reconnecting
+      if (server->max_clients > 0 && server->client_count >= server->max_clients) {
+        queue_push(pss);
+        lwsl_notice("WS   %s - %s, queued: %d\n", pss->path, pss->address, queue_count);
+        break;
       }
 
       server->client_count++;
+      metrics.sessions_total++;
 
-      lws_get_peer_simple(lws_get_network_wsi(wsi), pss->address, sizeof(pss->address));
       lwsl_notice("WS   %s - %s, clients: %d\n", pss->path, pss->address, server->client_count);
       break;
 
     case LWS_CALLBACK_SERVER_WRITEABLE:
+      if (pss->failed) return send_channel_closed(pss);
+      if (pss->queued) {
+        if (pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) {
+          if (pss->mux != NULL) return send_channel_closed(pss);
+          lws_close_reason(wsi, pss->lws_close_status, NULL, 0);
+          return 1;
+        }
+        if (pss->queue_notify && send_queue_position(pss) < 0) {
+          lwsl_err("failed to send queue position\n");
+          return -1;
+        }
+        break;
+      }
+
+      // refused before anything was started
+      if (pss->process == NULL && pss->playback == NULL && !pss->initialized &&
+          pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) {
+        if (pss->mux != NULL) return send_channel_closed(pss);
+        lws_close_reason(wsi, pss->lws_close_status, NULL, 0);
+        return 1;
+      }
+
       if (!pss->initialized) {
+        // the initial messages wait for the session daemon to start the process
+        if (pss->pending != NULL) break;
         if (pss->initial_cmd_index == sizeof(initial_cmds)) {
           pss->initialized = true;
-          pty_resume(pss->process);
+          if (pss->playback != NULL)
+            playback_start(pss->playback, replay_read_cb);
+          else if (!history_next(pss))
+            pty_resume(pss->process);
           break;
         }
-        if (send_initial_message(wsi, pss->initial_cmd_index) < 0) {
+        if (send_initial_message(wsi, pss, pss->initial_cmd_index) < 0) {
           lwsl_err("failed to send initial message, index: %d\n", pss->initial_cmd_index);
           lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
           return -1;
         }
         pss->initial_cmd_index++;
-        lws_callback_on_writable(wsi);
+        request_write(pss);
+        break;
+      }
+
+      if (pss->pong[0] != '\0' || pss->ping_pending) {
+        if ((pss->pong[0] != '\0' ? send_pong(wsi, pss) : send_ping(wsi, pss)) < 0) {
+          lwsl_err("failed to send latency message\n");
+          return -1;
+        }
+        request_write(pss);
         break;
       }
 
+      if (pss->screen != NULL && pss->screen->dirty) {
+        bool closing = pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS;
+        if (!pss->paused || closing) {
+          // the last frame goes out before the close
+          screen_output(wsi, pss);
+          if (closing) request_write(pss);
+          break;
+        }
+      }
+
+      if (view_output(pss) || pool_output(pss)) break;
+
       if (pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) {
+        if (pss->mux != NULL) return send_channel_closed(pss);
         lws_close_reason(wsi, pss->lws_close_status, NULL, 0);
         return 1;
       }
 
-      if (pss->pty_buf != NULL) {
-        wsi_output(wsi, pss->pty_buf);
+      if (pss->pty_buf != NULL && !pss->hidden) {
+        metrics.output_queue_bytes -= pss->pty_buf->len;
+        wsi_output(pss, pss->pty_buf);
+        observe_echo(pss);
         pty_buf_free(pss->pty_buf);
         pss->pty_buf = NULL;
-        pty_resume(pss->process);
+        output_next(pss);
       }
       break;
 
+    case LWS_CALLBACK_RECEIVE_PONG:
+      // pongs of the lws keepalive pings carry no timestamp
+      if (len != sizeof(uint64_t)) break;
+      uint64_t sent;
+      memcpy(&sent, in, sizeof(sent));
+      pss->last_rtt = (uv_hrtime() - sent) / 1e9;
+      metrics_observe(&pss->rtt, pss->last_rtt);
+      metrics_observe(&metrics.rtt_seconds, pss->last_rtt);
+      break;
+
     case LWS_CALLBACK_RECEIVE:
       if (pss->buffer == NULL) {
         pss->buffer = xmalloc(len);
@@ -304,32 +1435,78 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         return 0;
       }
 
+      // nothing runs while queued, only the handshake and the latest size are kept
+      if (pss->queued && command != JSON_DATA) {
+        if (command == RESIZE_TERMINAL)
+          json_object_put(parse_window_size(pss->buffer + 1, pss->len - 1, &pss->columns, &pss->rows));
+        free(pss->buffer);
+        pss->buffer = NULL;
+        break;
+      }
+
       switch (command) {
         case INPUT:
-          if (!server->writable) break;
+          session_wake(pss);
+          metrics.input_bytes_total += pss->len - 1;
+          if (pss->playback != NULL) {
+            playback_control(pss->playback, pss->buffer + 1, pss->len - 1);
+            break;
+          }
+          if (!server->writable || pss->viewer || pss->pending != NULL) break;
           int err = pty_write(pss->process, pty_buf_init(pss->buffer + 1, pss->len - 1));
           if (err) {
             lwsl_err("uv_write: %s (%s)\n", uv_err_name(err), uv_strerror(err));
             return -1;
           }
+          if (pss->input_time == 0) pss->input_time = uv_hrtime();
           break;
         case RESIZE_TERMINAL:
           if (pss->process == NULL) break;
+          session_wake(pss);
+          metrics.resize_total++;
           json_object_put(
               parse_window_size(pss->buffer + 1, pss->len - 1, &pss->process->columns, &pss->process->rows));
           pty_resize(pss->process);
+          if (pss->screen != NULL) {
+            screen_resize(pss->screen, pss->process->columns, pss->process->rows);
+            schedule_frame(pss);
+          }
           break;
         case PAUSE:
+          metrics.pause_total++;
+          pss->paused = true;
+          if (pss->screen != NULL) break;
           pty_pause(pss->process);
+          playback_pause(pss->playback);
           break;
         case RESUME:
-          pty_resume(pss->process);
+          metrics.resume_total++;
+          pss->paused = false;
+          if (pss->screen != NULL) {
+            schedule_frame(pss);
+            break;
+          }
+          output_resume(pss);
+          break;
+        case PING: {
+          // echo the client timestamp for its own round trip, and measure ours
+          n = pss->len - 1 < sizeof(buf) - 1 ? pss->len - 1 : sizeof(buf) - 1;
+          memcpy(buf, pss->buffer + 1, n);
+          buf[n] = '\0';
+          double ts = strtod(buf, NULL);
+          snprintf(pss->pong, sizeof(pss->pong), "%.3f", ts > -1e15 && ts < 1e15 ? ts : 0);
+          pss->ping_pending = true;
+          request_write(pss);
+        } break;
+        case VISIBILITY:
+          set_visibility(pss, pss->len > 1 && pss->buffer[1] == '0');
           break;
         case JSON_DATA:
-          if (pss->process != NULL) break;
+          if (pss->process != NULL || pss->viewer || pss->pending != NULL) break;
           uint16_t columns = 0;
           uint16_t rows = 0;
           json_object *obj = parse_window_size(pss->buffer, pss->len, &columns, &rows);
+          struct json_object *session = NULL;
           if (server->credential != NULL) {
             struct json_object *o = NULL;
             if (json_object_object_get_ex(obj, "AuthToken", &o)) {
@@ -340,12 +1517,43 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                 lwsl_warn("WS authentication failed with token: %s\n", token);
             }
             if (!pss->authenticated) {
+              metrics.auth_failures_total++;
               json_object_put(obj);
-              lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
+              // a tty-mux channel closes on its own, the connection is shared
+              if (pss->mux != NULL)
+                pss->lws_close_status = LWS_CLOSE_STATUS_POLICY_VIOLATION;
+              else
+                lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
               return -1;
             }
           }
+          if (server->max_viewers > 0 && json_object_object_get_ex(obj, "ViewSessionId", &session)) {
+            if (pss->queued)
+              pss->lws_close_status = 1013;  // try again later
+            else
+              view_attach(pss, json_object_get_string(session));
+            json_object_put(obj);
+            request_write(pss);
+            break;
+          }
+          // a client of a session handed over on upgrade comes back to it
+          if (!pss->queued && json_object_object_get_ex(obj, "SessionId", &session) &&
+              session_attach(pss, json_object_get_string(session), columns, rows)) {
+            json_object_put(obj);
+            break;
+          }
           json_object_put(obj);
+          if (pss->queued) {
+            pss->handshake = true;
+            pss->columns = columns;
+            pss->rows = rows;
+            break;
+          }
+          if (pss->playback != NULL) {
+            request_write(pss);
+            break;
+          }
+          if (spawn_refused(pss)) break;
           if (!spawn_process(pss, columns, rows)) return 1;
           break;
         default:
@@ -362,20 +1570,85 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
     case LWS_CALLBACK_CLOSED:
       if (pss->wsi == NULL) break;
 
-      server->client_count--;
-      lwsl_notice("WS closed from %s, clients: %d\n", pss->address, server->client_count);
+      if (pss->queued) {
+        queue_remove(pss);
+        queue_notify();
+        lwsl_notice("WS closed from %s, queued: %d\n", pss->address, queue_count);
+      } else {
+        server->client_count--;
+        lwsl_notice("WS closed from %s, clients: %d\n", pss->address, server->client_count);
+        queue_admit();
+      }
       if (pss->buffer != NULL) free(pss->buffer);
-      if (pss->pty_buf != NULL) pty_buf_free(pss->pty_buf);
+      free(pss->message);
+      if (pss->pty_buf != NULL) {
+        metrics.output_queue_bytes -= pss->pty_buf->len;
+        pty_buf_free(pss->pty_buf);
+      }
+      metrics.output_queue_bytes -= compress_cancel(&pss->compress);
+      // the viewers send what they have left, then close
+      while (pss->viewers != NULL) {
+        struct pss_tty *v = pss->viewers;
+        pss->viewers = v->viewer_next;
+        v->viewer_next = NULL;
+        v->viewed = NULL;
+        v->lws_close_status = 1000;
+        request_write(v);
+      }
+      if (pss->viewer) {
+        view_detach(pss);
+        metrics.viewers--;
+      }
+      history_free(pss->history);
+      pss->history = NULL;
       for (int i = 0; i < pss->argc; i++) {
         free(pss->args[i]);
       }
 
+      if (pss->playback != NULL) {
+        playback_free(pss->playback);
+        pss->playback = NULL;
+      }
+
+      if (pss->screen != NULL) {
+        uv_timer_stop(pss->frame_timer);
+        uv_close((uv_handle_t *)pss->frame_timer, frame_close_cb);
+        screen_free(pss->screen);
+        pss->screen = NULL;
+      }
+
+      if (pss->idle_timer != NULL) {
+        uv_timer_stop(pss->idle_timer);
+        uv_close((uv_handle_t *)pss->idle_timer, idle_close_cb);
+        pss->idle_timer = NULL;
+        if (pss->hibernated) metrics.hibernated_sessions--;
+        // a stopped process would not act on the signal it is killed with, nor run on after an upgrade
+        idle_continue(pss);
+      }
+
+      session_remove(pss);
+#ifndef _WIN32
+      if (pss->pending != NULL) sessiond_cancel(pss->pending);
+#endif
       if (pss->process != NULL) {
-        ((pty_ctx_t *)pss->process->ctx)->ws_closed = true;
-        if (process_running(pss->process)) {
+        pty_ctx_t *ctx = (pty_ctx_t *)pss->process->ctx;
+        ctx->ws_closed = true;
+        // on exit, the sessions of the daemon stay there for their clients to come back to
+        bool keep = handed_off || (ctx->remote != NULL && force_exit);
+        if (process_running(pss->process) && !keep) {
           pty_pause(pss->process);
           lwsl_notice("killing process, pid: %d\n", pss->process->pid);
+#ifndef _WIN32
+          if (ctx->remote != NULL) {
+            sessiond_kill(ctx->remote, server->sig_code);
+          } else {
+            pty_kill(pss->process, server->sig_code);
+          }
+          // not our child, the end of its output is what frees it
+          if (pss->process->adopted && ctx->remote == NULL) pty_resume(pss->process);
+#else
           pty_kill(pss->process, server->sig_code);
+#endif
         }
       }
 
@@ -393,3 +1666,202 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
   return 0;
 }
+
+int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  watchdog_scope scope;
+  watchdog_enter(&scope, "callback_tty", reason);
+  int ret = tty_callback(wsi, reason, user, in, len);
+  watchdog_leave(&scope);
+  return ret;
+}
+
+static int channel_find(struct pss_mux *mux, uint16_t id) {
+  for (int i = 0; i < mux->channel_count; i++) {
+    if (mux->channels[i]->channel == id) return i;
+  }
+  return -1;
+}
+
+// a channel is a session of its own, sharing the request of the connection
+static int channel_open(struct pss_mux *mux, uint16_t id) {
+  if (mux->channel_count == MUX_MAX_CHANNELS) {
+    lwsl_warn("refuse to open channel %d, %s has %d channels open\n", id, mux->conn.address, MUX_MAX_CHANNELS);
+    return -1;
+  }
+
+  struct pss_tty *pss = xmalloc(sizeof(struct pss_tty));
+  memset(pss, 0, sizeof(struct pss_tty));
+  pss->wsi = mux->conn.wsi;
+  pss->mux = mux;
+  pss->channel = id;
+  pss->lws_close_status = LWS_CLOSE_STATUS_NOSTATUS;
+  pss->compress.enabled = mux->conn.compress.enabled;
+  memcpy(pss->user, mux->conn.user, sizeof(pss->user));
+  memcpy(pss->address, mux->conn.address, sizeof(pss->address));
+  memcpy(pss->path, mux->conn.path, sizeof(pss->path));
+  if (mux->conn.argc > 0) {
+    pss->args = xmalloc(mux->conn.argc * sizeof(char *));
+    for (int i = 0; i < mux->conn.argc; i++) pss->args[i] = strdup(mux->conn.args[i]);
+    pss->argc = mux->conn.argc;
+  }
+
+  if ((server->once && server->client_count > 0) ||
+      (server->max_clients > 0 && server->client_count >= server->max_clients)) {
+    lwsl_warn("refuse to open channel %d due to the --once/--max-clients option.\n", id);
+    pss->refused = true;
+    pss->initialized = true;
+    pss->lws_close_status = 1013;  // try again later
+    request_write(pss);
+  } else {
+    server->client_count++;
+    metrics.sessions_total++;
+    lwsl_notice("WS   %s - %s, channel: %d, clients: %d\n", pss->path, pss->address, id, server->client_count);
+  }
+
+  mux->channels[mux->channel_count] = pss;
+  return mux->channel_count++;
+}
+
+static void channel_free(struct pss_mux *mux, int index) {
+  struct pss_tty *pss = mux->channels[index];
+  if (pss->refused) {
+    for (int i = 0; i < pss->argc; i++) free(pss->args[i]);
+  } else {
+    tty_callback(pss->wsi, LWS_CALLBACK_CLOSED, pss, NULL, 0);
+  }
+  free(pss->args);
+  free(pss);
+
+  mux->channels[index] = mux->channels[--mux->channel_count];
+  if (mux->next > mux->channel_count) mux->next = 0;
+}
+
+// a complete message: the channel id, then a message of the plain protocol
+static int channel_receive(struct lws *wsi, struct pss_mux *mux, char *message, size_t len) {
+  uint16_t id = (uint16_t)((unsigned char)message[0] << 8 | (unsigned char)message[1]);
+  const char command = message[MUX_HEADER];
+  int index = channel_find(mux, id);
+
+  if (command == CLOSE_CHANNEL) {
+    if (index >= 0) channel_free(mux, index);
+    return 0;
+  }
+  if (index < 0) {
+    // the first message of a channel is the handshake, as on a plain connection
+    if (command != JSON_DATA) {
+      lwsl_warn("ignored message for unknown channel: %d\n", id);
+      return 0;
+    }
+    index = channel_open(mux, id);
+    if (index < 0 || mux->channels[index]->refused) return 0;
+  }
+  struct pss_tty *pss = mux->channels[index];
+  if (pss->failed) return 0;
+  if (tty_callback(wsi, LWS_CALLBACK_RECEIVE, pss, message + MUX_HEADER, len - MUX_HEADER) == 0) return 0;
+
+  // only this channel is closed, the others on the connection go on
+  lwsl_warn("closing channel %d of %s after a failed message\n", id, pss->address);
+  if (pss->lws_close_status <= LWS_CLOSE_STATUS_NOSTATUS) pss->lws_close_status = LWS_CLOSE_STATUS_UNEXPECTED_CONDITION;
+  pss->failed = true;
+  request_write(pss);
+  return 0;
+}
+
+static int tty_mux_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  struct pss_mux *mux = (struct pss_mux *)user;
+  struct pss_tty *conn = &mux->conn;
+  int ret;
+
+  switch (reason) {
+    case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
+      ret = tty_callback(wsi, reason, conn, in, len);
+      if (ret != 0) return ret;
+      if (server->playback_dir != NULL && playback_parse_path(endpoints.playback, conn->path, "/ws", NULL, 0)) {
+        lwsl_warn("refuse to serve tty-mux client for playback: %s\n", conn->path);
+        return 1;
+      }
+      break;
+
+    case LWS_CALLBACK_CONFIRM_EXTENSION_OKAY:
+      return tty_callback(wsi, reason, conn, in, len);
+
+    case LWS_CALLBACK_ESTABLISHED:
+      conn->wsi = wsi;
+      conn->compress.enabled = output_deflate(wsi);
+      if (server->url_arg) parse_url_args(wsi, conn);
+      lws_get_peer_simple(lws_get_network_wsi(wsi), conn->address, sizeof(conn->address));
+      lwsl_notice("WS   %s - %s, tty-mux\n", conn->path, conn->address);
+      break;
+
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+      // one channel per callback, round robin, so a busy channel can not starve the others
+      for (int k = 0; k < mux->channel_count; k++) {
+        int index = (mux->next + k) % mux->channel_count;
+        struct pss_tty *pss = mux->channels[index];
+        if (!pss->want_write) continue;
+        pss->want_write = false;
+        mux->next = index + 1;
+        ret = tty_callback(wsi, reason, pss, in, len);
+        if (ret != 0) return ret;
+        if (pss->channel_closed) channel_free(mux, index);
+        break;
+      }
+      for (int i = 0; i < mux->channel_count; i++) {
+        if (mux->channels[i]->want_write) {
+          lws_callback_on_writable(wsi);
+          break;
+        }
+      }
+      break;
+
+    case LWS_CALLBACK_RECEIVE_PONG:
+      if (len == sizeof(uint64_t) + MUX_HEADER) {
+        unsigned char *p = (unsigned char *)in + sizeof(uint64_t);
+        int index = channel_find(mux, (uint16_t)(p[0] << 8 | p[1]));
+        if (index >= 0) tty_callback(wsi, reason, mux->channels[index], in, sizeof(uint64_t));
+      }
+      break;
+
+    case LWS_CALLBACK_RECEIVE:
+      if (conn->buffer == NULL) {
+        conn->buffer = xmalloc(len);
+        conn->len = len;
+        memcpy(conn->buffer, in, len);
+      } else {
+        conn->buffer = xrealloc(conn->buffer, conn->len + len);
+        memcpy(conn->buffer + conn->len, in, len);
+        conn->len += len;
+      }
+      if (lws_remaining_packet_payload(wsi) > 0 || !lws_is_final_fragment(wsi)) return 0;
+
+      char *message = conn->buffer;
+      size_t message_len = conn->len;
+      conn->buffer = NULL;
+      conn->len = 0;
+      ret = message_len > MUX_HEADER ? channel_receive(wsi, mux, message, message_len) : 0;
+      free(message);
+      return ret;
+
+    case LWS_CALLBACK_CLOSED:
+      if (conn->wsi == NULL) break;
+      while (mux->channel_count > 0) channel_free(mux, mux->channel_count - 1);
+      lwsl_notice("WS closed from %s, tty-mux\n", conn->address);
+      if (conn->buffer != NULL) free(conn->buffer);
+      for (int i = 0; i < conn->argc; i++) free(conn->args[i]);
+      free(conn->args);
+      break;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+int callback_tty_mux(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  watchdog_scope scope;
+  watchdog_enter(&scope, "callback_tty_mux", reason);
+  int ret = tty_mux_callback(wsi, reason, user, in, len);
+  watchdog_leave(&scope);
+  return ret;
+}
@@ -28,6 +28,10 @@ extern char **environ;
 
 #include "pty.h"
 #include "utils.h"
+#ifdef TTYD_FAKE_PTY
+#include "fakepty.h"
+#endif
+#include "watchdog.h"
 
 #ifdef _WIN32
 HRESULT (WINAPI *pCreatePseudoConsole)(COORD, HANDLE, HANDLE, DWORD, HPCON *);
@@ -35,9 +39,25 @@ HRESULT (WINAPI *pResizePseudoConsole)(HPCON, COORD);
 void (WINAPI *pClosePseudoConsole)(HPCON);
 #endif
 
-static void alloc_cb(uv_handle_t *unused, size_t suggested_size, uv_buf_t *buf) {
-  buf->base = xmalloc(suggested_size);
-  buf->len = suggested_size;
+// buffers kept, once there are enough the output path allocates nothing
+#define PTY_BUF_POOL 16
+
+static pty_buf_t *buf_pool[PTY_BUF_POOL];
+static int buf_pool_len = 0;
+
+pty_buf_t *pty_buf_get(size_t len) {
+  if (len <= PTY_BUF_SIZE && buf_pool_len > 0) return buf_pool[--buf_pool_len];
+  pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
+  buf->size = len <= PTY_BUF_SIZE ? PTY_BUF_SIZE : 0;
+  buf->base = xmalloc(buf->size > 0 ? buf->size : len);
+  return buf;
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t unused, uv_buf_t *buf) {
+  pty_process *process = (pty_process *) handle->data;
+  if (process->read_buf == NULL) process->read_buf = pty_buf_get(PTY_BUF_SIZE);
+  buf->base = process->read_buf->base;
+  buf->len = PTY_BUF_SIZE;
 }
 
 static void close_cb(uv_handle_t *handle) { free(handle); }
@@ -46,9 +66,12 @@ static void async_free_cb(uv_handle_t *handle) {
   free((uv_async_t *) handle -> data);
 }
 
+#ifndef _WIN32
+static bool fd_duplicate(int fd, uv_pipe_t *pipe);
+#endif
+
 pty_buf_t *pty_buf_init(char *base, size_t len) {
-  pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
-  buf->base = xmalloc(len);
+  pty_buf_t *buf = pty_buf_get(len);
   memcpy(buf->base, base, len);
   buf->len = len;
   return buf;
@@ -56,6 +79,10 @@ pty_buf_t *pty_buf_init(char *base, size_t len) {
 
 void pty_buf_free(pty_buf_t *buf) {
   if (buf == NULL) return;
+  if (buf->size == PTY_BUF_SIZE && buf_pool_len < PTY_BUF_POOL) {
+    buf_pool[buf_pool_len++] = buf;
+    return;
+  }
   if (buf->base != NULL) free(buf->base);
   free(buf);
 }
@@ -63,15 +90,25 @@ void pty_buf_free(pty_buf_t *buf) {
 static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
   uv_read_stop(stream);
   pty_process *process = (pty_process *) stream->data;
+  watchdog_scope scope;
+  watchdog_enter(&scope, "pty read", -1);
   if (n <= 0) {
-    if (n == UV_ENOBUFS || n == 0) return;
+    if (n == UV_ENOBUFS || n == 0) goto done;
     process->read_cb(process, NULL, true);
+#ifndef _WIN32
+    // not our child, the end of its output is all we learn of its exit
+    if (process->adopted && !process->remote) uv_async_send(&process->async);
+#endif
     goto done;
   }
-  process->read_cb(process, pty_buf_init(buf->base, (size_t) n), false);
+  // the buffer read into is the output, no copy
+  pty_buf_t *out = process->read_buf;
+  process->read_buf = NULL;
+  out->len = (size_t) n;
+  process->read_cb(process, out, false);
 
 done:
-  free(buf->base);
+  watchdog_leave(&scope);
 }
 
 static void write_cb(uv_write_t *req, int unused) {
@@ -94,11 +131,23 @@ pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]
 }
 
 bool process_running(pty_process *process) {
+#ifdef TTYD_FAKE_PTY
+  if (process != NULL && process->fake != NULL) return fake_pty_running(process);
+#endif
+#ifndef _WIN32
+  // it may run as another user, the daemon knows
+  if (process != NULL && process->remote) return process->exit_code < 0;
+#endif
   return process != NULL && process->pid > 0 && uv_kill(process->pid, 0) == 0;
 }
 
-void process_free(pty_process *process) {
-  if (process == NULL) return;
+static void pty_close(pty_process *process) {
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) {
+    fake_pty_free(process);
+    return;
+  }
+#endif
 #ifdef _WIN32
   if (process->si.lpAttributeList != NULL) {
     DeleteProcThreadAttributeList(process->si.lpAttributeList);
@@ -107,26 +156,47 @@ void process_free(pty_process *process) {
   if (process->pty != NULL) pClosePseudoConsole(process->pty);
   if (process->handle != NULL) CloseHandle(process->handle);
 #else
-  close(process->pty);
-  uv_thread_join(&process->tid);
+  // a spawn that failed has neither a pty nor a waiter thread
+  if (process->pty > 0) close(process->pty);
+  if (!process->adopted && process->pid > 0) uv_thread_join(&process->tid);
 #endif
+}
+
+void process_free(pty_process *process) {
+  if (process == NULL) return;
+  pty_close(process);
   if (process->in != NULL) uv_close((uv_handle_t *) process->in, close_cb);
   if (process->out != NULL) uv_close((uv_handle_t *) process->out, close_cb);
+  pty_buf_free(process->read_buf);
   if (process->argv != NULL) free(process->argv);
   if (process->cwd != NULL) free(process->cwd);
-  char **p = process->envp;
-  for (; *p; p++) free(*p);
-  free(process->envp);
+  if (process->envp != NULL) {
+    char **p = process->envp;
+    for (; *p; p++) free(*p);
+    free(process->envp);
+  }
 }
 
 void pty_pause(pty_process *process) {
   if (process == NULL) return;
-  if (process->paused) return;
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) {
+    fake_pty_pause(process);
+    return;
+  }
+#endif
+  // also stops the read pending since the last pty_resume
   uv_read_stop((uv_stream_t *) process->out);
 }
 
 void pty_resume(pty_process *process) {
   if (process == NULL) return;
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) {
+    fake_pty_resume(process);
+    return;
+  }
+#endif
   if (!process->paused) return;
   process->out->data = process;
   uv_read_start((uv_stream_t *) process->out, alloc_cb, read_cb);
@@ -137,15 +207,49 @@ int pty_write(pty_process *process, pty_buf_t *buf) {
     pty_buf_free(buf);
     return UV_ESRCH;
   }
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) return fake_pty_write(process, buf);
+#endif
+#ifndef _WIN32
+  if (process->in == NULL) {
+    // released by pty_hibernate
+    process->in = xmalloc(sizeof(uv_pipe_t));
+    uv_pipe_init(process->loop, process->in, 0);
+    if (!fd_duplicate(process->pty, process->in)) {
+      uv_close((uv_handle_t *) process->in, close_cb);
+      process->in = NULL;
+      pty_buf_free(buf);
+      return UV_EBADF;
+    }
+  }
+#endif
   uv_buf_t b = uv_buf_init(buf->base, buf->len);
   uv_write_t *req = xmalloc(sizeof(uv_write_t));
   req->data = buf;
   return uv_write(req, (uv_stream_t *) process->in, &b, 1, write_cb);
 }
 
+// release the write pipe and the read buffer of an idle process, the next write opens it again
+void pty_hibernate(pty_process *process) {
+  if (process == NULL) return;
+  pty_buf_free(process->read_buf);
+  process->read_buf = NULL;
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) return;
+#endif
+#ifndef _WIN32
+  if (process->in == NULL) return;
+  uv_close((uv_handle_t *) process->in, close_cb);
+  process->in = NULL;
+#endif
+}
+
 bool pty_resize(pty_process *process) {
   if (process == NULL) return false;
   if (process->columns <= 0 || process->rows <= 0) return false;
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) return true;
+#endif
 #ifdef _WIN32
   COORD size = {(int16_t) process->columns, (int16_t) process->rows};
   return pResizePseudoConsole(process->pty, size) == S_OK;
@@ -157,6 +261,9 @@ bool pty_resize(pty_process *process) {
 
 bool pty_kill(pty_process *process, int sig) {
   if (process == NULL) return false;
+#ifdef TTYD_FAKE_PTY
+  if (process->fake != NULL) return fake_pty_kill(process, sig);
+#endif
 #ifdef _WIN32
   return TerminateProcess(process->handle, 1) != 0;
 #else
@@ -289,6 +396,8 @@ static void CALLBACK conpty_exit(void *context, BOOLEAN unused) {
 
 static void async_cb(uv_async_t *async) {
   pty_process *process = (pty_process *) async->data;
+  watchdog_scope scope;
+  watchdog_enter(&scope, "pty exit", -1);
   UnregisterWait(process->wait);
 
   DWORD exit_code;
@@ -299,9 +408,17 @@ static void async_cb(uv_async_t *async) {
 
   uv_close((uv_handle_t *) async, async_free_cb);
   process_free(process);
+  watchdog_leave(&scope);
 }
 
 int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+#ifdef TTYD_FAKE_PTY
+  if (fake_pty_enabled()) {
+    process->read_cb = read_cb;
+    process->exit_cb = exit_cb;
+    return fake_pty_spawn(process);
+  }
+#endif
   char *in_name = NULL;
   char *out_name = NULL;
   DWORD flags = EXTENDED_STARTUPINFO_PRESENT | CREATE_UNICODE_ENVIRONMENT;
@@ -410,13 +527,46 @@ static void wait_cb(void *arg) {
 
 static void async_cb(uv_async_t *async) {
   pty_process *process = (pty_process *) async->data;
+  watchdog_scope scope;
+  watchdog_enter(&scope, "pty exit", -1);
   process->exit_cb(process);
 
   uv_close((uv_handle_t *) async, async_free_cb);
   process_free(process);
+  watchdog_leave(&scope);
+}
+
+static int pty_open(pty_process *process, int master, int pid, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+  int flags = fcntl(master, F_GETFL);
+  if (flags == -1) return -errno;
+  if (fcntl(master, F_SETFL, flags | O_NONBLOCK) == -1) return -errno;
+  if (!fd_set_cloexec(master)) return -errno;
+
+  process->in = xmalloc(sizeof(uv_pipe_t));
+  process->out = xmalloc(sizeof(uv_pipe_t));
+  uv_pipe_init(process->loop, process->in, 0);
+  uv_pipe_init(process->loop, process->out, 0);
+
+  if (!fd_duplicate(master, process->in) || !fd_duplicate(master, process->out)) return -errno;
+
+  process->pty = master;
+  process->pid = pid;
+  process->paused = true;
+  process->read_cb = read_cb;
+  process->exit_cb = exit_cb;
+  process->async.data = process;
+  uv_async_init(process->loop, &process->async, async_cb);
+  return 0;
 }
 
 int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+#ifdef TTYD_FAKE_PTY
+  if (fake_pty_enabled()) {
+    process->read_cb = read_cb;
+    process->exit_cb = exit_cb;
+    return fake_pty_spawn(process);
+  }
+#endif
   int status = 0;
 
   uv_disable_stdio_inheritance();
@@ -441,37 +591,8 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
     }
   }
 
-  int flags = fcntl(master, F_GETFL);
-  if (flags == -1) {
-    status = -errno;
-    goto error;
-  }
-  if (fcntl(master, F_SETFL, flags | O_NONBLOCK) == -1) {
-    status = -errno;
-    goto error;
-  }
-  if (!fd_set_cloexec(master)) {
-    status = -errno;
-    goto error;
-  }
-
-  process->in = xmalloc(sizeof(uv_pipe_t));
-  process->out = xmalloc(sizeof(uv_pipe_t));
-  uv_pipe_init(process->loop, process->in, 0);
-  uv_pipe_init(process->loop, process->out, 0);
-
-  if (!fd_duplicate(master, process->in) || !fd_duplicate(master, process->out)) {
-    status = -errno;
-    goto error;
-  }
-
-  process->pty = master;
-  process->pid = pid;
-  process->paused = true;
-  process->read_cb = read_cb;
-  process->exit_cb = exit_cb;
-  process->async.data = process;
-  uv_async_init(process->loop, &process->async, async_cb);
+  status = pty_open(process, master, pid, read_cb, exit_cb);
+  if (status != 0) goto error;
   uv_thread_create(&process->tid, wait_cb, process);
 
   return 0;
@@ -482,4 +603,25 @@ error:
   waitpid(pid, NULL, 0);
   return status;
 }
+
+int pty_adopt(pty_process *process, int master, int pid, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+  process->adopted = true;
+  process->pty = master;
+  // its exit status goes to init, a command that is gone is taken as exited normally
+  process->exit_code = 0;
+  return pty_open(process, master, pid, read_cb, exit_cb);
+}
+
+int pty_attach(pty_process *process, int master, int pid, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+  process->adopted = true;
+  process->remote = true;
+  process->pty = master;
+  return pty_open(process, master, pid, read_cb, exit_cb);
+}
+
+void pty_exited(pty_process *process, int exit_code, int exit_signal) {
+  process->exit_code = exit_code;
+  process->exit_signal = exit_signal;
+  uv_async_send(&process->async);
+}
 #endif
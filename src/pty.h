@@ -16,9 +16,13 @@
 bool conpty_init();
 #endif
 
+// reads, and copies up to this size, use buffers kept for reuse once freed
+#define PTY_BUF_SIZE (64 * 1024)
+
 typedef struct {
   char *base;
   size_t len;
+  size_t size;  // of base if it is kept for reuse once freed, else 0
 } pty_buf_t;
 
 struct pty_process_;
@@ -37,6 +41,8 @@ struct pty_process_ {
 #else
   pid_t pty;
   uv_thread_t tid;
+  bool adopted;  // taken over from a previous ttyd on upgrade, not our child
+  bool remote;   // a child of the session daemon, which reports its exit (pty_exited)
 #endif
   char **argv;
   char **envp;
@@ -47,21 +53,32 @@ struct pty_process_ {
   uv_pipe_t *in;
   uv_pipe_t *out;
   bool paused;
+  pty_buf_t *read_buf;  // handed to the read in progress
 
   pty_read_cb read_cb;
   pty_exit_cb exit_cb;
   void *ctx;
+#ifdef TTYD_FAKE_PTY
+  void *fake;  // state of the fake backend, if used
+#endif
 };
 
+pty_buf_t *pty_buf_get(size_t len);
 pty_buf_t *pty_buf_init(char *base, size_t len);
 void pty_buf_free(pty_buf_t *buf);
 pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]);
 bool process_running(pty_process *process);
 void process_free(pty_process *process);
 int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb);
+#ifndef _WIN32
+int pty_adopt(pty_process *process, int master, int pid, pty_read_cb read_cb, pty_exit_cb exit_cb);
+int pty_attach(pty_process *process, int master, int pid, pty_read_cb read_cb, pty_exit_cb exit_cb);
+void pty_exited(pty_process *process, int exit_code, int exit_signal);
+#endif
 void pty_pause(pty_process *process);
 void pty_resume(pty_process *process);
 int pty_write(pty_process *process, pty_buf_t *buf);
+void pty_hibernate(pty_process *process);
 bool pty_resize(pty_process *process);
 bool pty_kill(pty_process *process, int sig);
 
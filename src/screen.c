@@ -0,0 +1,995 @@
+#include "screen.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+enum { GROUND, ESCAPE, CHARSET, CSI, OSC, OSC_ESC, STRING, STRING_ESC };
+
+// DEC private modes forwarded to the client
+#define MODE_APP_CURSOR 0x001
+#define MODE_CURSOR_VISIBLE 0x002
+#define MODE_MOUSE_X10 0x004
+#define MODE_MOUSE_VT200 0x008
+#define MODE_MOUSE_BUTTON 0x010
+#define MODE_MOUSE_ANY 0x020
+#define MODE_FOCUS 0x040
+#define MODE_MOUSE_UTF8 0x080
+#define MODE_MOUSE_SGR 0x100
+#define MODE_MOUSE_URXVT 0x200
+#define MODE_PASTE 0x400
+#define MODE_APP_KEYPAD 0x800
+
+static const struct {
+  int mode;
+  uint32_t bit;
+} dec_modes[] = {{1, MODE_APP_CURSOR},      {25, MODE_CURSOR_VISIBLE}, {9, MODE_MOUSE_X10},
+                 {1000, MODE_MOUSE_VT200},  {1002, MODE_MOUSE_BUTTON}, {1003, MODE_MOUSE_ANY},
+                 {1004, MODE_FOCUS},        {1005, MODE_MOUSE_UTF8},   {1006, MODE_MOUSE_SGR},
+                 {1015, MODE_MOUSE_URXVT},  {2004, MODE_PASTE},        {0, 0}};
+
+// DEC special graphics, 0x5f - 0x7e
+static const uint16_t dec_graphics[] = {0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+                                        0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+                                        0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+                                        0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7};
+
+static const uint32_t wide_ranges[][2] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},   {0x23e9, 0x23ec},   {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3},   {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},   {0x267f, 0x267f},
+    {0x2693, 0x2693},   {0x26a1, 0x26a1},   {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},   {0x26f2, 0x26f5},   {0x26fa, 0x26fd},
+    {0x2705, 0x2705},   {0x270a, 0x270b},   {0x2728, 0x2728},   {0x274c, 0x274c},   {0x2753, 0x2757},
+    {0x2795, 0x2797},   {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},   {0x2b50, 0x2b55},
+    {0x2e80, 0x303e},   {0x3041, 0x33ff},   {0x3400, 0x4dbf},   {0x4e00, 0x9fff},   {0xa000, 0xa4cf},
+    {0xa960, 0xa97f},   {0xac00, 0xd7a3},   {0xf900, 0xfaff},   {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},
+    {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff},
+    {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+    {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f9ff}, {0x1fa70, 0x1faff},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd}};
+
+static const uint32_t zero_ranges[][2] = {{0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+                                          {0x064b, 0x065f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e},
+                                          {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff},
+                                          {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0xe0100, 0xe01ef}};
+
+static bool in_ranges(uint32_t c, const uint32_t (*ranges)[2], size_t n) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (c < ranges[mid][0])
+      hi = mid;
+    else if (c > ranges[mid][1])
+      lo = mid + 1;
+    else
+      return true;
+  }
+  return false;
+}
+
+static int char_width(uint32_t c) {
+  if (c < 0x300) return 1;
+  if (in_ranges(c, zero_ranges, sizeof(zero_ranges) / sizeof(zero_ranges[0]))) return 0;
+  if (in_ranges(c, wide_ranges, sizeof(wide_ranges) / sizeof(wide_ranges[0]))) return 2;
+  return 1;
+}
+
+static screen_cell blank_cell(screen_t *s) {
+  screen_cell cell = {' ', 0, s->cur.pen.bg, 0, 1, 0};
+  return cell;
+}
+
+static bool cell_is_blank(const screen_cell *cell) {
+  return cell->ch == ' ' && cell->bg == 0 && (cell->attr & (ATTR_UNDERLINE | ATTR_INVERSE | ATTR_STRIKE)) == 0;
+}
+
+static screen_cell *row_at(screen_t *s, int y) { return s->cells + (size_t)y * s->cols; }
+
+static void fill(screen_cell *cells, size_t n, screen_cell cell) {
+  for (size_t i = 0; i < n; i++) cells[i] = cell;
+}
+
+static void erase(screen_t *s, int y, int from, int to) {
+  if (from < 0) from = 0;
+  if (to > s->cols) to = s->cols;
+  if (from >= to) return;
+  screen_cell *row = row_at(s, y);
+  // don't leave half of a wide char behind
+  if (from > 0 && row[from].width == 0) from--;
+  if (to < s->cols && row[to].width == 0) to++;
+  fill(row + from, (size_t)(to - from), blank_cell(s));
+  s->dirty = true;
+}
+
+static void scroll_up(screen_t *s, int top, int bottom, int n) {
+  if (n > bottom - top + 1) n = bottom - top + 1;
+  if (n <= 0) return;
+  memmove(row_at(s, top), row_at(s, top + n), (size_t)(bottom - top + 1 - n) * s->cols * sizeof(screen_cell));
+  for (int y = bottom - n + 1; y <= bottom; y++) erase(s, y, 0, s->cols);
+  if (top == 0 && bottom == s->rows - 1 && s->cells == s->primary) s->scrolled += n;
+  s->dirty = true;
+}
+
+static void scroll_down(screen_t *s, int top, int bottom, int n) {
+  if (n > bottom - top + 1) n = bottom - top + 1;
+  if (n <= 0) return;
+  memmove(row_at(s, top + n), row_at(s, top), (size_t)(bottom - top + 1 - n) * s->cols * sizeof(screen_cell));
+  for (int y = top; y < top + n; y++) erase(s, y, 0, s->cols);
+  s->dirty = true;
+}
+
+static void linefeed(screen_t *s) {
+  s->wrap_pending = false;
+  if (s->cur.y == s->bottom)
+    scroll_up(s, s->top, s->bottom, 1);
+  else if (s->cur.y < s->rows - 1)
+    s->cur.y++;
+}
+
+static void reverse_index(screen_t *s) {
+  s->wrap_pending = false;
+  if (s->cur.y == s->top)
+    scroll_down(s, s->top, s->bottom, 1);
+  else if (s->cur.y > 0)
+    s->cur.y--;
+}
+
+static void move_to(screen_t *s, int x, int y) {
+  int top = 0, bottom = s->rows - 1;
+  if (s->cur.origin) {
+    top = s->top;
+    bottom = s->bottom;
+    y += s->top;
+  }
+  s->cur.x = x < 0 ? 0 : x >= s->cols ? s->cols - 1 : x;
+  s->cur.y = y < top ? top : y > bottom ? bottom : y;
+  s->wrap_pending = false;
+}
+
+static void move_rel(screen_t *s, int dx, int dy) {
+  int top = s->cur.y >= s->top ? s->top : 0;
+  int bottom = s->cur.y <= s->bottom ? s->bottom : s->rows - 1;
+  int x = s->cur.x + dx, y = s->cur.y + dy;
+  s->cur.x = x < 0 ? 0 : x >= s->cols ? s->cols - 1 : x;
+  s->cur.y = y < top ? top : y > bottom ? bottom : y;
+  s->wrap_pending = false;
+}
+
+// split a wide char crossing the boundary before column x
+static void split_wide(screen_t *s, screen_cell *row, int x) {
+  if (x <= 0 || x >= s->cols || row[x].width != 0) return;
+  row[x - 1] = row[x] = blank_cell(s);
+}
+
+static void insert_cells(screen_t *s, int n) {
+  screen_cell *row = row_at(s, s->cur.y);
+  int x = s->cur.x;
+  if (n > s->cols - x) n = s->cols - x;
+  split_wide(s, row, x);
+  split_wide(s, row, s->cols - n);
+  memmove(row + x + n, row + x, (size_t)(s->cols - x - n) * sizeof(screen_cell));
+  fill(row + x, (size_t)n, blank_cell(s));
+  s->dirty = true;
+}
+
+static void delete_cells(screen_t *s, int n) {
+  screen_cell *row = row_at(s, s->cur.y);
+  int x = s->cur.x;
+  if (n > s->cols - x) n = s->cols - x;
+  split_wide(s, row, x);
+  split_wide(s, row, x + n);
+  memmove(row + x, row + x + n, (size_t)(s->cols - x - n) * sizeof(screen_cell));
+  fill(row + s->cols - n, (size_t)n, blank_cell(s));
+  s->dirty = true;
+}
+
+static void put_char(screen_t *s, uint32_t c) {
+  screen_cursor *cur = &s->cur;
+  if (cur->graphics[cur->charset] && c >= 0x5f && c <= 0x7e) c = dec_graphics[c - 0x5f];
+
+  int width = char_width(c);
+  if (width == 0) return;  // combining characters are not tracked
+  s->last_char = c;
+  if (width > s->cols) return;  // a wide character does not fit a screen of one column
+
+  if (s->wrap_pending && s->autowrap) {
+    cur->x = 0;
+    linefeed(s);
+  }
+  s->wrap_pending = false;
+  if (width == 2 && cur->x == s->cols - 1) {
+    if (!s->autowrap) return;
+    erase(s, cur->y, cur->x, cur->x + 1);
+    cur->x = 0;
+    linefeed(s);
+  }
+  if (s->insert) insert_cells(s, width);
+
+  screen_cell *row = row_at(s, cur->y);
+  erase(s, cur->y, cur->x, cur->x + width);
+  screen_cell cell = cur->pen;
+  cell.ch = c;
+  cell.width = (uint8_t)width;
+  row[cur->x] = cell;
+  if (width == 2) {
+    cell.ch = ' ';
+    cell.width = 0;
+    row[cur->x + 1] = cell;
+  }
+  s->dirty = true;
+
+  cur->x += width;
+  if (cur->x >= s->cols) {
+    cur->x = s->cols - 1;
+    s->wrap_pending = true;
+  }
+}
+
+static void reply(screen_t *s, const char *fmt, int a, int b) {
+  int n = snprintf(s->reply + s->reply_len, sizeof(s->reply) - s->reply_len, fmt, a, b);
+  if (n > 0 && s->reply_len + n < sizeof(s->reply)) s->reply_len += n;
+}
+
+static void reset(screen_t *s) {
+  memset(&s->cur, 0, sizeof(s->cur));
+  s->cur.pen = (screen_cell){' ', 0, 0, 0, 1, 0};
+  s->saved[0] = s->saved[1] = s->cur;
+  s->cells = s->primary;
+  fill(s->primary, (size_t)s->cols * s->rows, s->cur.pen);
+  fill(s->alternate, (size_t)s->cols * s->rows, s->cur.pen);
+  s->top = 0;
+  s->bottom = s->rows - 1;
+  s->autowrap = true;
+  s->insert = false;
+  s->wrap_pending = false;
+  s->modes = MODE_CURSOR_VISIBLE;
+  s->dirty = true;
+}
+
+static void save_cursor(screen_t *s) { s->saved[s->cells == s->alternate] = s->cur; }
+
+static void restore_cursor(screen_t *s) {
+  s->cur = s->saved[s->cells == s->alternate];
+  if (s->cur.x >= s->cols) s->cur.x = s->cols - 1;
+  if (s->cur.y >= s->rows) s->cur.y = s->rows - 1;
+  s->wrap_pending = false;
+}
+
+static void switch_buffer(screen_t *s, bool alternate, bool clear) {
+  if ((s->cells == s->alternate) == alternate) return;
+  s->cells = alternate ? s->alternate : s->primary;
+  if (clear) fill(s->cells, (size_t)s->cols * s->rows, blank_cell(s));
+  s->scrolled = 0;
+  s->dirty = true;
+}
+
+static void set_mode(screen_t *s, int mode, bool set) {
+  if (s->prefix != '?') {
+    if (mode == 4) s->insert = set;
+    return;
+  }
+  switch (mode) {
+    case 6:
+      s->cur.origin = set;
+      move_to(s, 0, 0);
+      return;
+    case 7:
+      s->autowrap = set;
+      return;
+    case 47:
+    case 1047:
+      switch_buffer(s, set, set && mode == 1047);
+      return;
+    case 1049:
+      if (set) save_cursor(s);
+      switch_buffer(s, set, set);
+      if (!set) restore_cursor(s);
+      return;
+    default:
+      break;
+  }
+  for (int i = 0; dec_modes[i].mode != 0; i++) {
+    if (dec_modes[i].mode != mode) continue;
+    if (set)
+      s->modes |= dec_modes[i].bit;
+    else
+      s->modes &= ~dec_modes[i].bit;
+    s->dirty = true;
+  }
+}
+
+static void parse_color(screen_t *s, int *i, uint32_t *color) {
+  int *p = s->params;
+  if (*i + 2 < s->nparams && p[*i + 1] == 5) {
+    *color = 1 + (uint32_t)(p[*i + 2] & 0xff);
+    *i += 2;
+  } else if (*i + 4 < s->nparams && p[*i + 1] == 2) {
+    *color = COLOR_RGB | ((uint32_t)(p[*i + 2] & 0xff) << 16) | ((uint32_t)(p[*i + 3] & 0xff) << 8) |
+             (uint32_t)(p[*i + 4] & 0xff);
+    *i += 4;
+  }
+}
+
+static void sgr(screen_t *s) {
+  screen_cell *pen = &s->cur.pen;
+  if (s->nparams == 0) s->params[s->nparams++] = 0;
+  for (int i = 0; i < s->nparams; i++) {
+    int p = s->params[i];
+    switch (p) {
+      case 0:
+        pen->attr = 0;
+        pen->fg = pen->bg = 0;
+        break;
+      case 1:
+        pen->attr |= ATTR_BOLD;
+        break;
+      case 2:
+        pen->attr |= ATTR_DIM;
+        break;
+      case 3:
+        pen->attr |= ATTR_ITALIC;
+        break;
+      case 4:
+        pen->attr |= ATTR_UNDERLINE;
+        break;
+      case 5:
+        pen->attr |= ATTR_BLINK;
+        break;
+      case 7:
+        pen->attr |= ATTR_INVERSE;
+        break;
+      case 8:
+        pen->attr |= ATTR_HIDDEN;
+        break;
+      case 9:
+        pen->attr |= ATTR_STRIKE;
+        break;
+      case 21:
+      case 22:
+        pen->attr &= ~(ATTR_BOLD | ATTR_DIM);
+        break;
+      case 23:
+        pen->attr &= ~ATTR_ITALIC;
+        break;
+      case 24:
+        pen->attr &= ~ATTR_UNDERLINE;
+        break;
+      case 25:
+        pen->attr &= ~ATTR_BLINK;
+        break;
+      case 27:
+        pen->attr &= ~ATTR_INVERSE;
+        break;
+      case 28:
+        pen->attr &= ~ATTR_HIDDEN;
+        break;
+      case 29:
+        pen->attr &= ~ATTR_STRIKE;
+        break;
+      case 38:
+        parse_color(s, &i, &pen->fg);
+        break;
+      case 39:
+        pen->fg = 0;
+        break;
+      case 48:
+        parse_color(s, &i, &pen->bg);
+        break;
+      case 49:
+        pen->bg = 0;
+        break;
+      default:
+        if (p >= 30 && p <= 37)
+          pen->fg = 1 + (uint32_t)(p - 30);
+        else if (p >= 40 && p <= 47)
+          pen->bg = 1 + (uint32_t)(p - 40);
+        else if (p >= 90 && p <= 97)
+          pen->fg = 9 + (uint32_t)(p - 90);
+        else if (p >= 100 && p <= 107)
+          pen->bg = 9 + (uint32_t)(p - 100);
+        break;
+    }
+  }
+}
+
+static void csi_dispatch(screen_t *s, char c) {
+  int *p = s->params;
+  int p0 = s->nparams > 0 ? p[0] : 0;
+  int n = p0 > 0 ? p0 : 1;
+  int y = s->cur.y;
+
+  if (s->inter == '!' && c == 'p') {  // DECSTR
+    s->cur.pen = (screen_cell){' ', 0, 0, 0, 1, 0};
+    s->cur.origin = false;
+    s->top = 0;
+    s->bottom = s->rows - 1;
+    s->insert = false;
+    s->autowrap = true;
+    s->modes = MODE_CURSOR_VISIBLE;
+    s->dirty = true;
+    return;
+  }
+  if (s->inter != 0) return;
+
+  switch (c) {
+    case '@':
+      insert_cells(s, n);
+      break;
+    case 'A':
+      move_rel(s, 0, -n);
+      break;
+    case 'B':
+    case 'e':
+      move_rel(s, 0, n);
+      break;
+    case 'C':
+    case 'a':
+      move_rel(s, n, 0);
+      break;
+    case 'D':
+      move_rel(s, -n, 0);
+      break;
+    case 'E':
+      move_rel(s, -s->cur.x, n);
+      break;
+    case 'F':
+      move_rel(s, -s->cur.x, -n);
+      break;
+    case 'G':
+    case '`':
+      s->cur.x = n - 1 < s->cols ? n - 1 : s->cols - 1;
+      s->wrap_pending = false;
+      break;
+    case 'H':
+    case 'f':
+      move_to(s, (s->nparams > 1 && p[1] > 0 ? p[1] : 1) - 1, n - 1);
+      break;
+    case 'I':
+      // the parameter goes up to 655359, past cols / 8 tabs the cursor stays in the last column
+      if (n > s->cols / 8 + 1) n = s->cols / 8 + 1;
+      while (n-- > 0) move_rel(s, 8 - s->cur.x % 8, 0);
+      break;
+    case 'Z':
+      while (n-- > 0 && s->cur.x > 0) move_rel(s, -((s->cur.x - 1) % 8 + 1), 0);
+      break;
+    case 'J':
+      if (p0 == 0) {
+        erase(s, y, s->cur.x, s->cols);
+        for (int i = y + 1; i < s->rows; i++) erase(s, i, 0, s->cols);
+      } else if (p0 == 1) {
+        for (int i = 0; i < y; i++) erase(s, i, 0, s->cols);
+        erase(s, y, 0, s->cur.x + 1);
+      } else if (p0 == 2 || p0 == 3) {
+        for (int i = 0; i < s->rows; i++) erase(s, i, 0, s->cols);
+      }
+      break;
+    case 'K':
+      if (p0 == 0)
+        erase(s, y, s->cur.x, s->cols);
+      else if (p0 == 1)
+        erase(s, y, 0, s->cur.x + 1);
+      else if (p0 == 2)
+        erase(s, y, 0, s->cols);
+      break;
+    case 'L':
+      if (y >= s->top && y <= s->bottom) scroll_down(s, y, s->bottom, n);
+      s->cur.x = 0;
+      break;
+    case 'M':
+      if (y >= s->top && y <= s->bottom) scroll_up(s, y, s->bottom, n);
+      s->cur.x = 0;
+      break;
+    case 'P':
+      delete_cells(s, n);
+      break;
+    case 'S':
+      if (s->prefix == 0) scroll_up(s, s->top, s->bottom, n);
+      break;
+    case 'T':
+      if (s->prefix == 0) scroll_down(s, s->top, s->bottom, n);
+      break;
+    case 'X':
+      erase(s, y, s->cur.x, s->cur.x + n);
+      break;
+    case 'b':
+      if (s->last_char != 0) {
+        // the parameter goes up to 655359, past a screenful and a line of the character the screen and the cursor
+        // repeat with every line of it
+        int line = s->cols > 1 ? s->cols / char_width(s->last_char) : 1, full = line * (s->rows + 1);
+        if (n > full) n = full + (n - full) % line;
+        while (n-- > 0) put_char(s, s->last_char);
+      }
+      break;
+    case 'c':
+      if (s->prefix == '>')
+        reply(s, "\x1b[>0;276;0c", 0, 0);
+      else if (s->prefix == 0 && p0 == 0)
+        reply(s, "\x1b[?1;2c", 0, 0);
+      break;
+    case 'd':
+      move_to(s, s->cur.x, n - 1);
+      break;
+    case 'h':
+    case 'l':
+      for (int i = 0; i < s->nparams; i++) set_mode(s, p[i], c == 'h');
+      break;
+    case 'm':
+      if (s->prefix == 0) sgr(s);
+      break;
+    case 'n':
+      if (s->prefix != 0) break;
+      if (p0 == 5) reply(s, "\x1b[0n", 0, 0);
+      if (p0 == 6) reply(s, "\x1b[%d;%dR", s->cur.y + 1 - (s->cur.origin ? s->top : 0), s->cur.x + 1);
+      break;
+    case 'r':
+      if (s->prefix != 0) break;
+      {
+        int top = p0 > 0 ? p0 - 1 : 0;
+        int bottom = s->nparams > 1 && p[1] > 0 ? p[1] - 1 : s->rows - 1;
+        if (bottom >= s->rows) bottom = s->rows - 1;
+        if (top >= bottom) break;
+        s->top = top;
+        s->bottom = bottom;
+        move_to(s, 0, 0);
+      }
+      break;
+    case 's':
+      if (s->prefix == 0) save_cursor(s);
+      break;
+    case 'u':
+      if (s->prefix == 0) restore_cursor(s);
+      break;
+    default:
+      break;
+  }
+}
+
+static void osc_dispatch(screen_t *s) {
+  s->osc[s->osc_len] = '\0';
+  if ((s->osc[0] == '0' || s->osc[0] == '2') && s->osc[1] == ';') {
+    snprintf(s->title, sizeof(s->title), "%s", s->osc + 2);
+    s->title_changed = true;
+    s->dirty = true;
+  }
+}
+
+static void esc_dispatch(screen_t *s, char c) {
+  switch (c) {
+    case '7':
+      save_cursor(s);
+      break;
+    case '8':
+      restore_cursor(s);
+      break;
+    case 'D':
+      linefeed(s);
+      break;
+    case 'E':
+      s->cur.x = 0;
+      linefeed(s);
+      break;
+    case 'M':
+      reverse_index(s);
+      break;
+    case 'c':
+      reset(s);
+      break;
+    case '=':
+      s->modes |= MODE_APP_KEYPAD;
+      s->dirty = true;
+      break;
+    case '>':
+      s->modes &= ~MODE_APP_KEYPAD;
+      s->dirty = true;
+      break;
+    default:
+      break;
+  }
+}
+
+static void execute(screen_t *s, unsigned char c) {
+  switch (c) {
+    case '\a':
+      s->bells++;
+      s->dirty = true;
+      break;
+    case '\b':
+      if (s->cur.x > 0) s->cur.x--;
+      s->wrap_pending = false;
+      break;
+    case '\t':
+      move_rel(s, 8 - s->cur.x % 8, 0);
+      break;
+    case '\n':
+    case '\v':
+    case '\f':
+      linefeed(s);
+      break;
+    case '\r':
+      s->cur.x = 0;
+      s->wrap_pending = false;
+      break;
+    case 0x0e:
+      s->cur.charset = 1;
+      break;
+    case 0x0f:
+      s->cur.charset = 0;
+      break;
+    default:
+      break;
+  }
+}
+
+static void feed_byte(screen_t *s, unsigned char c) {
+  if (c == 0x18 || c == 0x1a) {  // CAN, SUB
+    s->state = GROUND;
+    return;
+  }
+  if (c == 0x1b && s->state != OSC && s->state != STRING) {
+    s->state = ESCAPE;
+    s->inter = 0;
+    return;
+  }
+
+  switch (s->state) {
+    case GROUND:
+      if (s->utf8_need > 0) {
+        if ((c & 0xc0) == 0x80) {
+          s->utf8 = (s->utf8 << 6) | (c & 0x3f);
+          if (--s->utf8_need == 0) put_char(s, s->utf8);
+          return;
+        }
+        s->utf8_need = 0;
+        put_char(s, 0xfffd);
+      }
+      if (c < 0x20 || c == 0x7f) {
+        execute(s, c);
+      } else if (c < 0x80) {
+        put_char(s, c);
+      } else if ((c & 0xe0) == 0xc0) {
+        s->utf8 = c & 0x1f;
+        s->utf8_need = 1;
+      } else if ((c & 0xf0) == 0xe0) {
+        s->utf8 = c & 0x0f;
+        s->utf8_need = 2;
+      } else if ((c & 0xf8) == 0xf0) {
+        s->utf8 = c & 0x07;
+        s->utf8_need = 3;
+      } else {
+        put_char(s, 0xfffd);
+      }
+      break;
+    case ESCAPE:
+      if (c < 0x20) {
+        execute(s, c);
+      } else if (c == '[') {
+        s->state = CSI;
+        s->nparams = 0;
+        s->params[0] = 0;
+        s->prefix = 0;
+        s->inter = 0;
+      } else if (c == ']') {
+        s->state = OSC;
+        s->osc_len = 0;
+      } else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+        s->state = STRING;
+      } else if (c >= 0x20 && c <= 0x2f) {
+        s->inter = (char)c;
+        s->state = CHARSET;
+      } else {
+        esc_dispatch(s, (char)c);
+        s->state = GROUND;
+      }
+      break;
+    case CHARSET:
+      if (s->inter == '(' || s->inter == ')') s->cur.graphics[s->inter == ')'] = c == '0';
+      s->state = GROUND;
+      break;
+    case CSI:
+      if (c >= '0' && c <= '9') {
+        if (s->nparams == 0) s->nparams = 1;
+        int *p = &s->params[s->nparams - 1];
+        if (*p < 65535) *p = *p * 10 + (c - '0');
+      } else if (c == ';' || c == ':') {
+        if (s->nparams == 0) s->nparams = 1;
+        if (s->nparams < (int)(sizeof(s->params) / sizeof(s->params[0]))) s->params[s->nparams++] = 0;
+      } else if (c >= '<' && c <= '?') {
+        s->prefix = (char)c;
+      } else if (c >= 0x20 && c <= 0x2f) {
+        s->inter = (char)c;
+      } else if (c >= 0x40 && c <= 0x7e) {
+        csi_dispatch(s, (char)c);
+        s->state = GROUND;
+      } else if (c < 0x20) {
+        execute(s, c);
+      }
+      break;
+    case OSC:
+      if (c == '\a') {
+        osc_dispatch(s);
+        s->state = GROUND;
+      } else if (c == 0x1b) {
+        s->state = OSC_ESC;
+      } else if (s->osc_len < sizeof(s->osc) - 1) {
+        s->osc[s->osc_len++] = (char)c;
+      }
+      break;
+    case OSC_ESC:
+      osc_dispatch(s);
+      s->state = GROUND;
+      if (c != '\\') feed_byte(s, c);
+      break;
+    case STRING:
+      if (c == 0x1b) s->state = STRING_ESC;
+      break;
+    case STRING_ESC:
+      s->state = c == '\\' ? GROUND : STRING;
+      break;
+    default:
+      s->state = GROUND;
+      break;
+  }
+}
+
+screen_t *screen_init(uint16_t cols, uint16_t rows) {
+  screen_t *s = xmalloc(sizeof(screen_t));
+  memset(s, 0, sizeof(screen_t));
+  s->cols = cols > 0 ? cols : 80;
+  s->rows = rows > 0 ? rows : 24;
+  size_t n = (size_t)s->cols * s->rows;
+  s->primary = xmalloc(n * sizeof(screen_cell));
+  s->alternate = xmalloc(n * sizeof(screen_cell));
+  s->shown = xmalloc(n * sizeof(screen_cell));
+  reset(s);
+  s->shown_modes = MODE_CURSOR_VISIBLE;
+  s->full_redraw = true;
+  return s;
+}
+
+void screen_free(screen_t *s) {
+  if (s == NULL) return;
+  free(s->primary);
+  free(s->alternate);
+  free(s->shown);
+  free(s->out);
+  free(s);
+}
+
+static void copy_buffer(screen_cell *dst, uint16_t cols, uint16_t rows, const screen_cell *src, uint16_t src_cols,
+                        uint16_t src_rows, int skip) {
+  screen_cell blank = {' ', 0, 0, 0, 1, 0};
+  fill(dst, (size_t)cols * rows, blank);
+  for (int y = 0; y < rows && y + skip < src_rows; y++) {
+    int n = cols < src_cols ? cols : src_cols;
+    memcpy(dst + (size_t)y * cols, src + (size_t)(y + skip) * src_cols, (size_t)n * sizeof(screen_cell));
+    if (dst[(size_t)y * cols + n - 1].width == 2) dst[(size_t)y * cols + n - 1] = blank;
+  }
+}
+
+void screen_resize(screen_t *s, uint16_t cols, uint16_t rows) {
+  if (cols == 0 || rows == 0 || (cols == s->cols && rows == s->rows)) return;
+
+  // keep the cursor line visible when shrinking
+  int skip = s->cur.y >= rows ? s->cur.y - rows + 1 : 0;
+  bool alternate = s->cells == s->alternate;
+  size_t n = (size_t)cols * rows;
+  screen_cell *primary = xmalloc(n * sizeof(screen_cell));
+  screen_cell *alt = xmalloc(n * sizeof(screen_cell));
+  copy_buffer(primary, cols, rows, s->primary, s->cols, s->rows, alternate ? 0 : skip);
+  copy_buffer(alt, cols, rows, s->alternate, s->cols, s->rows, alternate ? skip : 0);
+  free(s->primary);
+  free(s->alternate);
+  free(s->shown);
+  s->primary = primary;
+  s->alternate = alt;
+  s->shown = xmalloc(n * sizeof(screen_cell));
+  s->cells = alternate ? alt : primary;
+
+  s->cols = cols;
+  s->rows = rows;
+  s->cur.y -= skip;
+  if (s->cur.x >= cols) s->cur.x = cols - 1;
+  for (int i = 0; i < 2; i++) {
+    if (s->saved[i].x >= cols) s->saved[i].x = cols - 1;
+    if (s->saved[i].y >= rows) s->saved[i].y = rows - 1;
+  }
+  s->top = 0;
+  s->bottom = rows - 1;
+  s->wrap_pending = false;
+  screen_invalidate(s);
+}
+
+void screen_feed(screen_t *s, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) feed_byte(s, (unsigned char)data[i]);
+}
+
+void screen_invalidate(screen_t *s) {
+  s->full_redraw = true;
+  s->dirty = true;
+}
+
+void screen_compact(screen_t *s) {
+  free(s->out);
+  s->out = NULL;
+  s->out_len = 0;
+  s->out_cap = 0;
+  free(s->shown);
+  s->shown = NULL;
+  s->full_redraw = true;
+}
+
+static void out_reserve(screen_t *s, size_t n) {
+  if (s->out_len + n <= s->out_cap) return;
+  while (s->out_len + n > s->out_cap) s->out_cap = s->out_cap > 0 ? s->out_cap * 2 : 4096;
+  s->out = xrealloc(s->out, s->out_cap);
+}
+
+static void out_printf(screen_t *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void out_printf(screen_t *s, const char *fmt, ...) {
+  va_list args;
+  out_reserve(s, 64);
+  va_start(args, fmt);
+  int n = vsnprintf(s->out + s->out_len, s->out_cap - s->out_len, fmt, args);
+  va_end(args);
+  if (n >= (int)(s->out_cap - s->out_len)) {
+    out_reserve(s, (size_t)n + 1);
+    va_start(args, fmt);
+    n = vsnprintf(s->out + s->out_len, s->out_cap - s->out_len, fmt, args);
+    va_end(args);
+  }
+  if (n > 0) s->out_len += n;
+}
+
+static void out_utf8(screen_t *s, uint32_t c) {
+  out_reserve(s, 4);
+  char *p = s->out + s->out_len;
+  if (c < 0x80) {
+    p[0] = (char)c;
+    s->out_len += 1;
+  } else if (c < 0x800) {
+    p[0] = (char)(0xc0 | (c >> 6));
+    p[1] = (char)(0x80 | (c & 0x3f));
+    s->out_len += 2;
+  } else if (c < 0x10000) {
+    p[0] = (char)(0xe0 | (c >> 12));
+    p[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+    p[2] = (char)(0x80 | (c & 0x3f));
+    s->out_len += 3;
+  } else {
+    p[0] = (char)(0xf0 | (c >> 18));
+    p[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    p[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    p[3] = (char)(0x80 | (c & 0x3f));
+    s->out_len += 4;
+  }
+}
+
+static void out_color(screen_t *s, uint32_t color, int base) {
+  if (color == 0) return;
+  if (color & COLOR_RGB) {
+    out_printf(s, ";%d;2;%u;%u;%u", base + 8, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+  } else if (color <= 8) {
+    out_printf(s, ";%u", base + color - 1);
+  } else if (color <= 16) {
+    out_printf(s, ";%u", base + 60 + color - 9);
+  } else {
+    out_printf(s, ";%d;5;%u", base + 8, color - 1);
+  }
+}
+
+static void out_pen(screen_t *s, const screen_cell *cell) {
+  static const char codes[] = {1, 2, 3, 4, 5, 7, 8, 9};
+  out_printf(s, "\x1b[0");
+  for (int i = 0; i < 8; i++) {
+    if (cell->attr & (1 << i)) out_printf(s, ";%d", codes[i]);
+  }
+  out_color(s, cell->fg, 30);
+  out_color(s, cell->bg, 40);
+  out_printf(s, "m");
+}
+
+static bool same_pen(const screen_cell *a, const screen_cell *b) {
+  return a->fg == b->fg && a->bg == b->bg && a->attr == b->attr;
+}
+
+static int row_end(const screen_cell *row, int cols) {
+  while (cols > 0 && cell_is_blank(&row[cols - 1])) cols--;
+  return cols;
+}
+
+static bool same_cell(const screen_cell *a, const screen_cell *b) { return memcmp(a, b, sizeof(screen_cell)) == 0; }
+
+// whether rewriting a few unchanged cells is cheaper than moving the cursor over them
+static bool changed_near(const screen_cell *row, const screen_cell *shown, int x, int end) {
+  for (int i = x; i < end && i < x + 4; i++) {
+    if (!same_cell(&row[i], &shown[i])) return true;
+  }
+  return false;
+}
+
+size_t screen_render(screen_t *s, char **out) {
+  screen_cell blank = {' ', 0, 0, 0, 1, 0};
+  screen_cell pen = blank;
+  int cols = s->cols, rows = s->rows;
+  int cx = -1, cy = -1;
+
+  s->out_len = 0;
+  if (s->shown == NULL) s->shown = xmalloc((size_t)cols * rows * sizeof(screen_cell));
+  if (s->full_redraw) {
+    out_printf(s, "\x1b[?7l\x1b[0m\x1b[H\x1b[2J");
+    fill(s->shown, (size_t)cols * rows, blank);
+    s->full_redraw = false;
+  } else if (s->scrolled > 0) {
+    int n = s->scrolled < rows ? s->scrolled : rows;
+    out_printf(s, "\x1b[0m\x1b[%d;1H", rows);
+    out_reserve(s, (size_t)n);
+    memset(s->out + s->out_len, '\n', (size_t)n);
+    s->out_len += n;
+    memmove(s->shown, s->shown + (size_t)n * cols, (size_t)(rows - n) * cols * sizeof(screen_cell));
+    fill(s->shown + (size_t)(rows - n) * cols, (size_t)n * cols, blank);
+  }
+  s->scrolled = 0;
+
+  for (int y = 0; y < rows; y++) {
+    screen_cell *row = s->cells + (size_t)y * cols;
+    screen_cell *shown = s->shown + (size_t)y * cols;
+    if (memcmp(row, shown, (size_t)cols * sizeof(screen_cell)) == 0) continue;
+
+    int end = row_end(row, cols);
+    int x = 0;
+    while (x < cols) {
+      if (same_cell(&row[x], &shown[x]) && (x != cx || y != cy || !changed_near(row, shown, x, end))) {
+        x++;
+        continue;
+      }
+      if (row[x].width == 0 && x > 0) x--;
+      if (x != cx || y != cy) {
+        out_printf(s, "\x1b[%d;%dH", y + 1, x + 1);
+        cx = x;
+        cy = y;
+      }
+      if (x >= end) {
+        // rest of the row is blank, erase instead of writing spaces
+        if (!same_pen(&pen, &blank)) {
+          out_printf(s, "\x1b[0m");
+          pen = blank;
+        }
+        out_printf(s, "\x1b[K");
+        memcpy(shown + x, row + x, (size_t)(cols - x) * sizeof(screen_cell));
+        break;
+      }
+      if (!same_pen(&pen, &row[x])) {
+        out_pen(s, &row[x]);
+        pen = row[x];
+      }
+      out_utf8(s, row[x].ch);
+      int width = row[x].width == 2 && x + 1 < cols ? 2 : 1;
+      memcpy(shown + x, row + x, (size_t)width * sizeof(screen_cell));
+      x += width;
+      cx = x < cols ? x : -1;
+    }
+  }
+
+  if (!same_pen(&pen, &blank)) out_printf(s, "\x1b[0m");
+  if (s->title_changed) {
+    out_printf(s, "\x1b]0;%s\a", s->title);
+    s->title_changed = false;
+  }
+  for (int i = 0; dec_modes[i].mode != 0; i++) {
+    uint32_t bit = dec_modes[i].bit;
+    if ((s->modes & bit) != (s->shown_modes & bit)) out_printf(s, "\x1b[?%d%c", dec_modes[i].mode, s->modes & bit ? 'h' : 'l');
+  }
+  if ((s->modes & MODE_APP_KEYPAD) != (s->shown_modes & MODE_APP_KEYPAD))
+    out_printf(s, "\x1b%c", s->modes & MODE_APP_KEYPAD ? '=' : '>');
+  s->shown_modes = s->modes;
+  for (; s->bells > 0; s->bells--) out_printf(s, "\a");
+  if (s->cur.x != cx || s->cur.y != cy) out_printf(s, "\x1b[%d;%dH", s->cur.y + 1, s->cur.x + 1);
+
+  s->dirty = false;
+  *out = s->out;
+  return s->out_len;
+}
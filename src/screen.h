@@ -0,0 +1,89 @@
+#ifndef TTYD_SCREEN_H
+#define TTYD_SCREEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// cell attributes
+#define ATTR_BOLD 0x01
+#define ATTR_DIM 0x02
+#define ATTR_ITALIC 0x04
+#define ATTR_UNDERLINE 0x08
+#define ATTR_BLINK 0x10
+#define ATTR_INVERSE 0x20
+#define ATTR_HIDDEN 0x40
+#define ATTR_STRIKE 0x80
+
+// colors: 0 is the default color, 1-256 a palette index + 1, COLOR_RGB | 0xrrggbb a true color
+#define COLOR_RGB 0x1000000
+
+typedef struct {
+  uint32_t ch;
+  uint32_t fg;
+  uint32_t bg;
+  uint16_t attr;
+  uint8_t width;  // 2 for wide chars, 0 for the cell covered by a wide char
+  uint8_t reserved;
+} screen_cell;
+
+typedef struct {
+  int x, y;
+  screen_cell pen;
+  bool origin;
+  bool graphics[2];
+  int charset;
+} screen_cursor;
+
+typedef struct {
+  uint16_t cols, rows;
+  screen_cell *cells;  // active buffer, primary or alternate
+  screen_cell *primary;
+  screen_cell *alternate;
+  screen_cell *shown;  // what the client has, as of the last render
+
+  screen_cursor cur;
+  screen_cursor saved[2];  // saved cursor of primary and alternate buffer
+  bool wrap_pending;
+  int top, bottom;  // scroll region
+  bool autowrap;
+  bool insert;
+  uint32_t modes;        // DEC private modes that change client behavior
+  uint32_t shown_modes;  // modes the client has
+  uint32_t last_char;
+  int scrolled;  // full screen scrolls of the primary buffer since last render
+  int bells;
+
+  // parser
+  int state;
+  int params[16];
+  int nparams;
+  char prefix;
+  char inter;
+  uint32_t utf8;
+  int utf8_need;
+  char osc[256];
+  size_t osc_len;
+  char title[256];
+  bool title_changed;
+
+  char reply[64];  // reply to terminal queries, to be written back to the pty
+  size_t reply_len;
+
+  bool dirty;
+  bool full_redraw;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+} screen_t;
+
+screen_t *screen_init(uint16_t cols, uint16_t rows);
+void screen_free(screen_t *s);
+void screen_resize(screen_t *s, uint16_t cols, uint16_t rows);
+void screen_feed(screen_t *s, const char *data, size_t len);
+void screen_invalidate(screen_t *s);
+// release the buffers that the next render rebuilds, for an idle session
+void screen_compact(screen_t *s);
+size_t screen_render(screen_t *s, char **out);
+
+#endif  // TTYD_SCREEN_H
@@ -12,6 +12,9 @@
 #include <sys/stat.h>
 
 #include "utils.h"
+#ifdef TTYD_FAKE_PTY
+#include "fakepty.h"
+#endif
 
 #ifndef TTYD_VERSION
 #define TTYD_VERSION "unknown"
@@ -20,14 +23,26 @@
 volatile bool force_exit = false;
 struct lws_context *context;
 struct server *server;
-struct endpoints endpoints = {"/ws", "/", "/token", ""};
+struct endpoints endpoints = {"/ws", "/", "/token", "", "/playback", "/metrics"};
 
 extern int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 extern int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern int callback_tty_mux(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern void session_shed(int stage);
+extern void output_compressed(void *ctx);
+#ifndef _WIN32
+extern int session_export(upgrade_session **sessions);
+extern void session_handed_off();
+extern void session_adopt(upgrade_session *session);
+
+// the command line, to exec the new binary on upgrade
+static char **exec_argv = NULL;
+#endif
 
 // websocket protocols
 static const struct lws_protocols protocols[] = {{"http-only", callback_http, sizeof(struct pss_http), 0},
                                                  {"tty", callback_tty, sizeof(struct pss_tty), 0},
+                                                 {"tty-mux", callback_tty_mux, sizeof(struct pss_mux), 0},
                                                  {NULL, NULL, 0, 0}};
 
 #ifndef LWS_WITHOUT_EXTENSIONS
@@ -62,6 +77,18 @@ static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"cwd", required_argument, NULL, 'w'},
                                         {"index", required_argument, NULL, 'I'},
                                         {"base-path", required_argument, NULL, 'b'},
+                                        {"playback-dir", required_argument, NULL, 'R'},
+                                        {"screen-diff", required_argument, NULL, 'D'},
+                                        {"metrics", no_argument, NULL, 'M'},
+                                        {"compress", required_argument, NULL, 'z'},
+                                        {"compress-threads", required_argument, NULL, 'y'},
+                                        {"stall-threshold", required_argument, NULL, 'L'},
+#ifdef TTYD_FAKE_PTY
+                                        {"fake-pty", required_argument, NULL, 'F'},
+#endif
+#ifdef TTYD_ALLOC_STATS
+                                        {"alloc-stats", required_argument, NULL, 'X'},
+#endif
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
                                         {"ping-interval", required_argument, NULL, 'P'},
 #endif
@@ -77,6 +104,19 @@ static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"client-option", required_argument, NULL, 't'},
                                         {"check-origin", no_argument, NULL, 'O'},
                                         {"max-clients", required_argument, NULL, 'm'},
+                                        {"max-queue", required_argument, NULL, 'Q'},
+                                        {"queue-timeout", required_argument, NULL, 'E'},
+                                        {"max-viewers", required_argument, NULL, 'r'},
+                                        {"idle-timeout", required_argument, NULL, 'N'},
+                                        {"idle-stop", no_argument, NULL, 'Y'},
+                                        {"history", required_argument, NULL, 'e'},
+#ifndef _WIN32
+                                        {"session-socket", required_argument, NULL, 'k'},
+                                        {"session-daemon", no_argument, NULL, 'Z'},
+                                        {"history-budget", required_argument, NULL, 'j'},
+                                        {"history-spill", required_argument, NULL, 'J'},
+                                        {"memory-pressure", required_argument, NULL, 'G'},
+#endif
                                         {"once", no_argument, NULL, 'o'},
                                         {"exit-no-conn", no_argument, NULL, 'q'},
                                         {"browser", no_argument, NULL, 'B'},
@@ -84,7 +124,17 @@ static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"version", no_argument, NULL, 'v'},
                                         {"help", no_argument, NULL, 'h'},
                                         {NULL, 0, 0, 0}};
-static const char *opt_string = "p:i:U:c:H:u:g:s:w:I:b:P:f:6aSC:K:A:Wt:T:Om:oqBd:vh";
+static const char *opt_string = "p:i:U:c:H:u:g:s:w:I:b:R:D:Mz:y:L:P:f:6aSC:K:A:Wt:T:Om:Q:E:r:N:Ye:oqBd:vh"
+#ifdef TTYD_FAKE_PTY
+                                 "F:"
+#endif
+#ifdef TTYD_ALLOC_STATS
+                                 "X:"
+#endif
+#ifndef _WIN32
+                                 "k:Zj:J:G:"
+#endif
+    ;
 
 static void print_help() {
   // clang-format off
@@ -109,11 +159,36 @@ static void print_help() {
           "    -T, --terminal-type     Terminal type to report, default: xterm-256color\n"
           "    -O, --check-origin      Do not allow websocket connection from different origin\n"
           "    -m, --max-clients       Maximum clients to support (default: 0, no limit)\n"
+          "    -Q, --max-queue         Maximum clients waiting for a free slot at --max-clients (default: 0, refuse them)\n"
+          "    -E, --queue-timeout     Seconds a client may wait in the queue (default: 0, no limit)\n"
+          "    -r, --max-viewers       Read-only viewers a session accepts, joining with ?view=<session id> (default: 0, disabled)\n"
+          "    -N, --idle-timeout      Minutes without input or output before a session releases its buffers (default: 0, disabled)\n"
+          "    -Y, --idle-stop         Also stop the processes of idle sessions with a hidden client (SIGSTOP), until it is visible\n"
+          "    -e, --history           KiB of output a detached session keeps, compressed, and replays to its client (default: 0, disabled)\n"
+#ifndef _WIN32
+          "    -k, --session-socket    Run the processes in the session daemon listening on this UNIX domain socket, so they outlive ttyd\n"
+          "    -Z, --session-daemon    Be the session daemon on the --session-socket path, instead of a web server\n"
+          "    -j, --history-budget    KiB of memory for the history of all sessions, beyond it the least recently active spill to disk (default: 0, no limit)\n"
+          "    -J, --history-spill     Directory of the spilled history (default: $TMPDIR or /tmp)\n"
+          "    -G, --memory-pressure   Shed load from this percentage of the cgroup (v2) memory limit, or on memory stalls (default: 0, disabled)\n"
+#endif
           "    -o, --once              Accept only one client and exit on disconnection\n"
           "    -q, --exit-no-conn      Exit on all clients disconnection\n"
           "    -B, --browser           Open terminal with the default system browser\n"
           "    -I, --index             Custom index.html path\n"
           "    -b, --base-path         Expected base path for requests coming from a reverse proxy (eg: /mounted/here, max length: 128)\n"
+          "    -R, --playback-dir      Directory of ttyrec recordings to play back at /playback/<name> (no command is spawned)\n"
+          "    -D, --screen-diff       Send screen diffs at most this many times per second instead of raw output (eg: 10, default: 0, disabled)\n"
+          "    -M, --metrics           Serve Prometheus metrics at /metrics\n"
+          "    -z, --compress          Peers whose output is compressed: loopback, private, public, all or none, comma separated (default: private,public)\n"
+          "    -y, --compress-threads  Compress the output in a pool of this many threads instead of the event loop (default: 0, on the loop)\n"
+          "    -L, --stall-threshold   Log the callback blocking the event loop for longer than this (ms) (default: 0, disabled)\n"
+#ifdef TTYD_FAKE_PTY
+          "    -F, --fake-pty          Replay a byte stream instead of running a command, for benchmarks (eg: file=out.raw,chunk=4096,rate=1000000)\n"
+#endif
+#ifdef TTYD_ALLOC_STATS
+          "    -X, --alloc-stats       Count allocations per call site, the steady state starts after the warmup output bytes (eg: warmup=1048576,abort)\n"
+#endif
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
           "    -P, --ping-interval     Websocket ping interval(sec) (default: 5)\n"
 #endif
@@ -139,7 +214,7 @@ static void print_help() {
 static void print_config() {
   lwsl_notice("tty configuration:\n");
   if (server->credential != NULL) lwsl_notice("  credential: %s\n", server->credential);
-  lwsl_notice("  start command: %s\n", server->command);
+  if (server->command != NULL) lwsl_notice("  start command: %s\n", server->command);
   lwsl_notice("  close signal: %s (%d)\n", server->sig_name, server->sig_code);
   lwsl_notice("  terminal type: %s\n", server->terminal_type);
   if (endpoints.parent[0]) {
@@ -148,15 +223,35 @@ static void print_config() {
     lwsl_notice("  index    : %s\n", endpoints.index);
     lwsl_notice("  token    : %s\n", endpoints.token);
     lwsl_notice("  websocket: %s\n", endpoints.ws);
+    if (server->playback_dir != NULL) lwsl_notice("  playback : %s\n", endpoints.playback);
+    if (server->metrics) lwsl_notice("  metrics  : %s\n", endpoints.metrics);
   }
   if (server->auth_header != NULL) lwsl_notice("  auth header: %s\n", server->auth_header);
   if (server->check_origin) lwsl_notice("  check origin: true\n");
   if (server->url_arg) lwsl_notice("  allow url arg: true\n");
   if (server->max_clients > 0) lwsl_notice("  max clients: %d\n", server->max_clients);
+  if (server->max_clients > 0 && server->max_queue > 0) lwsl_notice("  max queue: %d\n", server->max_queue);
+  if (server->max_viewers > 0) lwsl_notice("  max viewers: %d\n", server->max_viewers);
+  if (server->idle_timeout > 0)
+    lwsl_notice("  idle timeout: %d minutes%s\n", server->idle_timeout, server->idle_stop ? ", stop hidden" : "");
   if (server->once) lwsl_notice("  once: true\n");
   if (server->exit_no_conn) lwsl_notice("  exit_no_conn: true\n");
   if (server->index != NULL) lwsl_notice("  custom index.html: %s\n", server->index);
   if (server->cwd != NULL) lwsl_notice("  working directory: %s\n", server->cwd);
+  if (server->session_socket != NULL) lwsl_notice("  session daemon: %s\n", server->session_socket);
+  if (server->history_size > 0) lwsl_notice("  history: %zu KiB\n", server->history_size / 1024);
+  if (server->history_budget > 0)
+    lwsl_notice("  history budget: %zu KiB, spilled to %s\n", server->history_budget / 1024, server->history_spill);
+  if (server->memory_pressure > 0) lwsl_notice("  memory pressure: from %d%% of the cgroup limit\n", server->memory_pressure);
+  if (server->playback_dir != NULL) lwsl_notice("  playback directory: %s\n", server->playback_dir);
+  if (server->diff_fps > 0) lwsl_notice("  screen diff: %d fps\n", server->diff_fps);
+  if (server->compress_peers != (COMPRESS_PRIVATE | COMPRESS_PUBLIC)) {
+    lwsl_notice("  compress: loopback: %s, private: %s, public: %s\n",
+                server->compress_peers & COMPRESS_LOOPBACK ? "yes" : "no",
+                server->compress_peers & COMPRESS_PRIVATE ? "yes" : "no",
+                server->compress_peers & COMPRESS_PUBLIC ? "yes" : "no");
+  }
+  if (server->compress_threads > 0) lwsl_notice("  compress threads: %d\n", server->compress_threads);
   if (!server->writable) lwsl_warn("The --writable option is not set, will start in readonly mode\n");
 }
 
@@ -169,8 +264,14 @@ static struct server *server_new(int argc, char **argv, int start) {
   memset(ts, 0, sizeof(struct server));
   ts->client_count = 0;
   ts->sig_code = SIGHUP;
+  ts->serv_buf_size = 4096;
+  ts->compress_peers = COMPRESS_PRIVATE | COMPRESS_PUBLIC;
   sprintf(ts->terminal_type, "%s", "xterm-256color");
   get_sig_name(ts->sig_code, ts->sig_name, sizeof(ts->sig_name));
+
+  ts->loop = xmalloc(sizeof *ts->loop);
+  uv_loop_init(ts->loop);
+
   if (start == argc) return ts;
 
   int cmd_argc = argc - start;
@@ -197,9 +298,6 @@ static struct server *server_new(int argc, char **argv, int start) {
   }
   *ptr = '\0';  // null terminator
 
-  ts->loop = xmalloc(sizeof *ts->loop);
-  uv_loop_init(ts->loop);
-
   return ts;
 }
 
@@ -209,12 +307,17 @@ static void server_free(struct server *ts) {
   if (ts->auth_header != NULL) free(ts->auth_header);
   if (ts->index != NULL) free(ts->index);
   if (ts->cwd != NULL) free(ts->cwd);
+  if (ts->session_socket != NULL) free(ts->session_socket);
+  if (ts->history_spill != NULL) free(ts->history_spill);
+  if (ts->playback_dir != NULL) free(ts->playback_dir);
   free(ts->command);
   free(ts->prefs_json);
 
-  char **p = ts->argv;
-  for (; *p; p++) free(*p);
-  free(ts->argv);
+  if (ts->argv != NULL) {
+    char **p = ts->argv;
+    for (; *p; p++) free(*p);
+    free(ts->argv);
+  }
 
   if (strlen(ts->socket_path) > 0) {
     struct stat st;
@@ -252,6 +355,28 @@ static void signal_cb(uv_signal_t *watcher, int signum) {
   lwsl_notice("send ^C to force exit.\n");
 }
 
+#ifndef _WIN32
+// hand the listener and the sessions to a new ttyd, then exit, the clients reconnect to it
+static void upgrade_cb(uv_signal_t *watcher, int signum) {
+  lwsl_notice("received signal: SIGUSR2 (%d), upgrading...\n", signum);
+
+  upgrade_session *sessions;
+  int count = session_export(&sessions);
+  bool ok = upgrade_exec(exec_argv, sessions, count);
+  free(sessions);
+  if (!ok) {
+    lwsl_err("upgrade failed, keep running\n");
+    return;
+  }
+
+  session_handed_off();
+  server->socket_path[0] = '\0';  // the new process owns it now
+  force_exit = true;
+  lws_cancel_service(context);
+  uv_stop(server->loop);
+}
+#endif
+
 static int parse_int(char *name, char *str) {
   char *endptr;
   errno = 0;
@@ -312,6 +437,12 @@ int main(int argc, char **argv) {
   }
 #endif
 
+#ifndef _WIN32
+  exec_argv = xmalloc((argc + 1) * sizeof(char *));
+  memcpy(exec_argv, argv, argc * sizeof(char *));
+  exec_argv[argc] = NULL;
+#endif
+
   int start = calc_command_start(argc, argv);
   server = server_new(argc, argv, start);
 
@@ -333,6 +464,8 @@ int main(int argc, char **argv) {
   char iface[128] = "";
   char socket_owner[128] = "";
   bool browser = false;
+  bool session_daemon = false;
+  int stall_threshold = 0;
   bool ssl = false;
   char cert_path[1024] = "";
   char key_path[1024] = "";
@@ -369,6 +502,29 @@ int main(int argc, char **argv) {
       case 'm':
         server->max_clients = parse_int("max-clients", optarg);
         break;
+      case 'Q':
+        server->max_queue = parse_int("max-queue", optarg);
+        break;
+      case 'E':
+        server->queue_timeout = parse_int("queue-timeout", optarg);
+        break;
+      case 'r':
+        server->max_viewers = parse_int("max-viewers", optarg);
+        break;
+      case 'N':
+        server->idle_timeout = parse_int("idle-timeout", optarg);
+        break;
+      case 'Y':
+        server->idle_stop = true;
+        break;
+      case 'e': {
+        int size = parse_int("history", optarg);
+        if (size < 0) {
+          fprintf(stderr, "ttyd: invalid history size: %s\n", optarg);
+          return -1;
+        }
+        server->history_size = (size_t)size * 1024;
+      } break;
       case 'o':
         server->once = true;
         break;
@@ -424,6 +580,30 @@ int main(int argc, char **argv) {
       case 'w':
         server->cwd = strdup(optarg);
         break;
+      case 'k':
+        server->session_socket = strdup(optarg);
+        break;
+      case 'Z':
+        session_daemon = true;
+        break;
+      case 'j': {
+        int size = parse_int("history-budget", optarg);
+        if (size < 0) {
+          fprintf(stderr, "ttyd: invalid history budget: %s\n", optarg);
+          return -1;
+        }
+        server->history_budget = (size_t)size * 1024;
+      } break;
+      case 'J':
+        server->history_spill = strdup(optarg);
+        break;
+      case 'G':
+        server->memory_pressure = parse_int("memory-pressure", optarg);
+        if (server->memory_pressure < 0 || server->memory_pressure > 99) {
+          fprintf(stderr, "ttyd: invalid memory pressure percentage: %s\n", optarg);
+          return -1;
+        }
+        break;
       case 'I':
         if (!strncmp(optarg, "~/", 2)) {
           const char *home = getenv("HOME");
@@ -442,6 +622,55 @@ int main(int argc, char **argv) {
           return -1;
         }
         break;
+      case 'R': {
+        struct stat st;
+        if (stat(optarg, &st) == -1 || !S_ISDIR(st.st_mode)) {
+          fprintf(stderr, "Invalid playback directory: %s\n", optarg);
+          return -1;
+        }
+        server->playback_dir = strdup(optarg);
+      } break;
+      case 'D':
+        server->diff_fps = parse_int("screen-diff", optarg);
+        if (server->diff_fps < 0 || server->diff_fps > 1000) {
+          fprintf(stderr, "ttyd: invalid screen-diff frame rate: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'M':
+        server->metrics = true;
+        break;
+      case 'z':
+        server->compress_peers = compress_parse_classes(optarg);
+        if (server->compress_peers < 0) {
+          fprintf(stderr, "ttyd: invalid compress peers: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'y':
+        server->compress_threads = parse_int("compress-threads", optarg);
+        if (server->compress_threads < 0 || server->compress_threads > 128) {
+          fprintf(stderr, "ttyd: invalid compress threads: %s\n", optarg);
+          return -1;
+        }
+        break;
+#ifdef TTYD_FAKE_PTY
+      case 'F':
+        if (!fake_pty_init(optarg)) return -1;
+        break;
+#endif
+#ifdef TTYD_ALLOC_STATS
+      case 'X':
+        if (!alloc_stats_init(optarg)) return -1;
+        break;
+#endif
+      case 'L':
+        stall_threshold = parse_int("stall-threshold", optarg);
+        if (stall_threshold < 0) {
+          fprintf(stderr, "ttyd: invalid stall threshold: %s\n", optarg);
+          return -1;
+        }
+        break;
       case 'b': {
         char path[128];
         strncpy(path, optarg, 128);
@@ -451,7 +680,7 @@ int main(int argc, char **argv) {
 #define sc(f)                                  \
   strncpy(path + len, endpoints.f, 128 - len); \
   endpoints.f = strdup(path);
-        sc(ws) sc(index) sc(token) sc(parent)
+        sc(ws) sc(index) sc(token) sc(parent) sc(playback) sc(metrics)
 #undef sc
       } break;
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
@@ -472,6 +701,7 @@ int main(int argc, char **argv) {
           return -1;
         }
         info.pt_serv_buf_size = serv_buf_size;
+        if (serv_buf_size > 0) server->serv_buf_size = serv_buf_size;
       } break;
       case '6':
         info.options &= ~(LWS_SERVER_OPTION_DISABLE_IPV6);
@@ -525,13 +755,50 @@ int main(int argc, char **argv) {
   server->prefs_json = strdup(json_object_to_json_string(client_prefs));
   json_object_put(client_prefs);
 
-  if (server->command == NULL || strlen(server->command) == 0) {
+#ifdef TTYD_FAKE_PTY
+  if (fake_pty_enabled() && server->command == NULL) {
+    server->argv = xmalloc(sizeof(char *) * 2);
+    server->argv[0] = strdup("fake-pty");
+    server->argv[1] = NULL;
+    server->argc = 1;
+    server->command = strdup("fake-pty");
+  }
+#endif
+#ifndef _WIN32
+  if (server->history_budget > 0) {
+    if (server->history_spill == NULL) {
+      const char *tmp = getenv("TMPDIR");
+      server->history_spill = strdup(tmp != NULL && strlen(tmp) > 0 ? tmp : "/tmp");
+    }
+    history_spill(server->history_spill, server->history_budget);
+  }
+  if (session_daemon) {
+    if (server->session_socket == NULL) {
+      fprintf(stderr, "ttyd: --session-daemon requires --session-socket\n");
+      return -1;
+    }
+    lws_set_log_level(debug_level, NULL);
+    lwsl_notice("ttyd %s session daemon\n", TTYD_VERSION);
+    int ret = sessiond_run(server->loop, server->session_socket, server->sig_code, server->history_size);
+    server_free(server);
+    return ret;
+  }
+#endif
+  if ((server->command == NULL || strlen(server->command) == 0) && server->playback_dir == NULL) {
     fprintf(stderr, "ttyd: missing start command\n");
     return -1;
   }
 
   lws_set_log_level(debug_level, NULL);
 
+  if (server->metrics || stall_threshold > 0) watchdog_init(server->loop, stall_threshold);
+  if (server->index != NULL && !index_file_init(server->loop, server->index)) return -1;
+  if (server->memory_pressure > 0 && !pressure_init(server->loop, server->memory_pressure, session_shed)) return -1;
+  if (server->compress_threads > 0 && !compress_pool_init(server->compress_threads, output_compressed)) {
+    fprintf(stderr, "ttyd: can not set the size of the thread pool\n");
+    return -1;
+  }
+
   char server_hdr[128] = "";
   sprintf(server_hdr, "ttyd/%s (libwebsockets/%s)", TTYD_VERSION, LWS_LIBRARY_VERSION);
   info.server_string = server_hdr;
@@ -585,6 +852,18 @@ int main(int argc, char **argv) {
     lowercase(server->auth_header);
   }
 
+  bool upgrade = false;
+#ifndef _WIN32
+  upgrade_session *sessions = NULL;
+  int session_count = 0;
+  upgrade = upgrade_started();
+  if (upgrade) {
+    if (!upgrade_receive(&sessions, &session_count)) return 1;
+    // the listener is inherited from the previous process
+    info.port = CONTEXT_PORT_NO_LISTEN;
+  }
+#endif
+
   void *foreign_loops[1];
   foreign_loops[0] = server->loop;
   info.foreign_loops = foreign_loops;
@@ -602,9 +881,20 @@ int main(int argc, char **argv) {
     return 1;
   }
   int port = lws_get_vhost_listen_port(vhost);
-  lwsl_notice(" Listening on port: %d\n", port);
+  if (!upgrade) lwsl_notice(" Listening on port: %d\n", port);
+#ifndef _WIN32
+  if (upgrade) {
+    upgrade_listen(server->loop, vhost);
+    for (int i = 0; i < session_count; i++) session_adopt(&sessions[i]);
+    free(sessions);
+    upgrade_ready();
+    lwsl_notice(" Listening on the socket of the previous process, sessions taken over: %d\n", session_count);
+  } else {
+    upgrade_find_listener(server->loop);
+  }
+#endif
 
-  if (browser) {
+  if (browser && !upgrade) {
     char url[30];
     sprintf(url, "%s://localhost:%d", ssl ? "https" : "http", port);
     open_uri(url);
@@ -617,6 +907,11 @@ int main(int argc, char **argv) {
     uv_signal_init(server->loop, &signals[i]);
     uv_signal_start(&signals[i], signal_cb, sig_nums[i]);
   }
+#ifndef _WIN32
+  uv_signal_t upgrade_signal;
+  uv_signal_init(server->loop, &upgrade_signal);
+  uv_signal_start(&upgrade_signal, upgrade_cb, SIGUSR2);
+#endif
 
   lws_service(context, 0);
 
@@ -624,11 +919,24 @@ int main(int argc, char **argv) {
     uv_signal_stop(&signals[i]);
   }
 #undef sig_count
+#ifndef _WIN32
+  uv_signal_stop(&upgrade_signal);
+#endif
 
   lws_context_destroy(context);
+  watchdog_free();
+  pressure_free();
+  index_file_free();
+#ifndef _WIN32
+  upgrade_free();
+  free(exec_argv);
+#endif
 
   // cleanup
   server_free(server);
+#ifdef TTYD_ALLOC_STATS
+  alloc_stats_report();
+#endif
 
   return 0;
 }
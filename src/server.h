@@ -1,20 +1,45 @@
+#ifndef TTYD_SERVER_H
+#define TTYD_SERVER_H
+
 #include <libwebsockets.h>
 #include <stdbool.h>
 #include <uv.h>
 
+#include "compress.h"
+#include "history.h"
+#include "index.h"
+#include "metrics.h"
+#include "playback.h"
+#include "pressure.h"
 #include "pty.h"
+#include "screen.h"
+#include "sessiond.h"
+#include "upgrade.h"
+#include "watchdog.h"
 
 // client message
 #define INPUT '0'
 #define RESIZE_TERMINAL '1'
 #define PAUSE '2'
 #define RESUME '3'
+#define VISIBILITY '4'
+#define PING '5'
+#define CLOSE_CHANNEL '6'  // tty-mux only
 #define JSON_DATA '{'
 
 // server message
 #define OUTPUT '0'
 #define SET_WINDOW_TITLE '1'
 #define SET_PREFERENCES '2'
+#define PONG '3'
+#define CHANNEL_CLOSED '4'  // tty-mux only
+#define QUEUE_POSITION '5'
+#define SET_SESSION '6'
+#define OUTPUT_DEFLATED '7'  // OUTPUT as a raw deflate stream, to clients asking for it
+
+// tty-mux messages start with the channel id, 2 bytes big endian
+#define MUX_HEADER 2
+#define MUX_MAX_CHANNELS 64
 
 // url paths
 struct endpoints {
@@ -22,6 +47,8 @@ struct endpoints {
   char *index;
   char *token;
   char *parent;
+  char *playback;
+  char *metrics;
 };
 
 extern volatile bool force_exit;
@@ -34,8 +61,21 @@ struct pss_http {
   char *buffer;
   char *ptr;
   size_t len;
+  index_file_t *index;  // version of the custom index in buffer, if any
+  bool headroom;        // the LWS_PRE bytes before buffer are ours, lws_write may use them
 };
 
+// a message of output shared by the read-only viewers of a session, built once and freed by the last one to send it
+typedef struct view_frame_ {
+  struct view_frame_ *next;
+  int refs;        // viewers that did not send it yet
+  char *raw;       // LWS_PRE + MUX_HEADER bytes, then the OUTPUT message
+  size_t raw_len;
+  char *deflated;  // the OUTPUT_DEFLATED message, NULL if it did not pay off or no viewer inflates
+  size_t deflated_len;
+  size_t len;      // of the output
+} view_frame;
+
 struct pss_tty {
   bool initialized;
   int initial_cmd_index;
@@ -51,14 +91,76 @@ struct pss_tty {
   size_t len;
 
   pty_process *process;
+  playback_t *playback;
   pty_buf_t *pty_buf;
+  char *message;             // OUTPUT is built in, kept from one to the next
+  size_t message_size;
+  compress_state compress;   // OUTPUT_DEFLATED, per message
+  history_t *history;        // output of the detached session, sent before the live output
+  uv_timer_t *idle_timer;    // hibernates the session after --idle-timeout
+  uint64_t active_time;      // loop time of the last input or output (ms)
+  bool hibernated;           // idle, its buffers are released
+  bool stopped;              // idle and hidden, its processes got SIGSTOP (--idle-stop)
+  char session[SESSION_ID_LEN + 1];  // id to resume the process with after an upgrade
+  struct pss_tty *session_next;      // sessions with a process, for the upgrade handoff
+  sessiond_client *pending;          // a spawn or attach waiting for the session daemon
+  uint64_t spawn_time;               // the pending spawn was asked for (ns)
+
+  bool viewer;                   // a read-only viewer of another session (--max-viewers)
+  struct pss_tty *viewed;        // the session it views, NULL once it ended
+  struct pss_tty *viewer_next;
+  view_frame *view_cursor;       // next output to send, NULL when up to date
+  size_t view_bytes;             // output not sent yet
+  struct pss_tty *viewers;       // the read-only viewers of this session
+  int viewer_count;
+  view_frame *view_tail;         // last output shared with the viewers
+  compress_state view_compress;  // the output compressed once for the viewers
+
+  screen_t *screen;          // terminal state, in screen-diff mode
+  uv_timer_t *frame_timer;   // paces screen-diff frames
+  uint64_t frame_time;       // loop time of last frame (ms)
+  bool paused;               // client asked to pause output (PAUSE)
+  bool hidden;               // client tab is in the background, output is held back apart from PAUSE
+
+  uint64_t input_time;       // arrival of the first INPUT not echoed yet (ns)
+  char pong[32];             // client timestamp of a PING to answer
+  bool ping_pending;         // send a websocket ping to measure the round trip
+  metrics_histogram rtt;     // websocket ping round trip
+  metrics_histogram echo;    // INPUT arrival to the next OUTPUT
+  double last_rtt;           // seconds
+  double last_echo;          // seconds
+
+  struct pss_mux *mux;       // connection of a tty-mux channel, NULL for a plain session
+  uint16_t channel;          // channel id on mux
+  bool want_write;           // the channel has something to send
+  bool refused;              // the channel was not opened, only CHANNEL_CLOSED is sent
+  bool failed;               // a message of the channel failed, only CHANNEL_CLOSED is sent
+  bool channel_closed;       // CHANNEL_CLOSED was sent, the channel can be freed
+
+  bool queued;               // waiting for a free slot (--max-queue), nothing runs yet
+  struct pss_tty *queue_next;
+  uv_timer_t *queue_timer;   // ends the wait after --queue-timeout
+  bool queue_notify;         // the position changed, send it
+  bool handshake;            // JSON_DATA was received while queued
+  uint16_t columns;          // window size of the handshake, while queued
+  uint16_t rows;
 
   int lws_close_status;
 };
 
+// a tty-mux connection, carrying many sessions as channels over one websocket
+struct pss_mux {
+  struct pss_tty conn;       // the request (auth, address, path, url args) and message reassembly
+  struct pss_tty *channels[MUX_MAX_CHANNELS];
+  int channel_count;
+  int next;                  // channel to consider first for the next write, round robin
+};
+
 typedef struct {
   struct pss_tty *pss;
   bool ws_closed;
+  sessiond_client *remote;  // the process runs in the session daemon (--session-socket)
+  history_t *history;       // output kept while detached (--history)
 } pty_ctx_t;
 
 struct server {
@@ -71,12 +173,28 @@ struct server {
   char **argv;             // command with arguments
   int argc;                // command + arguments count
   char *cwd;               // working directory
+  char *session_socket;    // unix socket of the session daemon owning the processes, NULL to own them
+  char *playback_dir;      // directory of recordings to play back
+  int diff_fps;            // screen-diff frame rate, 0 to pass output through
+  bool metrics;            // whether to serve prometheus metrics
   int sig_code;            // close signal
   char sig_name[20];       // human readable signal string
   bool url_arg;            // allow client to send cli arguments in URL
   bool writable;           // whether clients to write to the TTY
   bool check_origin;       // whether allow websocket connection from different origin
   int max_clients;         // maximum clients to support
+  int max_queue;           // maximum clients waiting for a free slot
+  int max_viewers;         // read-only viewers of a session, 0 to disable viewing
+  int queue_timeout;       // seconds a client may wait in the queue, 0 for no limit
+  int idle_timeout;        // minutes without input or output before a session hibernates, 0 to disable
+  bool idle_stop;          // whether to SIGSTOP the processes of hibernated hidden clients
+  size_t history_size;     // output bytes a detached session keeps for its client, 0 to keep none
+  size_t history_budget;   // memory of all histories before the oldest blocks are spilled, 0 to never spill
+  char *history_spill;     // directory of the spill files
+  int memory_pressure;     // percent of the cgroup memory limit to start shedding load at, 0 to disable
+  int compress_peers;      // classes of peer addresses getting compression (COMPRESS_*)
+  int compress_threads;    // threads compressing the output, 0 to compress on the loop
+  int serv_buf_size;       // largest chunk of a HTTP body written at once
   bool once;               // whether accept only one client and exit on disconnection
   bool exit_no_conn;       // whether exit on all clients disconnection
   char socket_path[255];   // UNIX domain socket path
@@ -84,3 +202,5 @@ struct server {
 
   uv_loop_t *loop;         // the libuv event loop
 };
+
+#endif  // TTYD_SERVER_H
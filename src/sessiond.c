@@ -0,0 +1,852 @@
+#include "sessiond.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "utils.h"
+#ifdef TTYD_FAKE_PTY
+#include "fakepty.h"
+#endif
+
+// largest frame, a spawn with its arguments and environment, or a history block
+#define SESSIOND_MAX_PAYLOAD (2 * HISTORY_BLOCK_SIZE)
+#define SESSIOND_MAX_STRINGS 4096
+// time a front end waits for the reply to a request (ms)
+#define SESSIOND_TIMEOUT 5000
+// time a detached session waits for a front end before its process is killed (ms)
+#define SESSIOND_DETACHED_TIMEOUT 60000
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// frame types, the front end sends the upper case ones
+enum {
+  SESSIOND_SPAWN = 'S',    // spawn_request, then cwd, argv and envp, NUL terminated
+  SESSIOND_ATTACH = 'A',   // upgrade_session with id and user
+  SESSIOND_KILL = 'K',     // int32_t signal
+  SESSIOND_HISTORY = 'h',  // uint32_t raw length and a history block, before SESSIOND_SESSION
+  SESSIOND_SESSION = 's',  // upgrade_session with pid and size, the pty master attached
+  SESSIOND_ERROR = 'e',    // int32_t errno
+  SESSIOND_EXIT = 'x',     // int32_t exit code and signal, the connection is closed after it
+};
+
+typedef struct {
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t len;  // of the payload that follows
+} frame_header;
+
+typedef struct {
+  upgrade_session session;
+  uint32_t argc;
+  uint32_t envc;
+} spawn_request;
+
+// a frame waiting for the socket to take it
+typedef struct out_frame_ {
+  char *data;  // header and payload
+  size_t len;
+  size_t sent;
+  int fd;  // passed with the first byte, -1 if none
+  struct out_frame_ *next;
+} out_frame;
+
+// a non-blocking connection carrying frames both ways, driven by its poll handle
+typedef struct {
+  int fd;
+  uv_poll_t *poll;
+  frame_header header;  // of the frame being read
+  size_t got;           // bytes of it read so far
+  char *payload;        // NUL terminated, allocated once the header is complete
+  int passed_fd;        // passed with the frame being read, -1 if none
+  out_frame *out;       // sent in order
+  out_frame **out_tail;
+} frame_io;
+
+struct sessiond_client_ {
+  frame_io io;
+  uint8_t type;                    // of the request
+  uv_timer_t *timer;               // gives up on the reply, NULL once it arrived
+  sessiond_request_cb request_cb;  // NULL once the reply was handed over or the request canceled
+  void *request_ctx;
+  history_t *history;  // received before the session
+  sessiond_exit_cb cb;
+  void *ctx;
+};
+
+typedef struct daemon_session_ daemon_session;
+
+// a connection of a front end, bound to a session by its first request
+typedef struct {
+  frame_io io;
+  daemon_session *session;
+  bool closing;  // freed once the queued frames are sent
+} daemon_conn;
+
+struct daemon_session_ {
+  pty_process *process;
+  upgrade_session info;  // id, user and size
+  char *strings;         // the arguments point into it
+  daemon_conn *conn;     // NULL while detached
+  history_t *history;    // output read while detached
+  uv_timer_t *timer;     // kills the process if no front end takes it over
+  daemon_session *next;
+};
+
+static uv_loop_t *loop;
+static const char *socket_path;
+static int listener = -1;
+static uv_poll_t *accept_poll = NULL;
+static int kill_sig;
+static size_t history_size;
+static bool stopping = false;
+static daemon_session *sessions = NULL;
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static bool set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  return flags >= 0 && fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1;
+}
+
+static bool set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static void io_init(frame_io *io, uv_loop_t *l, int fd, void *data) {
+  memset(io, 0, sizeof(frame_io));
+  io->fd = fd;
+  io->passed_fd = -1;
+  io->out_tail = &io->out;
+  io->poll = xmalloc(sizeof(uv_poll_t));
+  uv_poll_init(l, io->poll, fd);
+  io->poll->data = data;
+}
+
+static void io_close(frame_io *io) {
+  uv_poll_stop(io->poll);
+  uv_close((uv_handle_t *)io->poll, close_cb);
+  close(io->fd);
+  free(io->payload);
+  if (io->passed_fd >= 0) close(io->passed_fd);
+  while (io->out != NULL) {
+    out_frame *f = io->out;
+    io->out = f->next;
+    if (f->fd >= 0) close(f->fd);
+    free(f->data);
+    free(f);
+  }
+}
+
+// wait for the next frame if readable, and for the socket to take the queued ones
+static void io_poll(frame_io *io, bool readable, uv_poll_cb cb) {
+  int events = (readable ? UV_READABLE : 0) | (io->out != NULL ? UV_WRITABLE : 0);
+  if (events == 0)
+    uv_poll_stop(io->poll);
+  else
+    uv_poll_start(io->poll, events, cb);
+}
+
+// fd is duplicated, it stays open until the frame is sent
+static void io_queue(frame_io *io, uint8_t type, const void *payload, uint32_t len, int fd) {
+  frame_header header = {type, {0, 0, 0}, len};
+  out_frame *f = xmalloc(sizeof(out_frame));
+  f->data = xmalloc(sizeof(header) + len);
+  memcpy(f->data, &header, sizeof(header));
+  if (len > 0) memcpy(f->data + sizeof(header), payload, len);
+  f->len = sizeof(header) + len;
+  f->sent = 0;
+  f->fd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+  f->next = NULL;
+  *io->out_tail = f;
+  io->out_tail = &f->next;
+}
+
+// send what the socket takes now, false with errno set on error
+static bool io_flush(frame_io *io) {
+  while (io->out != NULL) {
+    out_frame *f = io->out;
+    struct iovec iov = {f->data + f->sent, f->len - f->sent};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (f->sent == 0 && f->fd >= 0) {
+      memset(control, 0, sizeof(control));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &f->fd, sizeof(int));
+    }
+
+    ssize_t n = sendmsg(io->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    // the peer has its own copy of the fd once the first byte went
+    if (f->fd >= 0) close(f->fd);
+    f->fd = -1;
+    f->sent += (size_t)n;
+    if (f->sent < f->len) continue;
+    io->out = f->next;
+    if (io->out == NULL) io->out_tail = &io->out;
+    free(f->data);
+    free(f);
+  }
+  return true;
+}
+
+// read what has arrived: 1 with the next frame, its payload NUL terminated and fd -1 if none was passed, 0 if it is
+// not complete yet, -1 with errno set on error or EOF
+static int io_read(frame_io *io, frame_header *header, char **payload, int *fd) {
+  for (;;) {
+    if (io->got == sizeof(frame_header) && io->payload == NULL) {
+      if (io->header.len > SESSIOND_MAX_PAYLOAD) {
+        errno = EPROTO;
+        return -1;
+      }
+      io->payload = xmalloc(io->header.len + 1);
+      io->payload[io->header.len] = '\0';
+    }
+    char *p;
+    size_t want;
+    if (io->got < sizeof(frame_header)) {
+      p = (char *)&io->header + io->got;
+      want = sizeof(frame_header) - io->got;
+    } else {
+      p = io->payload + (io->got - sizeof(frame_header));
+      want = io->header.len - (io->got - sizeof(frame_header));
+    }
+    if (want == 0) break;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {p, want};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(io->fd, &msg, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (n == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      if (io->passed_fd >= 0) close(io->passed_fd);
+      memcpy(&io->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+      set_cloexec(io->passed_fd);
+    }
+    io->got += (size_t)n;
+  }
+
+  *header = io->header;
+  *payload = io->payload;
+  *fd = io->passed_fd;
+  io->got = 0;
+  io->payload = NULL;
+  io->passed_fd = -1;
+  return 1;
+}
+
+// the next NUL terminated string of a request, NULL if there is none left
+static char *next_string(char **p, char *end) {
+  if (*p >= end) return NULL;
+  char *s = *p;
+  *p += strlen(s) + 1;
+  return s;
+}
+
+static void detached_timer_cb(uv_timer_t *timer) {
+  daemon_session *session = (daemon_session *)timer->data;
+  lwsl_notice("no front end took session %.8s over, killing process, pid: %d\n", session->info.id,
+              session->process->pid);
+  pty_kill(session->process, kill_sig);
+}
+
+static void conn_free(daemon_conn *conn) {
+  io_close(&conn->io);
+  daemon_session *session = conn->session;
+  if (session != NULL) {
+    session->conn = NULL;
+    lwsl_notice("session %.8s detached, pid: %d\n", session->info.id, session->process->pid);
+    if (!stopping) uv_timer_start(session->timer, detached_timer_cb, SESSIOND_DETACHED_TIMEOUT, 0);
+    if (!stopping && history_size > 0) {
+      session->history = history_init(history_size);
+      pty_resume(session->process);
+    }
+  }
+  free(conn);
+}
+
+// the blocks go as they are, the front end inflates them when it sends them on
+static void queue_history(frame_io *io, history_t *history) {
+  history_seal(history);
+  char *payload = xmalloc(sizeof(uint32_t) + HISTORY_BLOCK_SIZE);
+  for (history_block *block = history->head; block != NULL; block = block->next) {
+    memcpy(payload, &block->raw_len, sizeof(uint32_t));
+    // a block the spill file lost is skipped
+    if (!history_block_copy(history, block, payload + sizeof(uint32_t))) continue;
+    io_queue(io, SESSIOND_HISTORY, payload, sizeof(uint32_t) + block->len, -1);
+  }
+  free(payload);
+}
+
+static void conn_cb(uv_poll_t *handle, int status, int events);
+
+// send what is queued without waiting, false if the connection was freed
+static bool conn_flush(daemon_conn *conn) {
+  if (!io_flush(&conn->io)) {
+    lwsl_warn("session daemon: failed to send to the front end: %s\n", strerror(errno));
+    conn_free(conn);
+    return false;
+  }
+  if (conn->closing && conn->io.out == NULL) {
+    conn_free(conn);
+    return false;
+  }
+  io_poll(&conn->io, !conn->closing, conn_cb);
+  return true;
+}
+
+// the session goes out once the history was sent
+static void conn_bind(daemon_conn *conn, daemon_session *session) {
+  uv_timer_stop(session->timer);
+  session->conn = conn;
+  conn->session = session;
+  if (session->history != NULL) {
+    // the front end reads from now on
+    pty_pause(session->process);
+    lwsl_notice("session %.8s kept %zu bytes of output in %zu bytes, dropped: %llu\n", session->info.id,
+                session->history->raw_len, session->history->mem_len, (unsigned long long)session->history->dropped);
+    queue_history(&conn->io, session->history);
+    history_free(session->history);
+    session->history = NULL;
+  }
+  io_queue(&conn->io, SESSIOND_SESSION, &session->info, sizeof(upgrade_session), session->process->pty);
+}
+
+// the front end reads the pty, the daemon only while it is detached
+static void daemon_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
+  daemon_session *session = (daemon_session *)process->ctx;
+  if (session->history != NULL && buf != NULL) {
+    history_append(session->history, buf->base, buf->len);
+    pty_resume(process);
+  }
+  pty_buf_free(buf);
+}
+
+static void daemon_exit_cb(pty_process *process) {
+  daemon_session *session = (daemon_session *)process->ctx;
+  lwsl_notice("process exited with code %d, pid: %d, session: %.8s\n", process->exit_code, process->pid,
+              session->info.id);
+  if (session->conn != NULL) {
+    daemon_conn *conn = session->conn;
+    int32_t status[2] = {process->exit_code, process->exit_signal};
+    io_queue(&conn->io, SESSIOND_EXIT, status, sizeof(status), -1);
+    conn->session = NULL;
+    conn->closing = true;
+    conn_flush(conn);
+  }
+
+  for (daemon_session **p = &sessions; *p != NULL; p = &(*p)->next) {
+    if (*p != session) continue;
+    *p = session->next;
+    break;
+  }
+  uv_timer_stop(session->timer);
+  uv_close((uv_handle_t *)session->timer, close_cb);
+  history_free(session->history);
+  free(session->strings);
+  free(session);
+  if (stopping && sessions == NULL) uv_stop(loop);
+}
+
+static int daemon_spawn(daemon_conn *conn, char *payload, uint32_t len) {
+  spawn_request req;
+  if (len < sizeof(req)) return EINVAL;
+  memcpy(&req, payload, sizeof(req));
+  if (req.argc == 0 || req.argc > SESSIOND_MAX_STRINGS || req.envc > SESSIOND_MAX_STRINGS) return EINVAL;
+  req.session.id[SESSION_ID_LEN] = '\0';
+  req.session.user[sizeof(req.session.user) - 1] = '\0';
+  if (strlen(req.session.id) != SESSION_ID_LEN) return EINVAL;
+  for (daemon_session *s = sessions; s != NULL; s = s->next) {
+    if (strcmp(s->info.id, req.session.id) == 0) return EEXIST;
+  }
+#ifdef TTYD_FAKE_PTY
+  if (fake_pty_enabled()) return ENOTSUP;
+#endif
+
+  // payload is NUL terminated, so is its last string
+  size_t size = len - sizeof(req);
+  char *strings = xmalloc(size + 1);
+  memcpy(strings, payload + sizeof(req), size + 1);
+  char *p = strings, *end = strings + size;
+  char **argv = xmalloc((req.argc + 1) * sizeof(char *));
+  char **envp = xmalloc((req.envc + 1) * sizeof(char *));
+  memset(envp, 0, (req.envc + 1) * sizeof(char *));
+  char *cwd = next_string(&p, end);
+  bool ok = cwd != NULL;
+  for (uint32_t i = 0; ok && i < req.argc; i++) ok = (argv[i] = next_string(&p, end)) != NULL;
+  for (uint32_t i = 0; ok && i < req.envc; i++) {
+    char *s = next_string(&p, end);
+    ok = s != NULL;
+    if (ok) envp[i] = strdup(s);
+  }
+  argv[req.argc] = NULL;
+  if (!ok) {
+    free(argv);
+    for (uint32_t i = 0; i < req.envc; i++) free(envp[i]);
+    free(envp);
+    free(strings);
+    return EINVAL;
+  }
+
+  daemon_session *session = xmalloc(sizeof(daemon_session));
+  memset(session, 0, sizeof(daemon_session));
+  pty_process *process = process_init((void *)session, loop, argv, envp);
+  if (strlen(cwd) > 0) process->cwd = strdup(cwd);
+  if (req.session.columns > 0) process->columns = req.session.columns;
+  if (req.session.rows > 0) process->rows = req.session.rows;
+
+  int err = pty_spawn(process, daemon_read_cb, daemon_exit_cb);
+  if (err != 0) {
+    lwsl_err("pty_spawn: %d (%s)\n", -err, strerror(-err));
+    process_free(process);
+    free(process);
+    free(strings);
+    free(session);
+    return -err;
+  }
+
+  session->process = process;
+  session->strings = strings;
+  session->info = req.session;
+  session->info.pid = process->pid;
+  session->info.columns = process->columns;
+  session->info.rows = process->rows;
+  session->info.fd = -1;
+  session->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, session->timer);
+  session->timer->data = session;
+  session->next = sessions;
+  sessions = session;
+  lwsl_notice("started process, pid: %d, session: %.8s\n", process->pid, session->info.id);
+  conn_bind(conn, session);
+  return 0;
+}
+
+static int daemon_attach(daemon_conn *conn, char *payload, uint32_t len) {
+  upgrade_session req;
+  if (len != sizeof(req)) return EINVAL;
+  memcpy(&req, payload, sizeof(req));
+  req.id[SESSION_ID_LEN] = '\0';
+  req.user[sizeof(req.user) - 1] = '\0';
+
+  daemon_session *session = sessions;
+  while (session != NULL && (strcmp(session->info.id, req.id) != 0 || strcmp(session->info.user, req.user) != 0))
+    session = session->next;
+  // a session in use stays with its front end
+  if (session == NULL || session->conn != NULL) return ENOENT;
+
+  // the front ends resize the pty themselves
+  struct winsize size;
+  if (ioctl(session->process->pty, TIOCGWINSZ, &size) == 0) {
+    session->info.columns = size.ws_col;
+    session->info.rows = size.ws_row;
+  }
+  lwsl_notice("session %.8s attached, pid: %d\n", session->info.id, session->process->pid);
+  conn_bind(conn, session);
+  return 0;
+}
+
+static void conn_request(daemon_conn *conn, frame_header *header, char *payload) {
+  int err = 0;
+  if (conn->session == NULL && header->type == SESSIOND_SPAWN) {
+    err = daemon_spawn(conn, payload, header->len);
+  } else if (conn->session == NULL && header->type == SESSIOND_ATTACH) {
+    err = daemon_attach(conn, payload, header->len);
+  } else if (conn->session != NULL && header->type == SESSIOND_KILL && header->len == sizeof(int32_t)) {
+    int32_t sig;
+    memcpy(&sig, payload, sizeof(sig));
+    pty_kill(conn->session->process, sig);
+  } else {
+    lwsl_warn("session daemon: unexpected request: %d\n", header->type);
+    conn->closing = true;
+  }
+
+  if (err != 0) {
+    int32_t value = err;
+    io_queue(&conn->io, SESSIOND_ERROR, &value, sizeof(value), -1);
+    conn->closing = true;
+  }
+}
+
+// nothing waits on a front end, a request is handled once all of it arrived
+static void conn_cb(uv_poll_t *handle, int status, int events) {
+  daemon_conn *conn = (daemon_conn *)handle->data;
+  if (status != 0) {
+    conn_free(conn);
+    return;
+  }
+  while (!conn->closing && (events & UV_READABLE)) {
+    frame_header header;
+    char *payload;
+    int fd;
+    int ret = io_read(&conn->io, &header, &payload, &fd);
+    if (ret == 0) break;
+    if (ret < 0) {
+      conn_free(conn);
+      return;
+    }
+    if (fd >= 0) close(fd);
+    conn_request(conn, &header, payload);
+    free(payload);
+  }
+  conn_flush(conn);
+}
+
+static void accept_cb(uv_poll_t *handle, int status, int events) {
+  if (status != 0) return;
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) lwsl_warn("accept: %s\n", strerror(errno));
+      return;
+    }
+    set_cloexec(fd);
+    set_nonblock(fd);
+
+    daemon_conn *conn = xmalloc(sizeof(daemon_conn));
+    io_init(&conn->io, loop, fd, conn);
+    conn->session = NULL;
+    conn->closing = false;
+    io_poll(&conn->io, true, conn_cb);
+  }
+}
+
+static void signal_cb(uv_signal_t *watcher, int signum) {
+  if (stopping) exit(EXIT_FAILURE);
+  stopping = true;
+  lwsl_notice("received signal: %d, killing the sessions and exiting...\n", signum);
+  lwsl_notice("send ^C to force exit.\n");
+
+  uv_poll_stop(accept_poll);
+  uv_close((uv_handle_t *)accept_poll, close_cb);
+  close(listener);
+  unlink(socket_path);
+  for (daemon_session *s = sessions; s != NULL; s = s->next) pty_kill(s->process, kill_sig);
+  if (sessions == NULL) uv_stop(loop);
+}
+
+int sessiond_run(uv_loop_t *l, const char *path, int sig, size_t size) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ttyd: session socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    fprintf(stderr, "ttyd: socket: %s\n", strerror(errno));
+    return 1;
+  }
+  // a daemon that is gone leaves its socket behind, a running one must be left alone
+  if (connect(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "ttyd: a session daemon is already running on %s\n", path);
+    close(listener);
+    return 1;
+  }
+  close(listener);
+  unlink(path);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t mask = umask(0077);  // only the user of the daemon may spawn processes with it
+  int ret = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (ret != 0 || listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "ttyd: can not listen on %s: %s\n", path, strerror(errno));
+    close(listener);
+    return 1;
+  }
+  set_cloexec(listener);
+  set_nonblock(listener);
+  signal(SIGPIPE, SIG_IGN);
+
+  loop = l;
+  socket_path = path;
+  kill_sig = sig;
+  history_size = size;
+  accept_poll = xmalloc(sizeof(uv_poll_t));
+  uv_poll_init(loop, accept_poll, listener);
+  uv_poll_start(accept_poll, UV_READABLE, accept_cb);
+
+#define sig_count 2
+  int sig_nums[] = {SIGINT, SIGTERM};
+  uv_signal_t signals[sig_count];
+  for (int i = 0; i < sig_count; i++) {
+    uv_signal_init(loop, &signals[i]);
+    uv_signal_start(&signals[i], signal_cb, sig_nums[i]);
+  }
+
+  lwsl_notice("session daemon listening on %s\n", path);
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  for (int i = 0; i < sig_count; i++) {
+    uv_signal_stop(&signals[i]);
+    uv_close((uv_handle_t *)&signals[i], NULL);
+  }
+#undef sig_count
+  uv_run(loop, UV_RUN_NOWAIT);
+  return 0;
+}
+
+// the connection is non-blocking from the start, a daemon that can not accept it now is an error
+static int connect_daemon(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  set_cloexec(fd);
+  set_nonblock(fd);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static void client_free(sessiond_client *client) {
+  io_close(&client->io);
+  if (client->timer != NULL) {
+    uv_timer_stop(client->timer);
+    uv_close((uv_handle_t *)client->timer, close_cb);
+  }
+  history_free(client->history);
+  free(client);
+}
+
+// hand the reply over, session is NULL unless err is 0
+static void request_done(sessiond_client *client, int err, upgrade_session *session) {
+  uv_timer_stop(client->timer);
+  uv_close((uv_handle_t *)client->timer, close_cb);
+  client->timer = NULL;
+  uv_poll_stop(client->io.poll);
+  sessiond_request_cb cb = client->request_cb;
+  void *ctx = client->request_ctx;
+  history_t *history = client->history;
+  client->request_cb = NULL;
+  client->history = NULL;
+
+  if (cb == NULL) {
+    // canceled, a process started for nobody is killed
+    if (err == 0 && client->type == SESSIOND_SPAWN) sessiond_kill(client, SIGKILL);
+    if (err == 0) close(session->fd);
+    history_free(history);
+    client_free(client);
+  } else if (err != 0) {
+    history_free(history);
+    client_free(client);
+    cb(ctx, NULL, NULL, NULL, err);
+  } else {
+    cb(ctx, client, session, history, 0);
+  }
+}
+
+static void request_timer_cb(uv_timer_t *timer) { request_done((sessiond_client *)timer->data, ETIMEDOUT, NULL); }
+
+static void reply_cb(uv_poll_t *handle, int status, int events) {
+  sessiond_client *client = (sessiond_client *)handle->data;
+  if (status != 0) {
+    request_done(client, -status, NULL);
+    return;
+  }
+  if ((events & UV_WRITABLE) && !io_flush(&client->io)) {
+    request_done(client, errno, NULL);
+    return;
+  }
+
+  frame_header header;
+  char *reply;
+  int master, ret;
+  while ((ret = io_read(&client->io, &header, &reply, &master)) > 0) {
+    if (header.type == SESSIOND_HISTORY && client->type == SESSIOND_ATTACH && header.len > sizeof(uint32_t)) {
+      // the daemon kept it within its limit already
+      if (client->history == NULL) client->history = history_init(SIZE_MAX);
+      uint32_t raw_len;
+      memcpy(&raw_len, reply, sizeof(raw_len));
+      history_add_block(client->history, reply + sizeof(raw_len), header.len - sizeof(raw_len), raw_len);
+      free(reply);
+      if (master >= 0) close(master);
+      continue;
+    }
+
+    upgrade_session session;
+    int err = EPROTO;
+    if (header.type == SESSIOND_SESSION && header.len == sizeof(upgrade_session) && master >= 0) {
+      memcpy(&session, reply, sizeof(upgrade_session));
+      session.id[SESSION_ID_LEN] = '\0';
+      session.user[sizeof(session.user) - 1] = '\0';
+      session.fd = master;
+      master = -1;
+      err = 0;
+    } else if (header.type == SESSIOND_ERROR && header.len == sizeof(int32_t)) {
+      int32_t value;
+      memcpy(&value, reply, sizeof(value));
+      err = value;
+    }
+    free(reply);
+    if (master >= 0) close(master);
+    request_done(client, err, err == 0 ? &session : NULL);
+    return;
+  }
+  if (ret < 0) {
+    request_done(client, errno, NULL);
+    return;
+  }
+  io_poll(&client->io, true, reply_cb);
+}
+
+// send the request, the reply comes to cb on the loop; NULL with errno set if the daemon can not be reached
+static sessiond_client *request(uv_loop_t *l, const char *path, uint8_t type, const void *payload, uint32_t len,
+                                sessiond_request_cb cb, void *ctx) {
+  int fd = connect_daemon(path);
+  if (fd < 0) return NULL;
+
+  sessiond_client *client = xmalloc(sizeof(sessiond_client));
+  memset(client, 0, sizeof(sessiond_client));
+  io_init(&client->io, l, fd, client);
+  client->type = type;
+  client->request_cb = cb;
+  client->request_ctx = ctx;
+  client->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(l, client->timer);
+  client->timer->data = client;
+
+  io_queue(&client->io, type, payload, len, -1);
+  if (!io_flush(&client->io)) {
+    int err = errno;
+    client_free(client);
+    errno = err;
+    return NULL;
+  }
+  uv_timer_start(client->timer, request_timer_cb, SESSIOND_TIMEOUT, 0);
+  io_poll(&client->io, true, reply_cb);
+  return client;
+}
+
+sessiond_client *sessiond_spawn(uv_loop_t *l, const char *path, upgrade_session *session, char **argv, char **envp,
+                                const char *cwd, sessiond_request_cb cb, void *ctx) {
+  spawn_request req;
+  memset(&req, 0, sizeof(req));
+  req.session = *session;
+  req.session.fd = -1;
+
+  size_t len = sizeof(req) + strlen(cwd != NULL ? cwd : "") + 1;
+  for (char **p = argv; *p != NULL; p++, req.argc++) len += strlen(*p) + 1;
+  for (char **p = envp; p != NULL && *p != NULL; p++, req.envc++) len += strlen(*p) + 1;
+  if (len > SESSIOND_MAX_PAYLOAD) {
+    errno = E2BIG;
+    return NULL;
+  }
+
+  char *payload = xmalloc(len);
+  memcpy(payload, &req, sizeof(req));
+  char *p = payload + sizeof(req);
+  p = stpcpy(p, cwd != NULL ? cwd : "") + 1;
+  for (char **s = argv; *s != NULL; s++) p = stpcpy(p, *s) + 1;
+  for (char **s = envp; s != NULL && *s != NULL; s++) p = stpcpy(p, *s) + 1;
+
+  sessiond_client *client = request(l, path, SESSIOND_SPAWN, payload, (uint32_t)len, cb, ctx);
+  free(payload);
+  return client;
+}
+
+sessiond_client *sessiond_attach(uv_loop_t *l, const char *path, upgrade_session *session, sessiond_request_cb cb,
+                                 void *ctx) {
+  upgrade_session req = *session;
+  req.fd = -1;
+  return request(l, path, SESSIOND_ATTACH, &req, sizeof(req), cb, ctx);
+}
+
+void sessiond_cancel(sessiond_client *client) {
+  sessiond_request_cb cb = client->request_cb;
+  void *ctx = client->request_ctx;
+  client->request_cb = NULL;
+  if (cb != NULL) cb(ctx, NULL, NULL, NULL, ECANCELED);
+}
+
+static void client_cb(uv_poll_t *handle, int status, int events) {
+  sessiond_client *client = (sessiond_client *)handle->data;
+  frame_header header;
+  char *payload;
+  int fd, ret = -1;
+  int32_t exit_status[2] = {-1, 0};
+  if (status == 0 && (!(events & UV_WRITABLE) || io_flush(&client->io)))
+    ret = io_read(&client->io, &header, &payload, &fd);
+  if (ret == 0) {
+    io_poll(&client->io, true, client_cb);
+    return;
+  }
+  if (ret > 0) {
+    if (fd >= 0) close(fd);
+    if (header.type == SESSIOND_EXIT && header.len == sizeof(exit_status))
+      memcpy(exit_status, payload, sizeof(exit_status));
+    free(payload);
+  }
+
+  sessiond_exit_cb cb = client->cb;
+  void *ctx = client->ctx;
+  client_free(client);
+  cb(ctx, exit_status[0], exit_status[1]);
+}
+
+void sessiond_watch(sessiond_client *client, sessiond_exit_cb cb, void *ctx) {
+  client->cb = cb;
+  client->ctx = ctx;
+  io_poll(&client->io, true, client_cb);
+}
+
+// sent without waiting, what the socket does not take now goes once it is writable
+bool sessiond_kill(sessiond_client *client, int sig) {
+  int32_t value = sig;
+  io_queue(&client->io, SESSIOND_KILL, &value, sizeof(value), -1);
+  if (!io_flush(&client->io)) return false;
+  if (client->cb != NULL) io_poll(&client->io, true, client_cb);
+  return true;
+}
+
+void sessiond_close(sessiond_client *client) { client_free(client); }
@@ -0,0 +1,40 @@
+#ifndef TTYD_SESSIOND_H
+#define TTYD_SESSIOND_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+#include "history.h"
+#include "upgrade.h"
+
+// the connection of a front end to the session daemon for one session, it lives as long as the session is attached
+typedef struct sessiond_client_ sessiond_client;
+// exit_code is -1 if the daemon went away
+typedef void (*sessiond_exit_cb)(void *ctx, int exit_code, int exit_signal);
+// the reply to a spawn or attach: the session with its pid, size and pty master filled in, and history, the output
+// the daemon kept for it, NULL if none; client, session and history are NULL if err is set, ECANCELED by
+// sessiond_cancel
+typedef void (*sessiond_request_cb)(void *ctx, sessiond_client *client, upgrade_session *session, history_t *history,
+                                    int err);
+
+// Session daemon: own the processes and serve the front ends on path, until SIGINT/SIGTERM, a detached session keeps
+// history_size bytes of its output
+int sessiond_run(uv_loop_t *loop, const char *path, int sig, size_t history_size);
+
+// Front end: ask for argv to run in a new session with the id, user and size of session, the reply comes to cb on the
+// loop; NULL with errno set if the daemon can not be reached
+sessiond_client *sessiond_spawn(uv_loop_t *loop, const char *path, upgrade_session *session, char **argv, char **envp,
+                                const char *cwd, sessiond_request_cb cb, void *ctx);
+// Front end: ask to take over the detached session with the id and user of session, the reply comes to cb on the loop
+sessiond_client *sessiond_attach(uv_loop_t *loop, const char *path, upgrade_session *session, sessiond_request_cb cb,
+                                 void *ctx);
+// Drop a request waiting for its reply, a process spawned for it is killed once it arrives
+void sessiond_cancel(sessiond_client *client);
+// Call cb once the process exited
+void sessiond_watch(sessiond_client *client, sessiond_exit_cb cb, void *ctx);
+// Signal the process group
+bool sessiond_kill(sessiond_client *client, int sig);
+// Detach, the session waits in the daemon for a front end to take it over
+void sessiond_close(sessiond_client *client);
+
+#endif  // TTYD_SESSIOND_H
@@ -0,0 +1,227 @@
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define UPGRADE_ENV "TTYD_UPGRADE_FD"
+#define UPGRADE_MAGIC 0x54545944  // TTYD
+// time the new process has to take over (ms)
+#define UPGRADE_TIMEOUT 10000
+#define UPGRADE_MAX_SESSIONS 65536
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// the first message, carrying the listener, the sessions follow one per message
+typedef struct {
+  uint32_t magic;
+  uint32_t count;
+} upgrade_header;
+
+static int listen_fd = -1;      // inherited listener, -1 if lws created it
+static int lws_listen_fd = -1;  // created by lws, found by upgrade_find_listener
+static int channel = -1;    // to the old process, until upgrade_ready
+static uv_poll_t *poller = NULL;
+static struct lws_vhost *listen_vhost;
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static bool set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  return flags >= 0 && fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1;
+}
+
+static bool send_fd(int sock, const void *data, size_t len, int fd) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {(void *)data, len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t n;
+  do n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  return n == (ssize_t)len;
+}
+
+static bool recv_fd(int sock, void *data, size_t len, int *fd) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {data, len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do n = recvmsg(sock, &msg, MSG_WAITALL);
+  while (n < 0 && errno == EINTR);
+  if (n != (ssize_t)len) return false;
+
+  *fd = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    set_cloexec(*fd);
+  }
+  return *fd >= 0;
+}
+
+// lws watches its sockets with poll handles on our loop, the listener is the one accepting connections
+static void walk_cb(uv_handle_t *handle, void *arg) {
+  uv_os_fd_t fd;
+  int value = 0;
+  socklen_t len = sizeof(value);
+  if (handle->type != UV_POLL || uv_fileno(handle, &fd) != 0) return;
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) == 0 && value) *(int *)arg = fd;
+}
+
+void upgrade_find_listener(uv_loop_t *loop) {
+  if (listen_fd < 0) uv_walk(loop, walk_cb, &lws_listen_fd);
+}
+
+bool upgrade_exec(char **argv, upgrade_session *sessions, int count) {
+  int fd = listen_fd >= 0 ? listen_fd : lws_listen_fd;
+  if (fd < 0) {
+    lwsl_err("upgrade: listening socket not found\n");
+    return false;
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    lwsl_err("upgrade: socketpair: %s\n", strerror(errno));
+    return false;
+  }
+  set_cloexec(sv[0]);
+
+  // prepared before the fork, the child only execs
+  char env[32];
+  snprintf(env, sizeof(env), "%s=%d", UPGRADE_ENV, sv[1]);
+  pid_t pid = fork();
+  if (pid < 0) {
+    lwsl_err("upgrade: fork: %s\n", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+  if (pid == 0) {
+    putenv(env);
+    execvp(argv[0], argv);
+    perror("ttyd: upgrade exec failed");
+    _exit(1);
+  }
+  close(sv[1]);
+
+  upgrade_header header = {UPGRADE_MAGIC, (uint32_t)count};
+  bool ok = send_fd(sv[0], &header, sizeof(header), fd);
+  for (int i = 0; ok && i < count; i++) ok = send_fd(sv[0], &sessions[i], sizeof(upgrade_session), sessions[i].fd);
+
+  // the new process acks once it listens and owns the sessions
+  char ack = 0;
+  struct pollfd pfd = {sv[0], POLLIN, 0};
+  ok = ok && poll(&pfd, 1, UPGRADE_TIMEOUT) == 1 && read(sv[0], &ack, 1) == 1 && ack == 'R';
+  close(sv[0]);
+  if (!ok) {
+    lwsl_err("upgrade: new process did not take over, pid: %d\n", pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return false;
+  }
+
+  lwsl_notice("upgrade: handed over %d sessions to the new process, pid: %d\n", count, pid);
+  return true;
+}
+
+bool upgrade_started() { return getenv(UPGRADE_ENV) != NULL; }
+
+bool upgrade_receive(upgrade_session **sessions, int *count) {
+  channel = atoi(getenv(UPGRADE_ENV));
+  unsetenv(UPGRADE_ENV);
+  set_cloexec(channel);
+
+  upgrade_header header;
+  if (!recv_fd(channel, &header, sizeof(header), &listen_fd) || header.magic != UPGRADE_MAGIC ||
+      header.count > UPGRADE_MAX_SESSIONS) {
+    fprintf(stderr, "ttyd: invalid upgrade handoff\n");
+    return false;
+  }
+
+  *sessions = xmalloc((header.count + 1) * sizeof(upgrade_session));
+  *count = 0;
+  for (uint32_t i = 0; i < header.count; i++) {
+    upgrade_session *session = &(*sessions)[*count];
+    if (!recv_fd(channel, session, sizeof(upgrade_session), &session->fd)) {
+      fprintf(stderr, "ttyd: incomplete upgrade handoff, %d of %u sessions\n", *count, header.count);
+      return false;
+    }
+    session->id[SESSION_ID_LEN] = '\0';
+    session->user[sizeof(session->user) - 1] = '\0';
+    (*count)++;
+  }
+  return true;
+}
+
+static void accept_cb(uv_poll_t *handle, int status, int events) {
+  if (status != 0) return;
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) lwsl_warn("accept: %s\n", strerror(errno));
+      return;
+    }
+    set_cloexec(fd);
+    // lws closes the socket if it can not adopt it
+    lws_adopt_socket_vhost(listen_vhost, fd);
+  }
+}
+
+void upgrade_listen(uv_loop_t *loop, struct lws_vhost *vhost) {
+  int flags = fcntl(listen_fd, F_GETFL);
+  if (flags >= 0) fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+  listen_vhost = vhost;
+  poller = xmalloc(sizeof(uv_poll_t));
+  uv_poll_init(loop, poller, listen_fd);
+  uv_poll_start(poller, UV_READABLE, accept_cb);
+}
+
+void upgrade_ready() {
+  if (channel < 0) return;
+  char ack = 'R';
+  if (write(channel, &ack, 1) != 1) lwsl_warn("upgrade: failed to notify the old process\n");
+  close(channel);
+  channel = -1;
+}
+
+void upgrade_free() {
+  if (poller != NULL) {
+    uv_poll_stop(poller);
+    uv_close((uv_handle_t *)poller, close_cb);
+    poller = NULL;
+  }
+  if (listen_fd >= 0) close(listen_fd);
+  listen_fd = -1;
+}
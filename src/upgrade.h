@@ -0,0 +1,37 @@
+#ifndef TTYD_UPGRADE_H
+#define TTYD_UPGRADE_H
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+// hex characters of a session id
+#define SESSION_ID_LEN 32
+
+// a session handed over to the new ttyd on upgrade, fd is its pty master
+typedef struct {
+  char id[SESSION_ID_LEN + 1];
+  char user[30];
+  int pid;
+  uint16_t columns;
+  uint16_t rows;
+  int fd;
+} upgrade_session;
+
+// Old process: record the socket lws listens on, once the vhost is created
+void upgrade_find_listener(uv_loop_t *loop);
+// Old process: run argv as the new ttyd and hand it the listener and the sessions, true once it took over
+bool upgrade_exec(char **argv, upgrade_session *sessions, int count);
+
+// New process: whether it was started by upgrade_exec
+bool upgrade_started();
+// Receive the listener and the sessions, false if the handoff failed
+bool upgrade_receive(upgrade_session **sessions, int *count);
+// Accept the connections of the inherited listener on the vhost
+void upgrade_listen(uv_loop_t *loop, struct lws_vhost *vhost);
+// Tell the old process to exit
+void upgrade_ready();
+void upgrade_free();
+
+#endif  // TTYD_UPGRADE_H
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +38,135 @@ void *xrealloc(void *p, size_t size) {
   return p;
 }
 
+#ifdef TTYD_ALLOC_STATS
+#define ALLOC_SITES 512
+
+// counters of one call site, keyed by the __FILE__ pointer and line
+typedef struct {
+  const char *file;
+  int line;
+  uint64_t allocs;
+  uint64_t bytes;
+  uint64_t frees;
+  uint64_t steady;  // allocations after the warmup
+} alloc_site;
+
+static struct {
+  alloc_site sites[ALLOC_SITES];
+  uint64_t warmup;  // output bytes before the steady state
+  bool abort;       // abort on the first allocation in the steady state
+  bool steady;
+  uint64_t output_bytes;
+  uint64_t chunks;  // output chunks in the steady state
+  uint64_t steady_allocs;
+} alloc_stats;
+
+static alloc_site *alloc_site_get(const char *file, int line) {
+  size_t h = ((uintptr_t)file >> 3) * 31 + (size_t)line;
+  for (size_t i = 0; i < ALLOC_SITES; i++) {
+    alloc_site *site = &alloc_stats.sites[(h + i) % ALLOC_SITES];
+    if (site->file == file && site->line == line) return site;
+    if (site->file == NULL) {
+      site->file = file;
+      site->line = line;
+      return site;
+    }
+  }
+  return NULL;  // table full, not counted
+}
+
+static void alloc_count(size_t size, const char *file, int line) {
+  alloc_site *site = alloc_site_get(file, line);
+  if (site != NULL) {
+    site->allocs++;
+    site->bytes += size;
+  }
+  if (!alloc_stats.steady) return;
+  if (site != NULL) site->steady++;
+  alloc_stats.steady_allocs++;
+  if (alloc_stats.abort) {
+    fprintf(stderr, "ttyd: allocation of %zu bytes at %s:%d in the steady state\n", size, file, line);
+    abort();
+  }
+}
+
+void *xmalloc_at(size_t size, const char *file, int line) {
+  if (size > 0) alloc_count(size, file, line);
+  return xmalloc(size);
+}
+
+void *xrealloc_at(void *p, size_t size, const char *file, int line) {
+  if (size > 0) alloc_count(size, file, line);
+  return xrealloc(p, size);
+}
+
+void xfree_at(void *p, const char *file, int line) {
+  if (p == NULL) return;
+  alloc_site *site = alloc_site_get(file, line);
+  if (site != NULL) site->frees++;
+  free(p);
+}
+
+// spec: comma separated options, eg: warmup=1048576,abort
+bool alloc_stats_init(const char *spec) {
+  char *copy = strdup(spec), *save = NULL;
+  bool ok = true;
+
+  for (char *opt = strtok_r(copy, ",", &save); opt != NULL && ok; opt = strtok_r(NULL, ",", &save)) {
+    if (strcmp(opt, "abort") == 0) {
+      alloc_stats.abort = true;
+    } else if (strncmp(opt, "warmup=", 7) == 0) {
+      alloc_stats.warmup = strtoull(opt + 7, NULL, 0);
+    } else {
+      ok = false;
+    }
+  }
+  free(copy);
+  if (!ok) fprintf(stderr, "ttyd: invalid alloc stats spec: %s\n", spec);
+  return ok;
+}
+
+void alloc_stats_output(size_t bytes) {
+  alloc_stats.output_bytes += bytes;
+  if (alloc_stats.steady) {
+    alloc_stats.chunks++;
+  } else if (alloc_stats.warmup > 0 && alloc_stats.output_bytes >= alloc_stats.warmup) {
+    fprintf(stderr, "ttyd: alloc stats: warmup done after %llu output bytes\n",
+            (unsigned long long)alloc_stats.output_bytes);
+    alloc_stats.steady = true;
+  }
+}
+
+static int site_cmp(const void *a, const void *b) {
+  const alloc_site *x = a, *y = b;
+  if (x->steady != y->steady) return x->steady < y->steady ? 1 : -1;
+  if (x->allocs != y->allocs) return x->allocs < y->allocs ? 1 : -1;
+  return 0;
+}
+
+void alloc_stats_report() {
+  alloc_site sites[ALLOC_SITES];
+  size_t n = 0;
+  for (size_t i = 0; i < ALLOC_SITES; i++) {
+    if (alloc_stats.sites[i].file != NULL) sites[n++] = alloc_stats.sites[i];
+  }
+  qsort(sites, n, sizeof(alloc_site), site_cmp);
+
+  fprintf(stderr, "%-32s %12s %14s %12s %12s\n", "call site", "allocs", "bytes", "frees", "steady");
+  for (size_t i = 0; i < n; i++) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s:%d", sites[i].file, sites[i].line);
+    fprintf(stderr, "%-32s %12llu %14llu %12llu %12llu\n", name, (unsigned long long)sites[i].allocs,
+            (unsigned long long)sites[i].bytes, (unsigned long long)sites[i].frees, (unsigned long long)sites[i].steady);
+  }
+  if (alloc_stats.steady) {
+    fprintf(stderr, "steady state: %llu allocations in %llu output chunks (%.3f per chunk)\n",
+            (unsigned long long)alloc_stats.steady_allocs, (unsigned long long)alloc_stats.chunks,
+            alloc_stats.chunks > 0 ? (double)alloc_stats.steady_allocs / alloc_stats.chunks : 0);
+  }
+}
+#endif
+
 char *uppercase(char *s) {
   while(*s) {
     *s = (char)toupper((int)*s);
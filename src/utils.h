@@ -13,6 +13,28 @@ void *xmalloc(size_t size);
 // realloc with NULL check
 void *xrealloc(void *p, size_t size);
 
+#ifdef TTYD_ALLOC_STATS
+// debug build: count the allocations of every call site, see alloc_stats_report
+#include <stdlib.h>
+
+void *xmalloc_at(size_t size, const char *file, int line);
+void *xrealloc_at(void *p, size_t size, const char *file, int line);
+void xfree_at(void *p, const char *file, int line);
+
+// Parse the --alloc-stats spec
+bool alloc_stats_init(const char *spec);
+
+// Count an output chunk, the steady state starts after the warmup bytes
+void alloc_stats_output(size_t bytes);
+
+// Print the counters of every call site to stderr
+void alloc_stats_report();
+
+#define xmalloc(size) xmalloc_at(size, __FILE__, __LINE__)
+#define xrealloc(p, size) xrealloc_at(p, size, __FILE__, __LINE__)
+#define free(p) xfree_at(p, __FILE__, __LINE__)
+#endif
+
 // Convert a string to upper case
 char *uppercase(char *s);
 
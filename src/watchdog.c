@@ -0,0 +1,118 @@
+#include "watchdog.h"
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+static uv_loop_t *loop = NULL;
+static uv_prepare_t *prepare = NULL;
+static uv_check_t *check = NULL;
+static uint64_t threshold;  // ns, 0 to only collect the histogram
+static bool idle_time;      // whether libuv reports the time blocked in poll
+static watchdog_scope *current = NULL;
+
+// current loop iteration, from one check to the next
+static uint64_t iteration_start;
+static uint64_t idle_start;
+static uint64_t poll_start;
+static uint64_t tracked;  // time spent in outermost tracked callbacks since poll started
+static const char *longest_name;  // longest tracked callback of the iteration
+static int longest_reason;
+static uint64_t longest_time;
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static void prepare_cb(uv_prepare_t *handle) {
+  poll_start = uv_hrtime();
+  tracked = 0;
+}
+
+static void check_cb(uv_check_t *handle) {
+  uint64_t now = uv_hrtime();
+  uint64_t busy;
+
+#if UV_VERSION_HEX >= 0x012700
+  if (idle_time) {
+    uint64_t idle = uv_metrics_idle_time(loop);
+    busy = now - iteration_start - (idle - idle_start);
+    idle_start = idle;
+  } else
+#endif
+  {
+    // the time blocked in poll is unknown, count what the tracked callbacks spent there
+    busy = poll_start - iteration_start + tracked;
+  }
+
+  metrics_observe(&metrics.loop_lag_seconds, busy / 1e9);
+  if (threshold > 0 && busy > threshold) {
+    metrics.loop_stalls_total++;
+    if (longest_name == NULL) {
+      lwsl_warn("event loop blocked for %.1f ms outside of tracked callbacks\n", busy / 1e6);
+    } else if (longest_reason >= 0) {
+      lwsl_warn("event loop blocked for %.1f ms, longest callback: %s (reason: %d) for %.1f ms\n", busy / 1e6,
+                longest_name, longest_reason, longest_time / 1e6);
+    } else {
+      lwsl_warn("event loop blocked for %.1f ms, longest callback: %s for %.1f ms\n", busy / 1e6, longest_name,
+                longest_time / 1e6);
+    }
+  }
+
+  iteration_start = now;
+  longest_name = NULL;
+  longest_time = 0;
+}
+
+void watchdog_init(uv_loop_t *l, int threshold_ms) {
+  loop = l;
+  threshold = (uint64_t)threshold_ms * 1000000;
+#if UV_VERSION_HEX >= 0x012700
+  idle_time = uv_loop_configure(loop, UV_METRICS_IDLE_TIME) == 0;
+#endif
+
+  prepare = xmalloc(sizeof(uv_prepare_t));
+  uv_prepare_init(loop, prepare);
+  uv_prepare_start(prepare, prepare_cb);
+  uv_unref((uv_handle_t *)prepare);
+
+  check = xmalloc(sizeof(uv_check_t));
+  uv_check_init(loop, check);
+  uv_check_start(check, check_cb);
+  uv_unref((uv_handle_t *)check);
+
+  iteration_start = poll_start = uv_hrtime();
+}
+
+void watchdog_free() {
+  if (loop == NULL) return;
+  uv_prepare_stop(prepare);
+  uv_close((uv_handle_t *)prepare, close_cb);
+  uv_check_stop(check);
+  uv_close((uv_handle_t *)check, close_cb);
+  loop = NULL;
+}
+
+void watchdog_enter(watchdog_scope *scope, const char *name, int reason) {
+  if (loop == NULL) return;
+  scope->name = name;
+  scope->reason = reason;
+  scope->start = uv_hrtime();
+  scope->prev = current;
+  current = scope;
+}
+
+void watchdog_leave(watchdog_scope *scope) {
+  if (loop == NULL || current != scope) return;
+  uint64_t elapsed = uv_hrtime() - scope->start;
+  current = scope->prev;
+
+  // nested time is part of the outer callback already
+  if (current == NULL) tracked += elapsed;
+  if (elapsed > longest_time) {
+    longest_name = scope->name;
+    longest_reason = scope->reason;
+    longest_time = elapsed;
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef TTYD_WATCHDOG_H
+#define TTYD_WATCHDOG_H
+
+#include <stdint.h>
+#include <uv.h>
+
+// a callback tracked by the watchdog, lives on the stack of the callback
+typedef struct watchdog_scope_ {
+  const char *name;
+  int reason;
+  uint64_t start;
+  struct watchdog_scope_ *prev;
+} watchdog_scope;
+
+void watchdog_init(uv_loop_t *loop, int threshold_ms);
+void watchdog_free();
+void watchdog_enter(watchdog_scope *scope, const char *name, int reason);
+void watchdog_leave(watchdog_scope *scope);
+
+#endif  // TTYD_WATCHDOG_H